@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Motor axes driven by this controller (the main capacitor, plus e.g. a coupling
+// loop or a second capacitor). Each axis has its own step timer and ISR, FSM
+// context, pulse delays, trajectory buffer and telemetry stream. The pins and
+// limits are compile-time descriptors: the step ISR is instantiated per axis
+// with its pins as constants, so nothing in the step path looks the axis up.
+// Every per-axis array is sized by AXIS_COUNT, so a one-axis build costs what
+// it did before.
+//
+// Commands select the axis in param bits 28-31 and carry their value in bits
+// 0-27 (sign-extended). Nibble 0xF also means axis 0, so a GUI that knows
+// nothing about axes keeps driving axis 0 with plain params, negative ones
+// included. Replies about axis 1 and up carry the axis the same way; replies
+// about axis 0 are unchanged.
+
+#ifndef STEPPER_AXIS_COUNT
+#define STEPPER_AXIS_COUNT 1
+#endif
+
+// Pulse delays (microseconds per half-pulse) for the jog speeds and move-to.
+// The runtime copies live in pulse_delays[] (main.cpp) and are persisted by
+// config_store.
+struct PulseDelays {
+  long slow_pd;
+  long med_pd;
+  long fast_pd;
+  long moveto_pd;
+};
+
+struct AxisConfig {
+  uint8_t step_pin;
+  uint8_t dir_pin;
+  uint8_t enable_pin; // DM542 ENA, driven to release the motor at rest (power_policy.h)
+  uint8_t sensor_pin; // TCRT5000 D0, LOW = white mark
+  uint8_t analog_pin; // TCRT5000 A0 on an ADC1 pin, for profiled homing (sensor_profile.h)
+  uint8_t timer;      // hardware timer that runs the step ISR
+  int16_t min_pos;    // soft limits in steps
+  int16_t max_pos;
+  PulseDelays defaults; // until a GUI sets them
+};
+
+constexpr AxisConfig AXIS_CONFIGS[] = {
+  {19, 18, 21, 2, 34, 0, 0, 1600, {40, 20, 10, 10}}, // main capacitor
+  {23, 22, 25, 4, 35, 1, 0, 1600, {40, 20, 10, 10}}, // second motor (coupling loop or second capacitor)
+};
+
+// ESP32 hardware timers; also what the two axis bits in telemetry flags can name
+constexpr uint8_t AXIS_MAX = 4;
+constexpr uint8_t AXIS_COUNT = STEPPER_AXIS_COUNT;
+static_assert(AXIS_COUNT >= 1 && AXIS_COUNT <= sizeof(AXIS_CONFIGS) / sizeof(AXIS_CONFIGS[0]),
+              "every axis needs a descriptor in AXIS_CONFIGS");
+static_assert(AXIS_COUNT <= AXIS_MAX, "at most AXIS_MAX axes");
+
+constexpr uint8_t AXIS_PARAM_SHIFT = 28;
+constexpr uint8_t AXIS_PARAM_LEGACY = 0xF; // sign extension of a plain negative param
+constexpr int32_t AXIS_VALUE_MIN = -(1L << 27);
+constexpr int32_t AXIS_VALUE_MAX = (1L << 27) - 1;
+
+// Axis named by a command param; may be >= AXIS_COUNT (reject those)
+inline uint8_t axis_from_param(int32_t param)
+{
+  uint8_t axis = (uint8_t)((uint32_t)param >> AXIS_PARAM_SHIFT);
+  return axis == AXIS_PARAM_LEGACY ? 0 : axis;
+}
+
+// Value part of a command param
+inline int32_t axis_value(int32_t param)
+{
+  return (int32_t)((uint32_t)param << (32 - AXIS_PARAM_SHIFT)) >> (32 - AXIS_PARAM_SHIFT);
+}
+
+// Param for value on axis; axis 0 values go out unchanged
+inline int32_t axis_param(uint8_t axis, int32_t value)
+{
+  if (axis == 0) return value;
+  return (int32_t)(((uint32_t)axis << AXIS_PARAM_SHIFT) | ((uint32_t)value & ((1UL << AXIS_PARAM_SHIFT) - 1)));
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "stepper_commands.h"
+
+// Batch frames: several records in one ESP-NOW frame (up to 250 bytes) instead
+// of one frame, airtime slot and send callback per 6-byte Message.
+//
+//   BatchHeader (4 bytes), then `count` records of: uint8_t len, len bytes
+//
+// A record is any frame that could also go on air alone: a Message, a telemetry
+// frame, a PerfReport. Like the telemetry and report frames, byte 1 holds a
+// kind outside the command range, and a sizeof(Message) long batch is invalid, so
+// readers that only know Message frames drop every batch. Batches are only sent
+// to peers that announced HELLO_CAP_BATCH (handshake.h); single frames stay
+// valid in both directions. A reader skips batches with a newer version.
+
+constexpr uint8_t BATCH_KIND = 0xFB;
+constexpr uint8_t BATCH_VERSION = 1;
+constexpr size_t BATCH_FRAME_MAX = 250; // ESP_NOW_MAX_DATA_LEN
+
+struct __attribute__((packed)) BatchHeader {
+  uint8_t seq;
+  uint8_t kind;    // BATCH_KIND
+  uint8_t version; // BATCH_VERSION
+  uint8_t count;   // records that follow
+};
+
+// Most Message records one batch can carry
+constexpr size_t BATCH_MAX_MESSAGES = (BATCH_FRAME_MAX - sizeof(BatchHeader)) / (1 + sizeof(Message));
+
+struct BatchBuilder {
+  uint8_t data[BATCH_FRAME_MAX];
+  size_t len;
+};
+
+inline void batch_begin(BatchBuilder &batch, uint8_t seq)
+{
+  BatchHeader header = {seq, BATCH_KIND, BATCH_VERSION, 0};
+  memcpy(batch.data, &header, sizeof(header));
+  batch.len = sizeof(header);
+}
+
+inline size_t batch_records(const BatchBuilder &batch)
+{
+  return batch.data[offsetof(BatchHeader, count)];
+}
+
+// Whether a record of len bytes still fits
+inline bool batch_fits(const BatchBuilder &batch, size_t len)
+{
+  return len > 0 && batch.len + 1 + len <= BATCH_FRAME_MAX && batch_records(batch) < UINT8_MAX;
+}
+
+// False (and nothing appended) if the record does not fit
+inline bool batch_append(BatchBuilder &batch, const uint8_t *record, size_t len)
+{
+  if (!batch_fits(batch, len)) return false;
+  batch.data[batch.len++] = (uint8_t)len;
+  memcpy(batch.data + batch.len, record, len);
+  batch.len += len;
+  batch.data[offsetof(BatchHeader, count)]++;
+  return true;
+}
+
+inline bool batch_is_frame(const uint8_t *data, size_t len)
+{
+  return len >= sizeof(BatchHeader) && len != sizeof(Message) && data[offsetof(BatchHeader, kind)] == BATCH_KIND;
+}
+
+// Calls visit(record, len) for each record in order. Returns false for a newer
+// version (nothing visited) or a truncated frame (records up to the damage are
+// visited).
+template <typename Visit>
+bool batch_for_each(const uint8_t *data, size_t len, Visit visit)
+{
+  if (!batch_is_frame(data, len)) return false;
+  BatchHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.version > BATCH_VERSION) return false;
+  size_t offset = sizeof(header);
+  for (uint8_t i = 0; i < header.count; ++i) {
+    if (offset >= len) return false;
+    size_t record_len = data[offset++];
+    if (record_len == 0 || offset + record_len > len) return false;
+    visit(data + offset, record_len);
+    offset += record_len;
+  }
+  return offset == len;
+}
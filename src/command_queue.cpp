@@ -0,0 +1,202 @@
+#include "command_queue.h"
+#include "controller_commands.h"
+#include "spsc_queue.h"
+#include "batch_frame.h"
+#include "axis.h"
+#include "perf_stats.h"
+#include "command_trace.h"
+#include "hal.h"
+
+// Holds a full batch frame, which the receive callback pushes in one go
+constexpr size_t NORMAL_LANE_SIZE = 64;
+static_assert(NORMAL_LANE_SIZE >= BATCH_MAX_MESSAGES, "a batch frame must fit the normal lane");
+constexpr size_t PRIORITY_LANE_SIZE = 4;
+
+// Commands carry the time they were queued, for the PERF_QUEUE_WAIT probe
+struct QueuedCommand {
+  Message msg;
+  uint32_t queued_us;
+};
+
+// A priority command remembers how far the normal lane had been written when it
+// arrived; everything before that index is older than the STOP/RESET
+struct PriorityEntry {
+  QueuedCommand command;
+  uint32_t barrier;
+};
+
+// Normal-lane command taken into the consumer's batch, with its lane index
+struct BatchEntry {
+  QueuedCommand command;
+  uint32_t index;
+  bool dropped;
+};
+
+static SpscQueue<QueuedCommand, NORMAL_LANE_SIZE> normal_lane;
+static SpscQueue<PriorityEntry, PRIORITY_LANE_SIZE> priority_lane;
+
+// Consumer-only state; one STOP barrier per axis
+static bool barrier_active[AXIS_COUNT] = {};
+static uint32_t barrier_index[AXIS_COUNT] = {};
+static BatchEntry batch[NORMAL_LANE_SIZE];
+static size_t batch_count = 0;
+static size_t batch_next = 0;
+static std::atomic<uint32_t> superseded_count{0};
+static std::atomic<uint32_t> coalesced_count{0};
+
+bool command_is_priority(CommandType cmd)
+{
+  return cmd == CMD_STOP || cmd == CMD_RESET;
+}
+
+bool command_is_motion(CommandType cmd)
+{
+  if (cmd == CMD_WAYPOINT || cmd == CMD_JOG_VELOCITY || cmd == CMD_MOVE_TO_FREQ) return true;
+  switch (cmd) {
+    case CMD_UP_SLOW:
+    case CMD_UP_MEDIUM:
+    case CMD_UP_FAST:
+    case CMD_DOWN_SLOW:
+    case CMD_DOWN_MEDIUM:
+    case CMD_DOWN_FAST:
+    case CMD_MOVE_TO:
+    case CMD_HOME:
+    case CMD_MOVE_TO_HOME:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool command_is_config(CommandType cmd)
+{
+  switch (cmd) {
+    case CMD_SLOW_SPEED_PULSE_DELAY:
+    case CMD_MEDIUM_SPEED_PULSE_DELAY:
+    case CMD_FAST_SPEED_PULSE_DELAY:
+    case CMD_MOVE_TO_PULSE_DELAY:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool command_is_homing(CommandType cmd)
+{
+  return cmd == CMD_HOME || cmd == CMD_MOVE_TO_HOME;
+}
+
+// Motion the FSM may refuse (axis not homed, frequency outside the tuning
+// table, waypoint buffer full) cannot make the commands before it pointless
+static bool command_may_be_rejected(CommandType cmd)
+{
+  return cmd == CMD_MOVE_TO_FREQ || cmd == CMD_WAYPOINT;
+}
+
+// Does a later entry make batch[i] pointless to execute? Motion entries are
+// decided first, so config entries only see the motion that will really run.
+static bool batch_superseded(size_t i)
+{
+  CommandType cmd = batch[i].command.msg.command;
+  uint8_t axis = axis_from_param(batch[i].command.msg.param);
+  for (size_t j = i + 1; j < batch_count; ++j) {
+    if (axis_from_param(batch[j].command.msg.param) != axis) continue;
+    CommandType later = batch[j].command.msg.command;
+    bool replaces = command_is_motion(later) && !command_may_be_rejected(later);
+    if (command_is_motion(cmd) && !command_is_homing(cmd) && replaces) return true;
+    if (command_is_config(cmd)) {
+      if (later == cmd) return true;
+      // A motion command in between starts with this value, so it must be applied
+      if (command_is_motion(later) && !batch[j].dropped) return false;
+    }
+  }
+  return false;
+}
+
+// Take everything queued so far and mark the entries later ones supersede
+static bool batch_fill()
+{
+  batch_count = 0;
+  batch_next = 0;
+  while (batch_count < NORMAL_LANE_SIZE) {
+    BatchEntry &entry = batch[batch_count];
+    entry.index = normal_lane.read_index();
+    if (!normal_lane.pop(entry.command)) break;
+    entry.dropped = false;
+    batch_count++;
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i + 1 < batch_count; ++i) {
+      bool config = command_is_config(batch[i].command.msg.command);
+      if (config != (pass == 1) || !batch_superseded(i)) continue;
+      batch[i].dropped = true;
+      coalesced_count.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  return batch_count > 0;
+}
+
+static void record_queue_wait(const QueuedCommand &command)
+{
+  if (!PERF_STATS) return;
+  uint32_t waited_us = (uint32_t)hal_micros() - command.queued_us;
+  perf_record_ns(PERF_QUEUE_WAIT, waited_us < UINT32_MAX / 1000U ? waited_us * 1000U : UINT32_MAX);
+}
+
+bool command_queue_push(const Message &msg)
+{
+  trace_command(msg);
+  QueuedCommand command{msg, PERF_STATS ? (uint32_t)hal_micros() : 0};
+  if (command_is_priority(msg.command)) {
+    return priority_lane.push(PriorityEntry{command, normal_lane.write_index()});
+  }
+  return normal_lane.push(command);
+}
+
+bool command_queue_pop(Message &msg, bool &cancelled)
+{
+  cancelled = false;
+  PriorityEntry entry;
+  if (priority_lane.pop(entry)) {
+    const Message &priority = entry.command.msg;
+    uint8_t stop_axis = axis_from_param(priority.param);
+    for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+      if (priority.command != CMD_RESET && axis != stop_axis) continue;
+      barrier_active[axis] = true;
+      barrier_index[axis] = entry.barrier;
+    }
+    record_queue_wait(entry.command);
+    msg = priority;
+    return true;
+  }
+  for (;;) {
+    if (batch_next == batch_count && !batch_fill()) return false;
+    const BatchEntry &entry = batch[batch_next++];
+    // A discarded waypoint still goes out, cancelled, so it gets its CMD_WAYPOINT_STATUS
+    bool waypoint = entry.command.msg.command == CMD_WAYPOINT;
+    if (entry.dropped && !waypoint) continue;
+    for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+      if (barrier_active[axis] && (int32_t)(barrier_index[axis] - entry.index) <= 0) barrier_active[axis] = false;
+    }
+    uint8_t axis = axis_from_param(entry.command.msg.param);
+    bool behind_stop = axis < AXIS_COUNT && barrier_active[axis] && command_is_motion(entry.command.msg.command);
+    if (behind_stop) superseded_count.fetch_add(1, std::memory_order_relaxed);
+    if (behind_stop && !waypoint) continue;
+    record_queue_wait(entry.command);
+    msg = entry.command.msg;
+    cancelled = entry.dropped || behind_stop;
+    return true;
+  }
+}
+
+CommandQueueStats command_queue_stats()
+{
+  CommandQueueStats stats;
+  stats.normal_overflows = normal_lane.overflow_count();
+  stats.priority_overflows = priority_lane.overflow_count();
+  stats.normal_high_water = normal_lane.high_water();
+  stats.priority_high_water = priority_lane.high_water();
+  stats.superseded = superseded_count.load(std::memory_order_relaxed);
+  stats.coalesced = coalesced_count.load(std::memory_order_relaxed);
+  return stats;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include "stepper_commands.h"
+
+// Inbound command intake between the ESP-NOW receive callback (producer, Wi-Fi
+// task) and the motion task (consumer). Both lanes are lock-free SPSC queues.
+// CMD_STOP and CMD_RESET travel in a separate priority lane and are always
+// popped first, so their latency does not depend on how much jog/move traffic is
+// queued. Motion commands that were queued before a STOP/RESET are discarded when
+// it is taken (they would restart the motor); other commands behind it still run.
+// A STOP only discards motion for its own axis (axis.h); RESET covers every axis.
+// A discarded CMD_WAYPOINT is still popped, marked cancelled, so the FSM can send
+// the CMD_WAYPOINT_STATUS its sender waits for.
+//
+// The consumer takes the normal lane in batches and collapses commands a later
+// one in the same batch makes pointless, so a burst from a GUI slider ends up
+// as one move to where the operator stopped:
+//  - a jog, CMD_MOVE_TO(_FREQ) or CMD_WAYPOINT followed by a jog, CMD_MOVE_TO or
+//    homing command (homing commands are always executed, since they change
+//    what positions mean; CMD_MOVE_TO_FREQ and CMD_WAYPOINT may be refused by
+//    the FSM, so they never replace what came before them)
+//  - a pulse-delay update followed by the same update, unless a motion command
+//    in between starts with the earlier value
+// Only commands for the same axis collapse into each other. Every message was
+// already ACKed by the receive callback, so nothing is lost on the GUI side; the
+// order of the remaining commands is kept.
+
+struct CommandQueueStats {
+  uint32_t normal_overflows;
+  uint32_t priority_overflows;
+  uint32_t normal_high_water;
+  uint32_t priority_high_water;
+  uint32_t superseded; // motion commands discarded behind a STOP/RESET
+  uint32_t coalesced;  // commands collapsed into a later one of their class
+};
+
+// Producer side (radio callback only)
+bool command_queue_push(const Message &msg);
+// Consumer side (motion task only). cancelled: msg is a CMD_WAYPOINT that was
+// discarded, to be reported (fsm_cancel_waypoint()) rather than executed
+bool command_queue_pop(Message &msg, bool &cancelled);
+
+bool command_is_priority(CommandType cmd);
+bool command_is_motion(CommandType cmd);
+// Pulse-delay updates
+bool command_is_config(CommandType cmd);
+CommandQueueStats command_queue_stats();
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include "command_trace.h"
+#include "axis.h"
+
+constexpr size_t TRACE_LINE_MAX = 64;
+
+// Written by the receive callback (commands) and the motion task (state
+// changes, sync records), read by the service task (dump)
+static HalLock trace_lock;
+static TraceRecord records[TRACE_CAPACITY];
+static size_t record_count = 0;
+static size_t record_next = 0;
+static uint32_t overwritten = 0;
+static uint32_t missed = 0; // dropped while the ring was being printed
+static bool frozen = false;
+// Axes that owe a sync record; every axis writes one on its first pass at rest after boot
+static volatile uint8_t sync_pending = (uint8_t)((1U << AXIS_COUNT) - 1);
+
+static volatile bool dump_pending = false;
+static volatile bool restart_after_dump = false;
+
+// Under trace_lock
+static void ring_put(const TraceRecord &record)
+{
+  TraceRecord &slot = records[record_next];
+  if (record_count < TRACE_CAPACITY) {
+    record_count++;
+  } else {
+    overwritten++;
+    // The oldest sync of an axis is going: write a new one so a replay can still start it
+    if (slot.type == TRACE_SYNC) sync_pending |= (uint8_t)(1U << slot.arg0);
+  }
+  slot = record;
+  record_next = (record_next + 1) % TRACE_CAPACITY;
+}
+
+void trace_record(const TraceRecord &record)
+{
+  hal_lock(trace_lock);
+  if (frozen) {
+    missed++;
+    // trace_sync_due() already cleared the bit: the axis owes its sync record again
+    if (record.type == TRACE_SYNC) sync_pending |= (uint8_t)(1U << record.arg0);
+  } else {
+    ring_put(record);
+  }
+  hal_unlock(trace_lock);
+}
+
+bool trace_sync_due(uint8_t axis)
+{
+  if (!COMMAND_TRACE || !(sync_pending & (1U << axis))) return false;
+  hal_lock(trace_lock);
+  sync_pending &= (uint8_t)~(1U << axis);
+  hal_unlock(trace_lock);
+  return true;
+}
+
+void trace_restart()
+{
+  hal_lock(trace_lock);
+  record_count = 0;
+  record_next = 0;
+  overwritten = 0;
+  sync_pending = (uint8_t)((1U << AXIS_COUNT) - 1);
+  hal_unlock(trace_lock);
+}
+
+size_t trace_count()
+{
+  return record_count;
+}
+
+TraceRecord trace_at(size_t i)
+{
+  hal_lock(trace_lock);
+  TraceRecord record = records[(record_next + TRACE_CAPACITY - record_count + i) % TRACE_CAPACITY];
+  hal_unlock(trace_lock);
+  return record;
+}
+
+uint32_t trace_overwritten()
+{
+  return overwritten;
+}
+
+size_t trace_format(const TraceRecord &record, char *line, size_t len)
+{
+  int n;
+  switch (record.type) {
+    case TRACE_COMMAND:
+      n = snprintf(line, len, "trace C %lu %u %u %ld\n", (unsigned long)record.time_us, (unsigned)record.arg0,
+                   (unsigned)record.arg1, (long)record.value);
+      break;
+    case TRACE_GAP:
+      n = snprintf(line, len, "trace G %lu %ld\n", (unsigned long)record.time_us, (long)record.value);
+      break;
+    case TRACE_STATE:
+    case TRACE_SYNC:
+      n = snprintf(line, len, "trace %c %lu %u %u %u %ld\n", record.type == TRACE_STATE ? 'S' : 'Y',
+                   (unsigned long)record.time_us, (unsigned)record.arg0, (unsigned)record.arg1,
+                   (unsigned)record.arg2, (long)record.value);
+      break;
+    default:
+      return 0;
+  }
+  return n > 0 && (size_t)n < len ? (size_t)n : 0;
+}
+
+bool trace_parse(const char *line, TraceRecord &record)
+{
+  char kind;
+  unsigned long time_us;
+  unsigned arg0 = 0, arg1 = 0, arg2 = 0;
+  long value;
+  if (sscanf(line, "trace %c %lu", &kind, &time_us) != 2) return false;
+  record = TraceRecord{};
+  record.time_us = (uint32_t)time_us;
+  if (kind == 'C') {
+    if (sscanf(line, "trace C %*u %u %u %ld", &arg0, &arg1, &value) != 3) return false;
+    record.type = TRACE_COMMAND;
+  } else if (kind == 'S' || kind == 'Y') {
+    if (sscanf(line, "trace %*c %*u %u %u %u %ld", &arg0, &arg1, &arg2, &value) != 4) return false;
+    record.type = kind == 'S' ? TRACE_STATE : TRACE_SYNC;
+  } else if (kind == 'G') {
+    if (sscanf(line, "trace G %*u %ld", &value) != 1) return false;
+    record.type = TRACE_GAP;
+  } else {
+    return false;
+  }
+  record.arg0 = (uint8_t)arg0;
+  record.arg1 = (uint8_t)arg1;
+  record.arg2 = (uint8_t)arg2;
+  record.value = (int32_t)value;
+  return true;
+}
+
+void trace_request_dump(bool restart)
+{
+  if (dump_pending) return; // already printing
+  restart_after_dump = restart;
+  dump_pending = true;
+}
+
+void trace_dump_pending()
+{
+  if (!dump_pending) return;
+  // Recording pauses while the ring is printed, which takes a while at 115200 baud
+  hal_lock(trace_lock);
+  frozen = true;
+  missed = 0;
+  hal_unlock(trace_lock);
+  char line[TRACE_LINE_MAX];
+  size_t count = trace_count();
+  int n = snprintf(line, sizeof(line), "trace begin %u %lu\n", (unsigned)count, (unsigned long)overwritten);
+  hal_console_write((const uint8_t *)line, (size_t)n);
+  for (size_t i = 0; i < count; ++i) {
+    TraceRecord record = trace_at(i);
+    size_t len = trace_format(record, line, sizeof(line));
+    if (len) hal_console_write((const uint8_t *)line, len);
+  }
+  hal_lock(trace_lock);
+  frozen = false;
+  uint32_t lost = missed;
+  if (lost) {
+    // What the axes did meanwhile is unknown: mark the gap and have every axis sync again
+    ring_put(TraceRecord{(uint32_t)hal_micros(), TRACE_GAP, 0, 0, 0, (int32_t)lost});
+    sync_pending = (uint8_t)((1U << AXIS_COUNT) - 1);
+  }
+  hal_unlock(trace_lock);
+  n = snprintf(line, sizeof(line), "trace end %lu\n", (unsigned long)lost);
+  hal_console_write((const uint8_t *)line, (size_t)n);
+  if (restart_after_dump) trace_restart();
+  dump_pending = false;
+}
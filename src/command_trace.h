@@ -0,0 +1,93 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "stepper_commands.h"
+#include "hal.h"
+
+// Session trace for reproducing field problems.
+// A RAM ring of 12-byte records holds every command that enters the command
+// intake (command_queue_push(), with its microsecond timestamp) and every FSM
+// state change (fsm_handle_command()/fsm_handle(), with the position). Sync
+// records give the homed flag, motor power and resting position of each axis
+// where a replay can start it: at boot, after CMD_TRACE restarts the trace, and
+// after the ring overwrites the axis' oldest sync record. An axis writes its
+// sync record on the first supervision pass it is at rest. Records that arrive
+// while the ring is printed are lost; a gap record then counts them, and every
+// axis writes a new sync record so a replay can pick it up again after the gap.
+//
+// CMD_TRACE prints the ring on the console as "trace ..." lines (format in
+// README "Command trace"), and `program replay <capture>` in the native build
+// feeds the commands back into the FSM at their recorded times and reports
+// where the state changes diverge in timing or position, leaving out what a gap
+// hides. Recording is ISR safe and costs a spinlock and a 12-byte copy; build
+// with -DCOMMAND_TRACE=0 to compile it out.
+
+#ifndef COMMAND_TRACE
+#define COMMAND_TRACE 1
+#endif
+
+constexpr size_t TRACE_CAPACITY = 512; // records, 6 KB
+
+enum TraceType : uint8_t {
+  TRACE_COMMAND, // arg0 messageId, arg1 command, value param
+  TRACE_STATE,   // arg0 axis, arg1 from, arg2 to, value position
+  TRACE_SYNC,    // arg0 axis, arg1 state, arg2 TRACE_SYNC_* flags, value position
+  TRACE_GAP      // value records lost while the ring was printed
+};
+
+// TRACE_SYNC flags
+constexpr uint8_t TRACE_SYNC_HOMED = 0x1;
+constexpr uint8_t TRACE_SYNC_RELEASED = 0x2; // motor current off (power_policy.h)
+
+struct __attribute__((packed)) TraceRecord {
+  uint32_t time_us;
+  uint8_t type; // TraceType
+  uint8_t arg0;
+  uint8_t arg1;
+  uint8_t arg2;
+  int32_t value;
+};
+
+static_assert(sizeof(TraceRecord) == 12, "TraceRecord must be packed");
+
+// CMD_TRACE param bits
+constexpr int32_t TRACE_PARAM_RESTART = 0x1; // clear the ring after printing and start a new session
+
+void trace_record(const TraceRecord &record);
+
+inline void trace_command(const Message &msg)
+{
+  if (!COMMAND_TRACE) return;
+  trace_record(TraceRecord{(uint32_t)hal_micros(), TRACE_COMMAND, msg.messageId, (uint8_t)msg.command, 0, msg.param});
+}
+
+inline void trace_state(uint8_t axis, uint8_t from, uint8_t to, int32_t position)
+{
+  if (!COMMAND_TRACE || from == to) return;
+  trace_record(TraceRecord{(uint32_t)hal_micros(), TRACE_STATE, axis, from, to, position});
+}
+
+// Motion task, each supervision pass at rest: true once when the axis owes a
+// sync record
+bool trace_sync_due(uint8_t axis);
+inline void trace_sync(uint8_t axis, uint8_t state, uint8_t flags, int32_t position)
+{
+  if (!COMMAND_TRACE) return;
+  trace_record(TraceRecord{(uint32_t)hal_micros(), TRACE_SYNC, axis, state, flags, position});
+}
+
+// Empty the ring and ask every axis for a sync record
+void trace_restart();
+// Records in the ring, oldest first, and records overwritten since the restart
+size_t trace_count();
+TraceRecord trace_at(size_t i);
+uint32_t trace_overwritten();
+
+// One "trace ..." console line for a record, and back; false for other lines
+size_t trace_format(const TraceRecord &record, char *line, size_t len);
+bool trace_parse(const char *line, TraceRecord &record);
+
+// Answer CMD_TRACE: print the ring from the service task (trace_dump_pending()),
+// then restart the trace if asked to
+void trace_request_dump(bool restart);
+void trace_dump_pending();
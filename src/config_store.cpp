@@ -0,0 +1,189 @@
+#include <stddef.h>
+#include <string.h>
+#include "config_store.h"
+#include "crc32.h"
+#include "deferred_log.h"
+#include "hal.h"
+
+extern PulseDelays pulse_delays[AXIS_COUNT];
+
+static const char CONFIG_KEY[] = "config";
+
+// Per-value keys from earlier firmware (axis 0), newest first
+struct LegacyKey {
+  long PulseDelays::*value;
+  const char *key;
+  const char *old_key;
+};
+static const LegacyKey LEGACY_KEYS[] = {
+  {&PulseDelays::slow_pd, "slow_pd", "slowPD"},
+  {&PulseDelays::med_pd, "med_pd", "mediumPD"},
+  {&PulseDelays::fast_pd, "fast_pd", "fastPD"},
+  {&PulseDelays::moveto_pd, "moveto_pd", "moveToPD"},
+};
+
+static StepperConfig saved = {}; // what NVS holds, to skip unchanged commits
+// Marked by the motion task, taken by the service task
+static HalLock dirty_lock;
+static bool dirty = false;
+static unsigned long first_dirty_ms = 0;
+static unsigned long last_dirty_ms = 0;
+static volatile bool restart_requested = false;
+static ConfigStats stats = {};
+
+// Blob size for a build with the given number of axes
+static constexpr size_t config_size(size_t axes)
+{
+  return offsetof(StepperConfig, axes) + axes * sizeof(StoredPulseDelays) + sizeof(uint32_t);
+}
+static_assert(config_size(AXIS_COUNT) == sizeof(StepperConfig), "StepperConfig must be packed");
+
+static uint32_t config_crc(const uint8_t *blob, size_t size)
+{
+  return crc32_update(0, blob, size - sizeof(uint32_t));
+}
+
+static bool config_valid(const uint8_t *blob, size_t size, size_t axes)
+{
+  uint16_t version, stored_size;
+  uint32_t crc;
+  memcpy(&version, blob + offsetof(StepperConfig, version), sizeof(version));
+  memcpy(&stored_size, blob + offsetof(StepperConfig, size), sizeof(stored_size));
+  memcpy(&crc, blob + size - sizeof(crc), sizeof(crc));
+  if (version != CONFIG_VERSION || stored_size != size || crc != config_crc(blob, size)) return false;
+  for (size_t axis = 0; axis < axes; ++axis) {
+    StoredPulseDelays stored;
+    memcpy(&stored, blob + offsetof(StepperConfig, axes) + axis * sizeof(stored), sizeof(stored));
+    if (stored.slow_pd <= 0 || stored.med_pd <= 0 || stored.fast_pd <= 0 || stored.moveto_pd <= 0) return false;
+  }
+  return true;
+}
+
+static StepperConfig config_from_globals()
+{
+  StepperConfig config = {};
+  config.version = CONFIG_VERSION;
+  config.size = sizeof(StepperConfig);
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+    const PulseDelays &pds = pulse_delays[axis];
+    config.axes[axis] = {(int32_t)pds.slow_pd, (int32_t)pds.med_pd, (int32_t)pds.fast_pd, (int32_t)pds.moveto_pd};
+  }
+  config.crc = config_crc((const uint8_t *)&config, sizeof(config));
+  return config;
+}
+
+static void config_commit()
+{
+  hal_lock(dirty_lock);
+  dirty = false; // a change from now on is committed again
+  hal_unlock(dirty_lock);
+  StepperConfig config = config_from_globals();
+  if (memcmp(&config, &saved, sizeof(config)) == 0) {
+    stats.unchanged++;
+    return;
+  }
+  if (!hal_nvs_put_blob(CONFIG_KEY, &config, sizeof(config))) {
+    LOG_ERROR("[CONFIG] write failed");
+    return;
+  }
+  saved = config;
+  stats.commits++;
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+    // Deferred log entries carry at most four arguments
+    LOG_INFO("[CONFIG] saved axis %u: slow=%d medium=%d", axis, config.axes[axis].slow_pd, config.axes[axis].med_pd);
+    LOG_INFO("[CONFIG] saved axis %u: fast=%d moveto=%d", axis, config.axes[axis].fast_pd, config.axes[axis].moveto_pd);
+  }
+}
+
+// Reads a blob written for any axis count, this build's first. Returns the
+// number of axes it holds, 0 if there is no valid blob.
+static size_t config_read(uint8_t *blob)
+{
+  for (size_t i = 0; i <= AXIS_MAX; ++i) {
+    size_t axes = i == 0 ? AXIS_COUNT : i;
+    if (i == AXIS_COUNT) continue;
+    size_t size = config_size(axes);
+    if (hal_nvs_get_blob(CONFIG_KEY, blob, size) != size) continue;
+    return config_valid(blob, size, axes) ? axes : 0;
+  }
+  return 0;
+}
+
+ConfigSource config_load()
+{
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) pulse_delays[axis] = AXIS_CONFIGS[axis].defaults;
+
+  uint8_t blob[config_size(AXIS_MAX)];
+  size_t axes = config_read(blob);
+  if (axes) {
+    for (size_t axis = 0; axis < axes && axis < AXIS_COUNT; ++axis) {
+      StoredPulseDelays stored;
+      memcpy(&stored, blob + offsetof(StepperConfig, axes) + axis * sizeof(stored), sizeof(stored));
+      pulse_delays[axis] = {stored.slow_pd, stored.med_pd, stored.fast_pd, stored.moveto_pd};
+    }
+    if (axes == AXIS_COUNT) {
+      memcpy(&saved, blob, sizeof(saved));
+    } else {
+      config_commit(); // rewrite it for this build's axes
+    }
+    return CONFIG_FROM_BLOB;
+  }
+
+  // One-time migration; afterwards the blob is found first
+  bool found = false;
+  for (const LegacyKey &legacy : LEGACY_KEYS) {
+    long value = hal_nvs_get_long(legacy.key, 0);
+    if (value <= 0) value = hal_nvs_get_long(legacy.old_key, 0);
+    if (value > 0) {
+      pulse_delays[0].*legacy.value = value;
+      found = true;
+    }
+  }
+  if (!found) return CONFIG_DEFAULTS;
+  config_commit();
+  return CONFIG_MIGRATED;
+}
+
+void config_mark_dirty()
+{
+  unsigned long now = hal_millis();
+  hal_lock(dirty_lock);
+  if (!dirty) first_dirty_ms = now;
+  last_dirty_ms = now;
+  dirty = true;
+  hal_unlock(dirty_lock);
+}
+
+void config_service(unsigned long now_ms)
+{
+  hal_lock(dirty_lock);
+  bool due = dirty && (now_ms - last_dirty_ms >= CONFIG_COMMIT_QUIET_MS ||
+                       now_ms - first_dirty_ms >= CONFIG_COMMIT_MAX_DELAY_MS);
+  hal_unlock(dirty_lock);
+  if (due) config_commit();
+}
+
+void config_flush()
+{
+  hal_lock(dirty_lock);
+  bool pending = dirty;
+  hal_unlock(dirty_lock);
+  if (pending) config_commit();
+}
+
+void config_request_restart()
+{
+  restart_requested = true;
+}
+
+bool config_restart_due()
+{
+  if (!restart_requested) return false;
+  restart_requested = false;
+  return true;
+}
+
+ConfigStats config_stats()
+{
+  return stats;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "axis.h"
+
+// Persistent configuration.
+// The runtime pulse delays of every axis (pulse_delays[] in main.cpp) are stored
+// as one versioned, CRC-checked blob under the "config" key of the "stepper" NVS
+// namespace and loaded with a single read at boot. The blob holds one entry per
+// axis and its size field gives the count, so the one-axis blob of earlier
+// firmware loads as axis 0; axes the blob lacks keep their AxisConfig defaults.
+// Changes are only marked dirty; the service task writes the blob once the
+// values have been quiet for CONFIG_COMMIT_QUIET_MS (or dirty for
+// CONFIG_COMMIT_MAX_DELAY_MS), so a GUI slider drag costs one flash write instead
+// of one per step.
+
+constexpr uint16_t CONFIG_VERSION = 1;
+constexpr unsigned long CONFIG_COMMIT_QUIET_MS = 1000;
+constexpr unsigned long CONFIG_COMMIT_MAX_DELAY_MS = 5000;
+
+struct __attribute__((packed)) StoredPulseDelays {
+  int32_t slow_pd;
+  int32_t med_pd;
+  int32_t fast_pd;
+  int32_t moveto_pd;
+};
+
+struct __attribute__((packed)) StepperConfig {
+  uint16_t version;
+  uint16_t size; // blob size: guards against layout changes and gives the axis count
+  StoredPulseDelays axes[AXIS_COUNT];
+  uint32_t crc; // CRC-32 of everything above
+};
+
+enum ConfigSource : uint8_t {
+  CONFIG_FROM_BLOB,  // valid blob
+  CONFIG_MIGRATED,   // blob missing; built from the per-value keys and saved
+  CONFIG_DEFAULTS    // nothing stored (or the blob was corrupt)
+};
+
+struct ConfigStats {
+  uint32_t commits;   // blobs written
+  uint32_t unchanged; // commits skipped because the blob already held the values
+};
+
+// Call once at boot after hal_nvs_begin(); sets pulse_delays[] from the AxisConfig
+// defaults and overwrites the values it finds. Migrates the per-value keys
+// (slow_pd.., and the older slowPD/mediumPD/fastPD/moveToPD) into axis 0 once.
+ConfigSource config_load();
+// A pulse delay changed (any task)
+void config_mark_dirty();
+// Service task: commit the blob when the debounce has elapsed
+void config_service(unsigned long now_ms);
+// Commit now if anything is pending (service task, before a restart)
+void config_flush();
+// CMD_RESET (motion task): the service task commits what is pending, then
+// restarts, so flash is only written from one task
+void config_request_restart();
+// Service task: true once after config_request_restart()
+bool config_restart_due();
+ConfigStats config_stats();
@@ -0,0 +1,50 @@
+#pragma once
+#include "stepper_commands.h"
+
+// Controller-side commands that are not in the shared CommandType enum
+// (MagLoop_Common_Files/stepper_commands.h). They use codes from 0xE0 up, well
+// clear of the shared commands and of the frame kinds (0xFC..0xFE) in byte 1 of
+// the telemetry and diagnostic frames. Move them into the shared header once the
+// GUI implements them.
+
+// Report the timing histograms (perf_stats.h); param: PERF_PARAM_* bits
+constexpr CommandType CMD_PERF_STATS = (CommandType)0xE0;
+
+// Handshake (handshake.h), both directions; param: HELLO_* version and capability bits
+constexpr CommandType CMD_HELLO = (CommandType)0xE1;
+
+// Append a waypoint to the trajectory buffer (trajectory.h); starts the
+// trajectory when not already running. param: bits 0-15 position (int16),
+// bits 16-27 dwell at the waypoint in ms, bits 28-31 axis (axis.h)
+constexpr CommandType CMD_WAYPOINT = (CommandType)0xE2;
+// Controller -> GUI, with the messageId of the CMD_WAYPOINT it refers to.
+// param: the position on reaching the waypoint, WAYPOINT_REJECTED or
+// WAYPOINT_CANCELLED
+constexpr CommandType CMD_WAYPOINT_STATUS = (CommandType)0xE3;
+
+// Streaming jog: param is a signed velocity setpoint in steps/s (positive = up,
+// 0 = ramp to a stop). Send it continuously while the knob is held; the motor
+// ramps down if no setpoint arrives for VELOCITY_TIMEOUT_MS (fsm.h).
+constexpr CommandType CMD_JOG_VELOCITY = (CommandType)0xE4;
+
+// Report the round-trip latency window (latency_probe.h) as one LatencyReport
+// frame; param: LATENCY_PARAM_* bits
+constexpr CommandType CMD_LATENCY_STATS = (CommandType)0xE5;
+
+// Report the reflectance profile of the axis' last profiled homing
+// (sensor_profile.h) as one ProfileReport frame; param: axis bits only
+constexpr CommandType CMD_SENSOR_PROFILE = (CommandType)0xE6;
+
+// Move to the position the calibration table (tuning_table.h) gives for a
+// frequency; param: frequency in Hz (bits 0-27). Runs like CMD_MOVE_TO once
+// homed. Echoed with TUNING_REJECTED when the axis is not homed or the table
+// does not cover the frequency.
+constexpr CommandType CMD_MOVE_TO_FREQ = (CommandType)0xE7;
+// The resting position is tuned to a frequency: teach it to the table.
+// param: frequency in Hz, or TUNING_CLEAR to empty the axis' table. Echoed with
+// the number of points in the table, or TUNING_REJECTED unless homed and at rest.
+constexpr CommandType CMD_TUNE_POINT = (CommandType)0xE8;
+
+// Print the command/state trace (command_trace.h) on the console as "trace ..."
+// lines; param: TRACE_PARAM_* bits
+constexpr CommandType CMD_TRACE = (CommandType)0xE9;
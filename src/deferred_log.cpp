@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "deferred_log.h"
+#include "hal.h"
+
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of two");
+
+// Binary frame sync bytes (see tools/log_decode.py)
+constexpr uint8_t LOG_SYNC_0 = 0xA5;
+constexpr uint8_t LOG_SYNC_1 = 0x5A;
+constexpr size_t LOG_LINE_MAX = 160;
+
+static const char LOG_DROPPED_FMT[] = "log: %u records dropped";
+
+// Writers from any core/ISR serialize on log_lock; only the drain advances ring_tail
+static LogRecord ring[LOG_RING_SIZE];
+static uint32_t ring_head = 0;
+static uint32_t ring_tail = 0;
+static uint32_t dropped = 0;
+static uint32_t dropped_reported = 0;
+static HalLock log_lock;
+
+void IRAM_ATTR log_write(uint8_t level, const char *fmt, uint8_t nargs, const intptr_t *args)
+{
+  uint32_t now = (uint32_t)hal_micros();
+  hal_lock(log_lock);
+  if (ring_head - ring_tail >= LOG_RING_SIZE) {
+    dropped++;
+    hal_unlock(log_lock);
+    return;
+  }
+  LogRecord &rec = ring[ring_head & (LOG_RING_SIZE - 1)];
+  rec.timestamp_us = now;
+  rec.fmt = fmt;
+  rec.level = level;
+  rec.nargs = nargs;
+  for (size_t i = 0; i < LOG_MAX_ARGS; ++i) rec.args[i] = args[i];
+  ring_head++;
+  hal_unlock(log_lock);
+}
+
+uint32_t log_dropped()
+{
+  return dropped;
+}
+
+static char level_letter(uint8_t level)
+{
+  switch (level) {
+    case LOG_LEVEL_ERROR: return 'E';
+    case LOG_LEVEL_WARN: return 'W';
+    case LOG_LEVEL_INFO: return 'I';
+    default: return 'D';
+  }
+}
+
+// printf subset over the stored arguments; every integer is a 32-bit value
+static size_t format_record(char *out, size_t size, const LogRecord &rec)
+{
+  int n = snprintf(out, size, "%c (%lu) ", level_letter(rec.level), (unsigned long)(rec.timestamp_us / 1000));
+  size_t len = n > 0 ? (size_t)n : 0;
+  const char *p = rec.fmt;
+  uint8_t next_arg = 0;
+  while (*p && len + 1 < size) {
+    if (*p != '%') {
+      out[len++] = *p++;
+      continue;
+    }
+    char spec[16];
+    size_t k = 0;
+    spec[k++] = *p++;
+    while (*p && strchr("-+ #0123456789.l", *p)) {
+      if (*p != 'l' && k < sizeof(spec) - 3) spec[k++] = *p;
+      p++;
+    }
+    char conv = *p ? *p++ : '\0';
+    if (conv == '%') {
+      out[len++] = '%';
+      continue;
+    }
+    intptr_t arg = next_arg < rec.nargs ? rec.args[next_arg] : 0;
+    next_arg++;
+    int written = 0;
+    switch (conv) {
+      case 'd':
+      case 'i':
+        spec[k++] = 'l'; spec[k++] = 'd'; spec[k] = '\0';
+        written = snprintf(out + len, size - len, spec, (long)(int32_t)arg);
+        break;
+      case 'u':
+      case 'x':
+      case 'X':
+        spec[k++] = 'l'; spec[k++] = conv; spec[k] = '\0';
+        written = snprintf(out + len, size - len, spec, (unsigned long)(uint32_t)arg);
+        break;
+      case 'c':
+        spec[k++] = 'c'; spec[k] = '\0';
+        written = snprintf(out + len, size - len, spec, (int)arg);
+        break;
+      case 's':
+        spec[k++] = 's'; spec[k] = '\0';
+        written = snprintf(out + len, size - len, spec, arg ? (const char *)arg : "(null)");
+        break;
+      default:
+        written = 0;
+        break;
+    }
+    if (written > 0) len = std::min(size - 1, len + (size_t)written);
+  }
+  out[len] = '\0';
+  return len;
+}
+
+static void emit_record(const LogRecord &rec)
+{
+#if LOG_BINARY
+  // sync, timestamp, format address, level, nargs, args (32-bit little endian)
+  uint8_t frame[2 + 4 + 4 + 2 + 4 * LOG_MAX_ARGS];
+  size_t len = 0;
+  frame[len++] = LOG_SYNC_0;
+  frame[len++] = LOG_SYNC_1;
+  uint32_t fmt_addr = (uint32_t)(uintptr_t)rec.fmt;
+  memcpy(frame + len, &rec.timestamp_us, 4); len += 4;
+  memcpy(frame + len, &fmt_addr, 4); len += 4;
+  frame[len++] = rec.level;
+  frame[len++] = rec.nargs;
+  for (uint8_t i = 0; i < rec.nargs; ++i) {
+    uint32_t arg = (uint32_t)rec.args[i];
+    memcpy(frame + len, &arg, 4); len += 4;
+  }
+  hal_console_write(frame, len);
+#else
+  char line[LOG_LINE_MAX];
+  size_t len = format_record(line, sizeof(line) - 1, rec);
+  line[len++] = '\n';
+  hal_console_write((const uint8_t *)line, len);
+#endif
+}
+
+size_t log_drain(size_t max_records)
+{
+  size_t written = 0;
+  LogRecord rec;
+  while (written < max_records) {
+    hal_lock(log_lock);
+    if (ring_tail == ring_head) {
+      hal_unlock(log_lock);
+      break;
+    }
+    rec = ring[ring_tail & (LOG_RING_SIZE - 1)];
+    ring_tail++;
+    hal_unlock(log_lock);
+    emit_record(rec);
+    written++;
+  }
+  uint32_t lost = dropped;
+  if (lost != dropped_reported) {
+    LogRecord note = {};
+    note.timestamp_us = (uint32_t)hal_micros();
+    note.fmt = LOG_DROPPED_FMT;
+    note.level = LOG_LEVEL_WARN;
+    note.nargs = 1;
+    note.args[0] = (intptr_t)(lost - dropped_reported);
+    dropped_reported = lost;
+    emit_record(note);
+  }
+  return written;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Deferred logging.
+// LOG_*() stores a compact record (timestamp, format pointer, up to four integer
+// or string-literal arguments) in a RAM ring and returns; it is safe from tasks,
+// callbacks and ISRs. The service task calls log_drain() to format records onto
+// Serial, or with LOG_BINARY=1 to write raw frames that tools/log_decode.py turns
+// back into text using the firmware ELF. Levels above LOG_LEVEL are compiled out.
+// Format strings and %s arguments must be string literals (they are stored by
+// address); supported conversions: %d %i %u %x %X %c %s with flags/width and l.
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#ifndef LOG_BINARY
+#define LOG_BINARY 0
+#endif
+
+constexpr size_t LOG_MAX_ARGS = 4;
+constexpr size_t LOG_RING_SIZE = 256; // records, power of two
+
+struct LogRecord {
+  uint32_t timestamp_us;
+  const char *fmt;
+  intptr_t args[LOG_MAX_ARGS];
+  uint8_t level;
+  uint8_t nargs;
+};
+
+void log_write(uint8_t level, const char *fmt, uint8_t nargs, const intptr_t *args);
+// Format/emit up to max_records queued records; returns the number written
+size_t log_drain(size_t max_records);
+uint32_t log_dropped();
+
+inline intptr_t log_arg(const char *s) { return (intptr_t)s; }
+template <typename T>
+inline intptr_t log_arg(T v) { return (intptr_t)v; }
+
+template <typename... Args>
+inline void log_at(uint8_t level, const char *fmt, Args... args)
+{
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+  const intptr_t packed[LOG_MAX_ARGS] = { log_arg(args)... };
+  log_write(level, fmt, (uint8_t)sizeof...(Args), packed);
+}
+
+// A compiled-out LOG_*() still type-checks its arguments and counts as a use of
+// them, so a parameter that is only logged does not warn, but emits no code.
+#define LOG_DISABLED(...) do { if (0) log_at(__VA_ARGS__); } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) LOG_DISABLED(LOG_LEVEL_ERROR, __VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) LOG_DISABLED(LOG_LEVEL_WARN, __VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) LOG_DISABLED(LOG_LEVEL_INFO, __VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_DISABLED(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#endif
+
+// MAC addresses are logged as two 24-bit halves: "%06X%06X"
+inline uint32_t log_mac_hi(const uint8_t *mac) { return ((uint32_t)mac[0] << 16) | (mac[1] << 8) | mac[2]; }
+inline uint32_t log_mac_lo(const uint8_t *mac) { return ((uint32_t)mac[3] << 16) | (mac[4] << 8) | mac[5]; }
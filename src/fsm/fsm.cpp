@@ -1,284 +1,739 @@
-#define D0_PIN 2
 #include "fsm.h"
 #include "stepper_helpers.h"
-#include <Preferences.h>
+#include "step_engine.h"
+#include "deferred_log.h"
+#include "hal.h"
+#include "perf_stats.h"
+#include "latency_probe.h"
+#include "sensor_profile.h"
+#include "tuning_table.h"
+#include "command_trace.h"
+#include "controller_commands.h"
+#include "config_store.h"
+#include "position_journal.h"
+#include "trajectory.h"
+#include "axis.h"
 
 
 extern void send_message(CommandType cmd, int32_t param, uint8_t messageId = 0);
 // ...existing code...
-extern void single_step(long pulse_delay, bool dir);
-extern unsigned long last_step_micros;
-extern unsigned long last_send_time;
-extern const unsigned long SEND_INTERVAL_MS;
-extern const int STEPPER_POSITION_MIN;
-extern const int STEPPER_POSITION_MAX;
-extern long slow_pd, med_pd, fast_pd, moveto_pd, pd;
-extern Preferences prefs;
-
-void fsm_init(StepperContext *ctx) {
+extern PulseDelays pulse_delays[AXIS_COUNT];
+
+// Homing: slow-pass pulse delay (1000 steps/s, under one step per supervision
+// tick), distance the back-off clears past the edge, and travel allowed per pass
+// before homing gives up
+constexpr long HOME_APPROACH_PD = 500;
+constexpr int HOME_BACKOFF_STEPS = 100;
+constexpr int HOME_TRAVEL_RANGES = 4;
+
+// Velocity jog setpoints beyond what the step engine can emit are clamped
+constexpr int32_t VELOCITY_MAX_STEPS_PER_S = 500000 / STEP_ENGINE_MIN_HALF_PERIOD_US;
+
+static int fsm_min_pos(const StepperContext *ctx) {
+    return AXIS_CONFIGS[ctx->axis].min_pos;
+}
+
+static int fsm_max_pos(const StepperContext *ctx) {
+    return AXIS_CONFIGS[ctx->axis].max_pos;
+}
+
+static int fsm_sensor_pin(const StepperContext *ctx) {
+    return AXIS_CONFIGS[ctx->axis].sensor_pin;
+}
+
+// Message to the GUI about this axis; the axis rides in the param (axis.h)
+static void fsm_reply(const StepperContext *ctx, CommandType cmd, int32_t value, uint8_t messageId = 0) {
+    send_message(cmd, axis_param(ctx->axis, value), messageId);
+}
+
+void fsm_init(StepperContext *ctx, uint8_t axis) {
+    ctx->axis = axis;
     ctx->state = STATE_IDLE;
     ctx->move_target = 0;
     ctx->position = 0;
-    ctx->pd = slow_pd;
+    ctx->pd = pulse_delays[ctx->axis].slow_pd;
     ctx->stop_flag = true;
     ctx->direction = true;
+    ctx->home_phase = HOME_FAST_APPROACH;
+    ctx->home_phase_steps = 0;
+    ctx->homed = false;
+    ctx->segment_from = 0;
+    ctx->dwelling = false;
+    ctx->dwell_until_ms = 0;
+    ctx->velocity = 0;
+    ctx->velocity_until_ms = 0;
+    trajectory_clear(ctx->axis);
 
-    // Initialize TCRT5000 digital output pin
-    pinMode(2, INPUT);
+    // Initialize TCRT5000 digital output pin; its falling edge latches the home step
+    hal_pin_input(fsm_sensor_pin(ctx));
+    hal_attach_falling(fsm_sensor_pin(ctx), step_engine_capture_isr(axis));
 }
 
-// Helper for move-to operation
-static void fsm_start_move_to(StepperContext *ctx, int pos) {
-    int difference = pos - ctx->position;
-    Serial.print("Position = "); Serial.print(ctx->position);
-    Serial.print("     move to = "); Serial.print(pos);
-    Serial.print("   Diff = "); Serial.println(difference);
-    if (difference == 0) {
-        Serial.println("Already at target position");
-        ctx->stop_flag = true;
-        ctx->state = STATE_IDLE;
-        send_message(CMD_POSITION, ctx->position);
-    } else {
-        ctx->move_target = pos;
-        ctx->state = STATE_MOVING_TO;
-        ctx->stop_flag = false;
+static void fsm_home_phase(StepperContext *ctx, HomePhase phase) {
+    ctx->home_phase = phase;
+    ctx->home_phase_steps = step_engine_step_count(ctx->axis);
+}
+
+// Two-pass homing. The counted position is meaningless until the mark is
+// found, so the passes work in provisional coordinates and step counts.
+static void fsm_start_homing(StepperContext *ctx) {
+    profile_end(ctx->axis);
+    ctx->stop_flag = false;
+    ctx->homed = false;
+    ctx->state = STATE_MOVE_TO_HOME;
+    step_engine_stop(ctx->axis);
+    if (hal_digital_read(fsm_sensor_pin(ctx)) == LOW) {
+        // Already on the mark: clear it upwards, then approach slowly
+        // Provisional position leaves room below the mark to ramp down in after the slow pass
+        LOG_INFO("[FSM] Homing: starting on the mark, backing off");
+        int provisional = fsm_min_pos(ctx) + HOME_BACKOFF_STEPS;
+        step_engine_set_position(ctx->axis, provisional);
+        fsm_home_phase(ctx, HOME_BACK_OFF);
+        step_engine_move_to(ctx->axis, provisional + 2 * HOME_BACKOFF_STEPS, pulse_delays[ctx->axis].fast_pd);
+        return;
     }
+    // Provisional top position leaves the whole range to travel before clamping
+    step_engine_set_position(ctx->axis, fsm_max_pos(ctx));
+    fsm_home_phase(ctx, HOME_FAST_APPROACH);
+    step_engine_capture_arm(ctx->axis);
+    step_engine_run(ctx->axis, pulse_delays[ctx->axis].fast_pd, false, false);
 }
 
-void fsm_handle_command(StepperContext *ctx, const Message &msg) {
-    // All case labels must be inside the switch below
-    Serial.print("[FSM] Handling command: ");
-    Serial.print(commandToString(msg.command));
-    Serial.print(" param=");
-    Serial.print(msg.param);
-    Serial.print(" id=");
-    Serial.println(msg.messageId);
-    StepperState prev_state = ctx->state;
-    bool prev_stop = ctx->stop_flag;
-    int prev_pos = ctx->position;
-    // Main FSM command switch
-    switch (msg.command) {
-        case CMD_STOP:
-            Serial.println("[FSM] CMD_STOP received: setting stop_flag=true, state=IDLE");
-            ctx->stop_flag = true;
-            ctx->state = STATE_IDLE;
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_HOME:
-            Serial.println("[FSM] CMD_HOME received");
-            // Start homing procedure here
-            ctx->state = STATE_MOVE_TO_HOME;
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_SENSOR_STATUS:
-            Serial.println("[FSM] CMD_SENSOR_STATUS received");
-            // Read and report sensor status (e.g., TCRT5000)
-            send_message(CMD_SENSOR_STATUS, digitalRead(2), msg.messageId);
-            break;
-        case CMD_MOVE_TO_HOME:
-            Serial.println("[FSM] CMD_MOVE_TO_HOME received");
-            // Move down until TCRT5000 sensor detects the white mark (LOW on pin 2)
-            ctx->stop_flag = false;
-            ctx->state = STATE_MOVE_TO_HOME;
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_HOME_COMPLETE:
-            Serial.println("[FSM] CMD_HOME_COMPLETE received");
-            send_message(CMD_HOME_COMPLETE, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_HOME_FAILED:
-            Serial.println("[FSM] CMD_HOME_FAILED received");
-            send_message(CMD_HOME_FAILED, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_SENSOR_ERROR:
-            Serial.println("[FSM] CMD_SENSOR_ERROR received");
-            send_message(CMD_SENSOR_ERROR, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-            break;
-        case CMD_UP_SLOW:
-            Serial.println("[FSM] CMD_UP_SLOW received");
-            pd = slow_pd; ctx->direction = true; ctx->stop_flag = false; ctx->state = STATE_MOVING_UP;
-            Serial.println("[FSM] Moving UP (slow): pd set, direction=true, stop_flag=false, state=MOVING_UP");
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_UP_MEDIUM:
-            Serial.println("[FSM] CMD_UP_MEDIUM received");
-            pd = med_pd; ctx->direction = true; ctx->stop_flag = false; ctx->state = STATE_MOVING_UP;
-            Serial.println("[FSM] Moving UP (medium): pd set, direction=true, stop_flag=false, state=MOVING_UP");
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_UP_FAST:
-            Serial.println("[FSM] CMD_UP_FAST received");
-            pd = fast_pd; ctx->direction = true; ctx->stop_flag = false; ctx->state = STATE_MOVING_UP;
-            Serial.println("[FSM] Moving UP (fast): pd set, direction=true, stop_flag=false, state=MOVING_UP");
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_DOWN_SLOW:
-            Serial.println("[FSM] CMD_DOWN_SLOW received");
-            pd = slow_pd; ctx->direction = false; ctx->stop_flag = false; ctx->state = STATE_MOVING_DOWN;
-            Serial.println("[FSM] Moving DOWN (slow): pd set, direction=false, stop_flag=false, state=MOVING_DOWN");
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_DOWN_MEDIUM:
-            Serial.println("[FSM] CMD_DOWN_MEDIUM received");
-            pd = med_pd; ctx->direction = false; ctx->stop_flag = false; ctx->state = STATE_MOVING_DOWN;
-            Serial.println("[FSM] Moving DOWN (medium): pd set, direction=false, stop_flag=false, state=MOVING_DOWN");
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_DOWN_FAST:
-            Serial.println("[FSM] CMD_DOWN_FAST received");
-            pd = fast_pd; ctx->direction = false; ctx->stop_flag = false; ctx->state = STATE_MOVING_DOWN;
-            Serial.println("[FSM] Moving DOWN (fast): pd set, direction=false, stop_flag=false, state=MOVING_DOWN");
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_MOVE_TO:
-            Serial.print("[FSM] CMD_MOVE_TO received, param=");
-            Serial.println(msg.param);
-            ctx->move_target = constrain((int)msg.param, STEPPER_POSITION_MIN, STEPPER_POSITION_MAX);
-            pd = moveto_pd;
-            Serial.print("[FSM] Starting move-to: target=");
-            Serial.println(ctx->move_target);
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            fsm_start_move_to(ctx, ctx->move_target);
-            break;
-            // Print state change summary
-            if (ctx->state != prev_state || ctx->stop_flag != prev_stop || ctx->position != prev_pos) {
-                Serial.print("[FSM] State change: state=");
-                Serial.print(ctx->state);
-                Serial.print(" stop_flag=");
-                Serial.print(ctx->stop_flag);
-                Serial.print(" position=");
-                Serial.println(ctx->position);
-            }
-        case CMD_SLOW_SPEED_PULSE_DELAY:
-            slow_pd = max(1, (int)msg.param);
-            prefs.putLong("slow_pd", slow_pd);
-            Serial.print("Updated slow_pd to "); Serial.println(slow_pd);
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_MEDIUM_SPEED_PULSE_DELAY:
-            med_pd = max(1, (int)msg.param);
-            prefs.putLong("med_pd", med_pd);
-            Serial.print("Updated med_pd to "); Serial.println(med_pd);
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_FAST_SPEED_PULSE_DELAY:
-            fast_pd = max(1, (int)msg.param);
-            prefs.putLong("fast_pd", fast_pd);
-            Serial.print("Updated fast_pd to "); Serial.println(fast_pd);
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        case CMD_MOVE_TO_PULSE_DELAY:
-            moveto_pd = max(1, (int)msg.param);
-            prefs.putLong("moveto_pd", moveto_pd);
-            Serial.print("Updated moveto_pd to "); Serial.println(moveto_pd);
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            break;
-        // ...existing code...
-        case CMD_GET_POSITION:
-            send_message(CMD_GET_POSITION, ctx->position, msg.messageId);
-            break;
-        case CMD_RESET:
-            ctx->stop_flag = true;
-            ctx->state = STATE_RESETTING;
-            send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
-            Serial.println("[DEBUG] CMD_RESET received: preparing to restart controller...");
-            delay(100);
-            Serial.println("[DEBUG] Calling ESP.restart() now...");
-            ESP.restart();
-            Serial.println("[DEBUG] ESP.restart() returned (should not happen)");
-            break;
-        default:
-            // Unknown command
-            break;
+static void fsm_homing_failed(StepperContext *ctx, const char *reason) {
+    profile_end(ctx->axis);
+    step_engine_stop(ctx->axis);
+    LOG_WARN("[FSM] Homing failed: %s", reason);
+    ctx->stop_flag = true;
+    ctx->state = STATE_IDLE;
+    fsm_reply(ctx, CMD_HOME_FAILED, STEPPER_PARAM_UNUSED);
+}
+
+// End of the profile pass: fit the dip and head for its centre, which becomes
+// the home step. The pass runs downwards, one position per step.
+static void fsm_finish_profile(StepperContext *ctx, bool captured, uint32_t edge_steps) {
+    ProfileFit fit;
+    bool fitted = profile_fit(fit);
+    profile_end(ctx->axis);
+    if (!fitted) {
+        fsm_homing_failed(ctx, "reflectance dip too shallow");
+        return;
     }
+    int32_t travelled_q8 = (int32_t)(step_engine_step_count(ctx->axis) - ctx->home_phase_steps) * 256;
+    int32_t center_q8 = step_engine_position(ctx->axis) * 256 + travelled_q8 - fit.center_q8;
+    int center = (center_q8 + 128) >> 8;
+    int32_t residual_q8 = center_q8 - center * 256;
+    int32_t edge_q8 = PROFILE_NO_EDGE;
+    if (captured) edge_q8 = (int32_t)(edge_steps - ctx->home_phase_steps) * 256 - fit.center_q8;
+    profile_record(ctx->axis, fit, residual_q8, edge_q8);
+    LOG_INFO("[FSM] Homing: dip centre %d/256 step off the home step, width %d/256, D0 edge %d/256", residual_q8,
+             fit.width_q8, edge_q8);
+    fsm_home_phase(ctx, HOME_SETTLE);
+    step_engine_move_to(ctx->axis, center, HOME_APPROACH_PD);
 }
 
-void fsm_handle(StepperContext *ctx, unsigned long now_micros, unsigned long step_period) {
-    switch (ctx->state) {
-        case STATE_MOVING_UP:
-            if (ctx->stop_flag) {
-                ctx->stop_flag = true;
-                ctx->state = STATE_IDLE;
+static void fsm_supervise_homing(StepperContext *ctx) {
+    int edge_position;
+    uint32_t edge_steps;
+    bool captured = step_engine_captured(ctx->axis, edge_position, edge_steps);
+    uint32_t travelled = step_engine_step_count(ctx->axis) - ctx->home_phase_steps;
+    uint32_t max_travel = (uint32_t)(HOME_TRAVEL_RANGES * (fsm_max_pos(ctx) - fsm_min_pos(ctx)));
+    switch (ctx->home_phase) {
+        case HOME_FAST_APPROACH:
+            if (!captured) {
+                if (travelled > max_travel) fsm_homing_failed(ctx, "mark not found");
                 break;
             }
-            if (now_micros - last_step_micros >= step_period) {
-                single_step(pd, true);
-                last_step_micros = now_micros;
-                if (millis() - last_send_time >= SEND_INTERVAL_MS) {
-                    send_message(CMD_POSITION, ctx->position);
-                    last_send_time = millis();
-                }
-            }
-            break;
-        case STATE_MOVING_DOWN:
-            if (ctx->stop_flag) {
-                ctx->stop_flag = true;
-                ctx->state = STATE_IDLE;
+            if (step_engine_running(ctx->axis)) {
+                step_engine_decelerate(ctx->axis);
                 break;
             }
-            if (now_micros - last_step_micros >= step_period) {
-                single_step(pd, false);
-                last_step_micros = now_micros;
-                if (millis() - last_send_time >= SEND_INTERVAL_MS) {
-                    send_message(CMD_POSITION, ctx->position);
-                    last_send_time = millis();
-                }
+            {
+                // Stopped past the edge; the edge is that many steps above us
+                int overshoot = (int)(step_engine_step_count(ctx->axis) - edge_steps);
+                int provisional = fsm_min_pos(ctx) + HOME_BACKOFF_STEPS;
+                step_engine_set_position(ctx->axis, provisional);
+                LOG_INFO("[FSM] Homing: fast pass overshoot %d steps", overshoot);
+                fsm_home_phase(ctx, HOME_BACK_OFF);
+                step_engine_move_to(ctx->axis, provisional + overshoot + HOME_BACKOFF_STEPS,
+                                    pulse_delays[ctx->axis].fast_pd);
             }
             break;
-        case STATE_MOVING_TO:
-            if (ctx->stop_flag) {
-                ctx->stop_flag = true; ctx->state = STATE_IDLE; send_message(CMD_POSITION, ctx->position);
+        case HOME_BACK_OFF:
+            if (step_engine_running(ctx->axis)) break;
+            if (hal_digital_read(fsm_sensor_pin(ctx)) == LOW) {
+                fsm_homing_failed(ctx, "sensor still on the mark after backing off");
                 break;
             }
-            if (ctx->position == ctx->move_target) {
-                ctx->stop_flag = true; ctx->state = STATE_IDLE;
-                send_message(CMD_POSITION, ctx->position);
-                Serial.print("Move To completed. Final position = "); Serial.println(ctx->position);
-                break;
+            fsm_home_phase(ctx, HOME_SLOW_APPROACH);
+            step_engine_capture_arm(ctx->axis);
+            if (profile_enabled() &&
+                profile_begin(ctx->axis, AXIS_CONFIGS[ctx->axis].analog_pin, ctx->home_phase_steps)) {
+                ctx->home_phase = HOME_PROFILE_PASS;
             }
-            if (now_micros - last_step_micros >= step_period) {
-                bool dir = (ctx->move_target > ctx->position);
-                single_step(pd, dir);
-                last_step_micros = now_micros;
-                if (millis() - last_send_time >= SEND_INTERVAL_MS) {
-                    send_message(CMD_POSITION, ctx->position);
-                    last_send_time = millis();
-                }
+            step_engine_run(ctx->axis, HOME_APPROACH_PD, false, false);
+            break;
+        case HOME_PROFILE_PASS: {
+            // Keeps sampling while the engine ramps down after the dip
+            uint32_t step_us;
+            uint32_t step_count = step_engine_last_step(ctx->axis, step_us);
+            switch (profile_update(step_count, step_us)) {
+                case PROFILE_SCANNING:
+                    break;
+                case PROFILE_FULL:
+                    fsm_homing_failed(ctx, "no reflectance dip on A0");
+                    break;
+                case PROFILE_OVERRUN:
+                    fsm_homing_failed(ctx, "ADC dropped samples on A0");
+                    break;
+                case PROFILE_PASSED:
+                    if (step_engine_running(ctx->axis)) step_engine_decelerate(ctx->axis);
+                    else fsm_finish_profile(ctx, captured, edge_steps);
+                    break;
             }
             break;
-        case STATE_MOVE_TO_HOME: {
-            // Use TCRT5000 digital output on pin 2 for limit detection
-            if (ctx->stop_flag) {
-                ctx->stop_flag = true;
-                ctx->state = STATE_IDLE;
-                ctx->position = STEPPER_POSITION_MIN;
+        }
+        case HOME_SLOW_APPROACH:
+            if (!captured) {
+                if (travelled > (uint32_t)(4 * HOME_BACKOFF_STEPS)) fsm_homing_failed(ctx, "edge lost on slow pass");
                 break;
             }
-            // Read TCRT5000 digital output (LOW = detected, HIGH = not detected)
-            int tcrt5000_state = digitalRead(2);
-            if (tcrt5000_state == LOW) { // Detected (reflective surface or object present)
-                Serial.println("[FSM] TCRT5000 detected: at home (white mark)");
-                ctx->stop_flag = true;
-                ctx->state = STATE_IDLE;
-                ctx->position = STEPPER_POSITION_MIN;
-                send_message(CMD_HOME_COMPLETE, ctx->position); // Notify home complete
+            if (step_engine_running(ctx->axis)) {
+                step_engine_decelerate(ctx->axis);
                 break;
             }
-            if (now_micros - last_step_micros >= step_period) {
-                single_step(pd, false);
-                last_step_micros = now_micros;
-                if (millis() - last_send_time >= SEND_INTERVAL_MS) {
-                    send_message(CMD_POSITION, ctx->position);
-                    last_send_time = millis();
-                }
-            }
+            LOG_DEBUG("[FSM] Homing: edge at %d, stopped at %d", edge_position, step_engine_position(ctx->axis));
+            fsm_home_phase(ctx, HOME_SETTLE);
+            step_engine_move_to(ctx->axis, edge_position, HOME_APPROACH_PD);
             break;
-        }
-        case STATE_RESETTING:
-        case STATE_IDLE:
-        default:
-            // idle: nothing to do
+        case HOME_SETTLE:
+            if (step_engine_running(ctx->axis)) break;
+            LOG_INFO("[FSM] TCRT5000 edge reached: at home (white mark)");
+            ctx->stop_flag = true;
+            ctx->state = STATE_IDLE;
+            ctx->position = fsm_min_pos(ctx);
+            ctx->homed = true;
+            step_engine_set_position(ctx->axis, ctx->position);
+            fsm_reply(ctx, CMD_HOME_COMPLETE, ctx->position); // Notify home complete
             break;
     }
 }
+
+bool fsm_restore_position(StepperContext *ctx, int pos) {
+    // Homing leaves the axis' min_pos on the mark's upper edge step, so the
+    // sensor reads the mark there and nowhere above it. Profiled homing puts it
+    // mid-mark instead; positions just above it are then rejected and re-homed.
+    bool on_mark = hal_digital_read(fsm_sensor_pin(ctx)) == LOW;
+    if (pos < fsm_min_pos(ctx) || pos > fsm_max_pos(ctx) || on_mark != (pos == fsm_min_pos(ctx))) {
+        LOG_WARN("[FSM] Restore of position %d rejected: sensor %s", pos, on_mark ? "on the mark" : "off the mark");
+        return false;
+    }
+    ctx->position = pos;
+    ctx->move_target = pos;
+    ctx->homed = true;
+    step_engine_set_position(ctx->axis, pos);
+    LOG_INFO("[FSM] Position %d restored", pos);
+    return true;
+}
+
+StepperContext *fsm_route(StepperContext *axes, Message &msg) {
+    uint8_t axis = axis_from_param(msg.param);
+    if (axis >= AXIS_COUNT) {
+        LOG_WARN("[FSM] Command %d for unknown axis %u dropped", (int)msg.command, axis);
+        return nullptr;
+    }
+    msg.param = axis_value(msg.param);
+    return &axes[axis];
+}
+
+// Helper for move-to operation
+static void fsm_start_move_to(StepperContext *ctx, int pos) {
+    ctx->position = step_engine_position(ctx->axis); // the engine may have moved since the last tick
+    int difference = pos - ctx->position;
+    LOG_INFO("Position = %d     move to = %d   Diff = %d", ctx->position, pos, difference);
+    // A running motor passing the target ramps down past it and comes back
+    if (difference == 0 && !step_engine_running(ctx->axis)) {
+        LOG_INFO("Already at target position");
+        step_engine_stop(ctx->axis);
+        ctx->stop_flag = true;
+        ctx->state = STATE_IDLE;
+        fsm_reply(ctx, CMD_POSITION, ctx->position);
+    } else {
+        ctx->move_target = pos;
+        ctx->state = STATE_MOVING_TO;
+        ctx->stop_flag = false;
+        step_engine_move_to(ctx->axis, pos, ctx->pd);
+    }
+}
+
+static void fsm_start_trajectory(StepperContext *ctx) {
+    ctx->position = step_engine_position(ctx->axis);
+    ctx->segment_from = ctx->position;
+    ctx->move_target = ctx->position; // nothing planned yet
+    ctx->dwelling = false;
+    ctx->stop_flag = false;
+    ctx->state = STATE_TRAJECTORY;
+    ctx->pd = pulse_delays[ctx->axis].moveto_pd;
+    LOG_INFO("[FSM] Trajectory started at %d", ctx->position);
+}
+
+// Each waypoint still buffered is reported as cancelled before the buffer is emptied
+static void fsm_cancel_trajectory(StepperContext *ctx) {
+    for (size_t i = 0; i < trajectory_count(ctx->axis); ++i) {
+        fsm_reply(ctx, CMD_WAYPOINT_STATUS, WAYPOINT_CANCELLED, trajectory_at(ctx->axis, i).messageId);
+    }
+    trajectory_clear(ctx->axis);
+}
+
+void fsm_cancel_waypoint(StepperContext *ctx, const Message &msg) {
+    LOG_INFO("[FSM] Waypoint id=%u discarded by the command queue", msg.messageId);
+    fsm_reply(ctx, CMD_WAYPOINT_STATUS, WAYPOINT_CANCELLED, msg.messageId);
+}
+
+// A waypoint is reached once the carriage is at or past it, seen from where its
+// segment started. The waypoint the engine is aimed at must also be at rest, so
+// stops are exact; waypoints passed at speed report where the carriage was.
+static void fsm_supervise_trajectory(StepperContext *ctx) {
+    if (ctx->dwelling) {
+        if ((long)(hal_millis() - ctx->dwell_until_ms) < 0) return;
+        ctx->dwelling = false;
+    }
+    bool running = step_engine_running(ctx->axis);
+    while (trajectory_count(ctx->axis)) {
+        const Waypoint &wp = trajectory_at(ctx->axis, 0);
+        bool passed = (ctx->position - wp.position) * (wp.position - ctx->segment_from) >= 0;
+        if (!passed || (running && wp.position == ctx->move_target)) break;
+        fsm_reply(ctx, CMD_WAYPOINT_STATUS, ctx->position, wp.messageId);
+        ctx->segment_from = wp.position;
+        uint16_t dwell_ms = wp.dwell_ms;
+        trajectory_pop(ctx->axis);
+        if (dwell_ms) {
+            ctx->dwelling = true;
+            ctx->dwell_until_ms = hal_millis() + dwell_ms;
+            return;
+        }
+    }
+    if (!trajectory_count(ctx->axis)) {
+        ctx->stop_flag = true;
+        ctx->state = STATE_IDLE;
+        fsm_reply(ctx, CMD_POSITION, ctx->position);
+        LOG_INFO("[FSM] Trajectory completed at %d", ctx->position);
+        return;
+    }
+    int target = trajectory_blend_target(ctx->axis, ctx->segment_from);
+    if (target != ctx->move_target || !running) {
+        ctx->move_target = target;
+        step_engine_move_to(ctx->axis, target, ctx->pd);
+    }
+}
+
+// Velocity jog. Speed changes in the same direction go through the planner, so
+// they follow the ramp table at MOTION_ACCEL_STEPS_PER_S2. A reversal or a zero
+// setpoint ramps down first; the new direction starts from rest on a later tick.
+static void fsm_track_velocity(StepperContext *ctx, bool new_setpoint) {
+    bool running = step_engine_running(ctx->axis);
+    int32_t velocity = ctx->velocity;
+    bool dir = velocity > 0;
+    if (velocity == 0 || (running && dir != step_engine_direction(ctx->axis))) {
+        if (running) {
+            step_engine_decelerate(ctx->axis);
+            return;
+        }
+        if (velocity == 0) {
+            ctx->stop_flag = true;
+            ctx->state = STATE_IDLE;
+            fsm_reply(ctx, CMD_POSITION, ctx->position);
+            LOG_INFO("[FSM] Velocity jog stopped at %d", ctx->position);
+            return;
+        }
+    }
+    if (running && !new_setpoint) return;
+    // Held against a soft limit: wait for a setpoint that points away from it
+    if (!running && (dir ? ctx->position >= fsm_max_pos(ctx) : ctx->position <= fsm_min_pos(ctx))) return;
+    ctx->pd = max(1L, 500000L / abs(velocity));
+    ctx->direction = dir;
+    step_engine_run(ctx->axis, ctx->pd, dir);
+}
+
+static void fsm_set_velocity(StepperContext *ctx, int32_t velocity) {
+    ctx->velocity = constrain(velocity, -VELOCITY_MAX_STEPS_PER_S, VELOCITY_MAX_STEPS_PER_S);
+    ctx->velocity_until_ms = hal_millis() + VELOCITY_TIMEOUT_MS;
+    if (ctx->state != STATE_VELOCITY) {
+        if (ctx->velocity == 0 && ctx->state == STATE_IDLE) return;
+        ctx->position = step_engine_position(ctx->axis);
+        ctx->stop_flag = false;
+        ctx->state = STATE_VELOCITY;
+        LOG_INFO("[FSM] Velocity jog started at %d", ctx->position);
+    }
+    fsm_track_velocity(ctx, true);
+}
+
+static void fsm_supervise_velocity(StepperContext *ctx) {
+    if (ctx->velocity != 0 && (long)(hal_millis() - ctx->velocity_until_ms) >= 0) {
+        LOG_WARN("[FSM] Velocity setpoints stopped arriving, ramping down");
+        ctx->velocity = 0;
+    }
+    fsm_track_velocity(ctx, false);
+}
+
+// ---------------------------------------------------------------------------
+// Command handlers. Each command has one descriptor in COMMAND_TABLE below;
+// handlers that serve several commands read their parameters from it.
+
+struct CommandDescriptor;
+using CommandHandler = void (*)(StepperContext *ctx, const Message &msg, const CommandDescriptor &cmd);
+
+struct CommandDescriptor {
+    CommandType command;
+    CommandHandler handler;
+    uint16_t from;              // states that take it (fsm_state_bit())
+    uint16_t to;                // states the handler may leave behind; 0 = state unchanged
+    bool ack;                   // ACK before the handler runs; replies carry the messageId instead
+    bool up;                    // jogs: direction
+    long PulseDelays::*delay;   // jogs: speed; pulse-delay updates: the value to set
+};
+
+static void fsm_halt(StepperContext *ctx);
+
+static void fsm_cmd_stop(StepperContext *ctx, const Message &, const CommandDescriptor &) {
+    ctx->stop_flag = true;
+    fsm_halt(ctx);
+}
+
+static void fsm_cmd_home(StepperContext *ctx, const Message &, const CommandDescriptor &) {
+    fsm_start_homing(ctx);
+}
+
+// Read and report sensor status (TCRT5000, LOW = white mark)
+static void fsm_cmd_sensor_status(StepperContext *ctx, const Message &msg, const CommandDescriptor &) {
+    fsm_reply(ctx, CMD_SENSOR_STATUS, hal_digital_read(fsm_sensor_pin(ctx)), msg.messageId);
+}
+
+// Status commands sent to the controller are echoed back
+static void fsm_cmd_echo(StepperContext *ctx, const Message &msg, const CommandDescriptor &cmd) {
+    fsm_reply(ctx, cmd.command, STEPPER_PARAM_UNUSED, msg.messageId);
+}
+
+static void fsm_cmd_jog(StepperContext *ctx, const Message &, const CommandDescriptor &cmd) {
+    ctx->pd = pulse_delays[ctx->axis].*cmd.delay;
+    ctx->direction = cmd.up;
+    ctx->stop_flag = false;
+    ctx->state = cmd.up ? STATE_MOVING_UP : STATE_MOVING_DOWN;
+    step_engine_run(ctx->axis, ctx->pd, cmd.up);
+}
+
+static void fsm_cmd_move_to(StepperContext *ctx, const Message &msg, const CommandDescriptor &) {
+    ctx->move_target = constrain((int)msg.param, fsm_min_pos(ctx), fsm_max_pos(ctx));
+    ctx->pd = pulse_delays[ctx->axis].moveto_pd;
+    fsm_start_move_to(ctx, ctx->move_target);
+}
+
+static void fsm_cmd_move_to_freq(StepperContext *ctx, const Message &msg, const CommandDescriptor &) {
+    int target;
+    // Table positions only mean something once homed
+    if (!ctx->homed || msg.param <= 0 || !tuning_lookup(ctx->axis, (uint32_t)msg.param, target)) {
+        LOG_WARN("[FSM] No calibrated position for %d Hz on axis %u", msg.param, ctx->axis);
+        fsm_reply(ctx, CMD_MOVE_TO_FREQ, TUNING_REJECTED, msg.messageId);
+        return;
+    }
+    ctx->move_target = constrain(target, fsm_min_pos(ctx), fsm_max_pos(ctx));
+    ctx->pd = pulse_delays[ctx->axis].moveto_pd;
+    fsm_start_move_to(ctx, ctx->move_target);
+}
+
+static void fsm_cmd_tune_point(StepperContext *ctx, const Message &msg, const CommandDescriptor &) {
+    if (msg.param == TUNING_CLEAR) {
+        tuning_clear(ctx->axis);
+        fsm_reply(ctx, CMD_TUNE_POINT, 0, msg.messageId);
+        return;
+    }
+    if (!ctx->homed || msg.param < 0 || ctx->state != STATE_IDLE || step_engine_running(ctx->axis)) {
+        LOG_WARN("[FSM] Tuning point %d Hz on axis %u rejected: not homed or not at rest", msg.param, ctx->axis);
+        fsm_reply(ctx, CMD_TUNE_POINT, TUNING_REJECTED, msg.messageId);
+        return;
+    }
+    ctx->position = step_engine_position(ctx->axis);
+    size_t count = tuning_learn(ctx->axis, (uint32_t)msg.param, ctx->position);
+    fsm_reply(ctx, CMD_TUNE_POINT, (int32_t)count, msg.messageId);
+}
+
+static void fsm_cmd_pulse_delay(StepperContext *ctx, const Message &msg, const CommandDescriptor &cmd) {
+    long &delay = pulse_delays[ctx->axis].*cmd.delay;
+    delay = max(1, (int)msg.param);
+    config_mark_dirty(); // committed by the service task once the value settles
+    LOG_INFO("[FSM] %s of axis %u set to %d", commandToString(cmd.command), ctx->axis, delay);
+}
+
+static void fsm_cmd_get_position(StepperContext *ctx, const Message &msg, const CommandDescriptor &) {
+    fsm_reply(ctx, CMD_GET_POSITION, ctx->position, msg.messageId);
+}
+
+static void fsm_cmd_reset(StepperContext *ctx, const Message &, const CommandDescriptor &) {
+    for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) step_engine_stop(axis);
+    ctx->stop_flag = true;
+    ctx->state = STATE_RESETTING;
+    LOG_DEBUG("[DEBUG] CMD_RESET received: preparing to restart controller...");
+    config_request_restart(); // the service task flushes the config and tuning tables first
+}
+
+static void fsm_cmd_perf_stats(StepperContext *, const Message &msg, const CommandDescriptor &) {
+    perf_report(msg.messageId, (msg.param & PERF_PARAM_RESET) != 0);
+}
+
+static void fsm_cmd_latency_stats(StepperContext *, const Message &msg, const CommandDescriptor &) {
+    latency_report(msg.messageId, (msg.param & LATENCY_PARAM_RESET) != 0);
+}
+
+static void fsm_cmd_profile(StepperContext *ctx, const Message &msg, const CommandDescriptor &) {
+    profile_report(ctx->axis, msg.messageId);
+}
+
+static void fsm_cmd_trace(StepperContext *, const Message &msg, const CommandDescriptor &) {
+    trace_request_dump((msg.param & TRACE_PARAM_RESTART) != 0);
+}
+
+static void fsm_cmd_waypoint(StepperContext *ctx, const Message &msg, const CommandDescriptor &) {
+    Waypoint wp = waypoint_from_param(msg.param, msg.messageId);
+    wp.position = (int16_t)constrain((int)wp.position, fsm_min_pos(ctx), fsm_max_pos(ctx));
+    LOG_INFO("[FSM] Waypoint: position=%d dwell=%ums", wp.position, wp.dwell_ms);
+    if (!trajectory_push(ctx->axis, wp)) {
+        LOG_WARN("[FSM] Trajectory buffer full, waypoint id=%u rejected", msg.messageId);
+        fsm_reply(ctx, CMD_WAYPOINT_STATUS, WAYPOINT_REJECTED, msg.messageId);
+        return;
+    }
+    if (ctx->state != STATE_TRAJECTORY) fsm_start_trajectory(ctx);
+}
+
+// Streamed at a high rate: the receive callback's ACK is the only one
+static void fsm_cmd_jog_velocity(StepperContext *ctx, const Message &msg, const CommandDescriptor &) {
+    fsm_set_velocity(ctx, msg.param);
+}
+
+// State sets for the tables
+constexpr uint16_t STAY = 0; // no state change
+constexpr uint16_t ANY = (uint16_t)((1u << STATE_COUNT) - 1);
+constexpr uint16_t LIVE = FSM_COMMAND_STATES;
+constexpr uint16_t TO_IDLE = fsm_state_bit(STATE_IDLE);
+constexpr uint16_t TO_UP = fsm_state_bit(STATE_MOVING_UP);
+constexpr uint16_t TO_DOWN = fsm_state_bit(STATE_MOVING_DOWN);
+constexpr uint16_t TO_HOME = fsm_state_bit(STATE_MOVE_TO_HOME);
+constexpr uint16_t TO_MOVE = fsm_state_bit(STATE_MOVING_TO) | TO_IDLE; // IDLE when already there
+constexpr uint16_t TO_RESET = fsm_state_bit(STATE_RESETTING);
+constexpr uint16_t TO_TRAJECTORY = fsm_state_bit(STATE_TRAJECTORY);
+constexpr uint16_t TO_VELOCITY = fsm_state_bit(STATE_VELOCITY) | TO_IDLE; // IDLE on a zero setpoint
+
+// Every command the FSM takes. Unlisted codes are logged and dropped, and so
+// is a command that arrives in a state outside its `from` set.
+constexpr CommandDescriptor COMMAND_TABLE[] = {
+    // command                     handler                from  to             ack    up     delay
+    {CMD_STOP,                     fsm_cmd_stop,          LIVE, TO_IDLE,       true,  false, nullptr},
+    {CMD_HOME,                     fsm_cmd_home,          LIVE, TO_HOME,       true,  false, nullptr},
+    {CMD_MOVE_TO_HOME,             fsm_cmd_home,          LIVE, TO_HOME,       true,  false, nullptr},
+    {CMD_SENSOR_STATUS,            fsm_cmd_sensor_status, ANY,  STAY,          false, false, nullptr},
+    {CMD_HOME_COMPLETE,            fsm_cmd_echo,          ANY,  STAY,          false, false, nullptr},
+    {CMD_HOME_FAILED,              fsm_cmd_echo,          ANY,  STAY,          false, false, nullptr},
+    {CMD_SENSOR_ERROR,             fsm_cmd_echo,          ANY,  STAY,          false, false, nullptr},
+    {CMD_UP_SLOW,                  fsm_cmd_jog,           LIVE, TO_UP,         true,  true,  &PulseDelays::slow_pd},
+    {CMD_UP_MEDIUM,                fsm_cmd_jog,           LIVE, TO_UP,         true,  true,  &PulseDelays::med_pd},
+    {CMD_UP_FAST,                  fsm_cmd_jog,           LIVE, TO_UP,         true,  true,  &PulseDelays::fast_pd},
+    {CMD_DOWN_SLOW,                fsm_cmd_jog,           LIVE, TO_DOWN,       true,  false, &PulseDelays::slow_pd},
+    {CMD_DOWN_MEDIUM,              fsm_cmd_jog,           LIVE, TO_DOWN,       true,  false, &PulseDelays::med_pd},
+    {CMD_DOWN_FAST,                fsm_cmd_jog,           LIVE, TO_DOWN,       true,  false, &PulseDelays::fast_pd},
+    {CMD_MOVE_TO,                  fsm_cmd_move_to,       LIVE, TO_MOVE,       true,  false, nullptr},
+    {CMD_SLOW_SPEED_PULSE_DELAY,   fsm_cmd_pulse_delay,   LIVE, STAY,          true,  false, &PulseDelays::slow_pd},
+    {CMD_MEDIUM_SPEED_PULSE_DELAY, fsm_cmd_pulse_delay,   LIVE, STAY,          true,  false, &PulseDelays::med_pd},
+    {CMD_FAST_SPEED_PULSE_DELAY,   fsm_cmd_pulse_delay,   LIVE, STAY,          true,  false, &PulseDelays::fast_pd},
+    {CMD_MOVE_TO_PULSE_DELAY,      fsm_cmd_pulse_delay,   LIVE, STAY,          true,  false, &PulseDelays::moveto_pd},
+    {CMD_GET_POSITION,             fsm_cmd_get_position,  ANY,  STAY,          false, false, nullptr},
+    {CMD_RESET,                    fsm_cmd_reset,         LIVE, TO_RESET,      true,  false, nullptr},
+    // Controller-local commands (controller_commands.h)
+    {CMD_PERF_STATS,               fsm_cmd_perf_stats,    ANY,  STAY,          true,  false, nullptr},
+    {CMD_WAYPOINT,                 fsm_cmd_waypoint,      LIVE, TO_TRAJECTORY, true,  false, nullptr},
+    {CMD_JOG_VELOCITY,             fsm_cmd_jog_velocity,  LIVE, TO_VELOCITY,   false, false, nullptr},
+    {CMD_LATENCY_STATS,            fsm_cmd_latency_stats, ANY,  STAY,          true,  false, nullptr},
+    {CMD_SENSOR_PROFILE,           fsm_cmd_profile,       ANY,  STAY,          true,  false, nullptr},
+    {CMD_MOVE_TO_FREQ,             fsm_cmd_move_to_freq,  LIVE, TO_MOVE,       true,  false, nullptr},
+    {CMD_TUNE_POINT,               fsm_cmd_tune_point,    LIVE, STAY,          true,  false, nullptr},
+    {CMD_TRACE,                    fsm_cmd_trace,         ANY,  STAY,          true,  false, nullptr},
+};
+constexpr size_t COMMAND_COUNT = sizeof(COMMAND_TABLE) / sizeof(COMMAND_TABLE[0]);
+
+// Command code -> COMMAND_TABLE slot, built at compile time
+constexpr uint8_t COMMAND_UNKNOWN = 0xFF;
+static_assert(COMMAND_COUNT < COMMAND_UNKNOWN, "command slots must fit uint8_t");
+
+struct CommandIndex {
+    uint8_t slot[256];
+};
+
+constexpr CommandIndex command_index() {
+    CommandIndex index = {};
+    for (uint8_t &slot : index.slot) slot = COMMAND_UNKNOWN;
+    for (size_t i = 0; i < COMMAND_COUNT; ++i) index.slot[(uint8_t)COMMAND_TABLE[i].command] = (uint8_t)i;
+    return index;
+}
+
+constexpr CommandIndex COMMAND_INDEX = command_index();
+
+constexpr bool commands_unique() {
+    for (size_t i = 0; i < COMMAND_COUNT; ++i) {
+        if (COMMAND_INDEX.slot[(uint8_t)COMMAND_TABLE[i].command] != i) return false;
+    }
+    return true;
+}
+static_assert(commands_unique(), "a command is listed twice in COMMAND_TABLE");
+
+// Every state change a table entry allows must be in FSM_TRANSITIONS
+constexpr bool transitions_legal(uint16_t from, uint16_t to) {
+    for (uint8_t s = 0; s < STATE_COUNT; ++s) {
+        if (!(from & (1u << s))) continue;
+        for (uint8_t t = 0; t < STATE_COUNT; ++t) {
+            if ((to & (1u << t)) && !fsm_transition_legal((StepperState)s, (StepperState)t)) return false;
+        }
+    }
+    return true;
+}
+
+constexpr bool commands_legal() {
+    for (const CommandDescriptor &cmd : COMMAND_TABLE) {
+        if (!transitions_legal(cmd.from, cmd.to)) return false;
+    }
+    return true;
+}
+static_assert(commands_legal(), "COMMAND_TABLE makes a transition FSM_TRANSITIONS does not allow");
+
+void fsm_handle_command(StepperContext *ctx, const Message &msg) {
+    uint32_t perf_start = perf_begin();
+    LOG_INFO("[FSM] Handling command: %s param=%d id=%u", commandToString(msg.command), msg.param, msg.messageId);
+    uint8_t slot = COMMAND_INDEX.slot[(uint8_t)msg.command];
+    if (slot == COMMAND_UNKNOWN) {
+        LOG_WARN("[FSM] Unknown command %u", msg.command);
+    } else if (!(COMMAND_TABLE[slot].from & fsm_state_bit(ctx->state))) {
+        LOG_WARN("[FSM] %s ignored in state %d", commandToString(msg.command), ctx->state);
+    } else {
+        const CommandDescriptor &cmd = COMMAND_TABLE[slot];
+        if (cmd.ack) send_message(CMD_ACK, STEPPER_PARAM_UNUSED, msg.messageId);
+        StepperState prev_state = ctx->state;
+        cmd.handler(ctx, msg, cmd);
+        if (ctx->state != prev_state) {
+            LOG_DEBUG("[FSM] State %d -> %d, position=%d", prev_state, ctx->state, ctx->position);
+        }
+        trace_state(ctx->axis, prev_state, ctx->state, ctx->position);
+    }
+    // Any command that ends the trajectory (STOP, a jog, a move, homing) drops what is left of it
+    if (ctx->state != STATE_TRAJECTORY) fsm_cancel_trajectory(ctx);
+    // Likewise a command that ends homing releases the ADC stream of its profile pass
+    if (ctx->state != STATE_MOVE_TO_HOME) profile_end(ctx->axis);
+    perf_end(PERF_COMMAND, perf_start);
+}
+
+// ---------------------------------------------------------------------------
+// Supervision. STATE_TABLE holds what fsm_handle() does in each state.
+
+// Jogs and move-to: the engine stops itself at the target or soft limit
+static void fsm_supervise_motion(StepperContext *ctx) {
+    if (step_engine_running(ctx->axis)) return;
+    ctx->stop_flag = true;
+    ctx->state = STATE_IDLE;
+    fsm_reply(ctx, CMD_POSITION, ctx->position);
+    LOG_INFO("[FSM] Motion completed at %d", ctx->position);
+}
+
+static void fsm_stopped_move_to(StepperContext *ctx) {
+    fsm_reply(ctx, CMD_POSITION, ctx->position);
+}
+
+static void fsm_stopped_homing(StepperContext *ctx) {
+    profile_end(ctx->axis);
+    ctx->position = fsm_min_pos(ctx);
+    step_engine_set_position(ctx->axis, ctx->position);
+}
+
+static void fsm_stopped_trajectory(StepperContext *ctx) {
+    fsm_cancel_trajectory(ctx);
+}
+
+struct StateDescriptor {
+    StepperState state;
+    void (*supervise)(StepperContext *ctx); // nullptr: nothing moves in this state
+    void (*stopped)(StepperContext *ctx);   // after stop_flag halted the motor; may be nullptr
+    uint16_t exits;                         // states supervise may move to
+};
+
+// Indexed by StepperState
+constexpr StateDescriptor STATE_TABLE[STATE_COUNT] = {
+    {STATE_IDLE,         nullptr,                  nullptr,                STAY},
+    {STATE_MOVING_UP,    fsm_supervise_motion,     nullptr,                TO_IDLE},
+    {STATE_MOVING_DOWN,  fsm_supervise_motion,     nullptr,                TO_IDLE},
+    {STATE_MOVING_TO,    fsm_supervise_motion,     fsm_stopped_move_to,    TO_IDLE},
+    {STATE_MOVE_TO_HOME, fsm_supervise_homing,     fsm_stopped_homing,     TO_IDLE},
+    {STATE_RESETTING,    nullptr,                  nullptr,                STAY},
+    {STATE_TRAJECTORY,   fsm_supervise_trajectory, fsm_stopped_trajectory, TO_IDLE},
+    {STATE_VELOCITY,     fsm_supervise_velocity,   nullptr,                TO_IDLE},
+};
+
+constexpr bool states_consistent() {
+    for (uint8_t s = 0; s < STATE_COUNT; ++s) {
+        const StateDescriptor &desc = STATE_TABLE[s];
+        if (desc.state != s) return false;
+        // The stop path always lands in STATE_IDLE
+        uint16_t exits = desc.exits | (desc.supervise ? TO_IDLE : STAY);
+        if (!transitions_legal(fsm_state_bit(desc.state), exits)) return false;
+    }
+    return true;
+}
+static_assert(states_consistent(), "STATE_TABLE out of StepperState order or making an illegal transition");
+
+// Stop the motor and leave the state through its stopped handler, the same way
+// for CMD_STOP and for stop_flag seen by the next supervision pass
+static void fsm_halt(StepperContext *ctx) {
+    const StateDescriptor &state = STATE_TABLE[ctx->state];
+    step_engine_stop(ctx->axis);
+    ctx->position = step_engine_position(ctx->axis);
+    ctx->state = STATE_IDLE;
+    if (state.stopped) state.stopped(ctx);
+}
+
+// Position log while the engine is stepping; the GUI gets it from telemetry frames
+static void fsm_report_position(StepperContext *ctx) {
+    static int last_printed_position[AXIS_COUNT] = {};
+    if (ctx->position != last_printed_position[ctx->axis]) {
+        LOG_DEBUG("Position: %d (axis %u)", ctx->position, ctx->axis);
+        last_printed_position[ctx->axis] = ctx->position;
+    }
+}
+
+// Steps are emitted by the step engine; this only supervises the motion.
+void fsm_handle(StepperContext *ctx) {
+    static unsigned long last_call_us = 0;
+    if (PERF_STATS && ctx->axis == 0) { // one supervision pass covers all axes
+        unsigned long now_us = hal_micros();
+        unsigned long interval_us = now_us - last_call_us;
+        if (last_call_us) perf_record_ns(PERF_SUPERVISE_INTERVAL, interval_us < 4000000UL ? interval_us * 1000U : UINT32_MAX);
+        last_call_us = now_us;
+    }
+    uint32_t perf_start = perf_begin();
+    ctx->position = step_engine_position(ctx->axis);
+    if (ctx->state == STATE_IDLE && trace_sync_due(ctx->axis)) {
+        uint8_t flags = ctx->homed ? TRACE_SYNC_HOMED : 0;
+        if (step_engine_released(ctx->axis)) flags |= TRACE_SYNC_RELEASED;
+        trace_sync(ctx->axis, ctx->state, flags, ctx->position);
+    }
+    StepperState prev_state = ctx->state;
+    const StateDescriptor &state = STATE_TABLE[ctx->state];
+    if (state.supervise) {
+        if (ctx->stop_flag) {
+            fsm_halt(ctx);
+        } else {
+            state.supervise(ctx);
+            fsm_report_position(ctx);
+        }
+        trace_state(ctx->axis, prev_state, ctx->state, ctx->position);
+    }
+    // Persist the resting position (flash writes happen in the service task).
+    // The journal holds axis 0 only; other axes home after a reset. While a
+    // CMD_RESET waits for the service task it keeps what it held at the reset.
+    if (ctx->axis == 0 && ctx->state != STATE_RESETTING) {
+        journal_note(ctx->homed && ctx->state == STATE_IDLE && !step_engine_running(ctx->axis), ctx->position);
+    }
+    perf_end(PERF_SUPERVISE, perf_start);
+}
@@ -2,6 +2,7 @@
 #pragma once
 #include <stdint.h>
 #include "stepper_commands.h"
+#include "axis.h"
 
 // Stepper state machine states
 enum StepperState {
@@ -10,20 +11,82 @@ enum StepperState {
     STATE_MOVING_DOWN,
     STATE_MOVING_TO,
     STATE_MOVE_TO_HOME,
-    STATE_RESETTING
+    STATE_RESETTING,
+    STATE_TRAJECTORY, // running the waypoints in trajectory.h
+    STATE_VELOCITY    // tracking CMD_JOG_VELOCITY setpoints
 };
+constexpr uint8_t STATE_COUNT = STATE_VELOCITY + 1;
 
-// State machine context
+constexpr uint16_t fsm_state_bit(StepperState state) {
+    return (uint16_t)(1u << state);
+}
+
+// States a motion command can start
+constexpr uint16_t FSM_MOTION_STATES = fsm_state_bit(STATE_MOVING_UP) | fsm_state_bit(STATE_MOVING_DOWN) |
+                                       fsm_state_bit(STATE_MOVING_TO) | fsm_state_bit(STATE_MOVE_TO_HOME) |
+                                       fsm_state_bit(STATE_TRAJECTORY) | fsm_state_bit(STATE_VELOCITY);
+// States that take commands; STATE_RESETTING only waits for the restart
+constexpr uint16_t FSM_COMMAND_STATES = fsm_state_bit(STATE_IDLE) | FSM_MOTION_STATES;
+
+// Legal transitions: bit t of FSM_TRANSITIONS[s] allows s -> t. Any command
+// state may start any motion, stop or reset; a motion ends in STATE_IDLE.
+// The command and state tables in fsm.cpp are checked against this at compile
+// time, and the native simulation checks every transition it sees.
+constexpr uint16_t FSM_TRANSITIONS[STATE_COUNT] = {
+    /* STATE_IDLE */         FSM_MOTION_STATES | fsm_state_bit(STATE_RESETTING),
+    /* STATE_MOVING_UP */    FSM_COMMAND_STATES | fsm_state_bit(STATE_RESETTING),
+    /* STATE_MOVING_DOWN */  FSM_COMMAND_STATES | fsm_state_bit(STATE_RESETTING),
+    /* STATE_MOVING_TO */    FSM_COMMAND_STATES | fsm_state_bit(STATE_RESETTING),
+    /* STATE_MOVE_TO_HOME */ FSM_COMMAND_STATES | fsm_state_bit(STATE_RESETTING),
+    /* STATE_RESETTING */    0,
+    /* STATE_TRAJECTORY */   FSM_COMMAND_STATES | fsm_state_bit(STATE_RESETTING),
+    /* STATE_VELOCITY */     FSM_COMMAND_STATES | fsm_state_bit(STATE_RESETTING),
+};
+
+// Staying in a state is always legal
+constexpr bool fsm_transition_legal(StepperState from, StepperState to) {
+    return from == to || (FSM_TRANSITIONS[from] & fsm_state_bit(to)) != 0;
+}
+
+// Velocity jog: ramp down when setpoints stop for this long
+constexpr unsigned long VELOCITY_TIMEOUT_MS = 250;
+
+// Homing passes within STATE_MOVE_TO_HOME
+enum HomePhase {
+    HOME_FAST_APPROACH, // down at fast_pd until the sensor edge interrupt
+    HOME_BACK_OFF,      // up past the edge so the slow pass approaches from above
+    HOME_SLOW_APPROACH, // down at HOME_APPROACH_PD until the edge
+    HOME_PROFILE_PASS,  // instead of the slow approach: down at HOME_APPROACH_PD across the mark, sampling A0
+    HOME_SETTLE         // back onto the captured edge step
+};
+
+// State machine context, one per axis
 struct StepperContext {
+    uint8_t axis;
     StepperState state;
     int move_target;
     int position;
-    long pd;
+    long pd;                   // pulse delay of the current motion
     bool stop_flag;
     bool direction;
+    HomePhase home_phase;
+    uint32_t home_phase_steps; // step count when the current homing pass started
+    bool homed;                // position is referenced to the mark (homing or a verified restore)
+    int segment_from;          // trajectory: waypoint (or start position) the current segment leaves from
+    bool dwelling;
+    unsigned long dwell_until_ms;
+    int32_t velocity;          // velocity jog: setpoint in steps/s, signed
+    unsigned long velocity_until_ms;
 };
 
 // FSM API
-void fsm_init(StepperContext *ctx);
-void fsm_handle(StepperContext *ctx, unsigned long now_micros, unsigned long step_period);
+void fsm_init(StepperContext *ctx, uint8_t axis);
+void fsm_handle(StepperContext *ctx);
 void fsm_handle_command(StepperContext *ctx, const Message &msg);
+// A CMD_WAYPOINT the command queue discarded: reported as WAYPOINT_CANCELLED
+void fsm_cancel_waypoint(StepperContext *ctx, const Message &msg);
+// Pick the context (of axes[AXIS_COUNT]) a command addresses and strip the axis
+// from msg.param; nullptr if the axis does not exist
+StepperContext *fsm_route(StepperContext *axes, Message &msg);
+// Boot: adopt a position from position_journal if the TCRT5000 agrees with it
+bool fsm_restore_position(StepperContext *ctx, int pos);
@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Thin hardware abstraction used by the portable modules (FSM, telemetry,
+// logging, command queue). hal_esp32.cpp implements it with the Arduino core;
+// src/sim/hal_sim.cpp implements it on a simulated clock for the native build.
+
+#if defined(ARDUINO)
+#include <Arduino.h>
+// Critical section usable from tasks and ISRs on either core
+struct HalLock {
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+};
+inline void IRAM_ATTR hal_lock(HalLock &lock) { portENTER_CRITICAL_SAFE(&lock.mux); }
+inline void IRAM_ATTR hal_unlock(HalLock &lock) { portEXIT_CRITICAL_SAFE(&lock.mux); }
+// CPU cycle counter of the calling core (ISR safe)
+inline uint32_t IRAM_ATTR hal_cycle_count() { return ESP.getCycleCount(); }
+inline uint32_t IRAM_ATTR hal_cycles_per_us() { return ets_get_cpu_frequency(); } // ROM, ISR safe
+#else
+#include <atomic>
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+#ifndef DRAM_ATTR
+#define DRAM_ATTR
+#endif
+struct HalLock {
+  std::atomic_flag flag = ATOMIC_FLAG_INIT;
+};
+inline void hal_lock(HalLock &lock) { while (lock.flag.test_and_set(std::memory_order_acquire)) {} }
+inline void hal_unlock(HalLock &lock) { lock.flag.clear(std::memory_order_release); }
+// Host: nanoseconds of wall time, so durations measure the host CPU
+uint32_t hal_cycle_count();
+inline uint32_t hal_cycles_per_us() { return 1000; }
+#endif
+
+// GPIO
+void hal_pin_input(int pin);
+int hal_digital_read(int pin);
+// Call isr (IRAM) on every HIGH -> LOW transition of pin
+void hal_attach_falling(int pin, void (*isr)());
+
+// Continuous analog sampling of one pin (ADC DMA on target; ADC1 pins only,
+// since Wi-Fi takes ADC2). Sample k (from 0) is taken at
+// start_us + (k + 1) * 1000000 / rate_hz, where start_us is the clock when
+// hal_adc_stream_start() returned.
+bool hal_adc_stream_start(int pin, uint32_t rate_hz, uint32_t &start_us);
+// Up to max 12-bit samples, oldest first, that were taken since the last read; never blocks.
+// overrun is set when samples were dropped since the last read (the driver's
+// buffer overflowed), so the samples no longer follow the schedule above.
+size_t hal_adc_stream_read(uint16_t *levels, size_t max, bool &overrun);
+void hal_adc_stream_stop();
+
+// Time
+unsigned long hal_millis();
+unsigned long hal_micros();
+void hal_delay_ms(unsigned long ms);
+
+// System
+void hal_restart();
+// CPU clock in MHz: 80, 160 or 240 on target (Wi-Fi needs at least 80)
+bool hal_set_cpu_mhz(uint32_t mhz);
+uint32_t hal_cpu_mhz();
+void hal_console_write(const uint8_t *data, size_t len);
+
+// Radio: hand one frame to the transport (ESP-NOW on target)
+bool hal_radio_send(const uint8_t *mac, const uint8_t *data, size_t len);
+
+// Small RAM block that keeps its contents across a soft reset (RTC slow memory on
+// target) and holds garbage after power-on; check it before trusting it
+constexpr size_t HAL_RETAINED_SIZE = 16;
+void *hal_retained_ram();
+
+// Raw flash region for the position journal ("journal" partition on target).
+// Erased bytes read 0xFF and writes can only clear bits until the sector is erased.
+constexpr size_t HAL_JOURNAL_SECTOR = 4096;
+size_t hal_journal_size(); // 0 when there is no journal partition
+bool hal_journal_read(size_t offset, void *data, size_t len);
+bool hal_journal_write(size_t offset, const void *data, size_t len);
+bool hal_journal_erase_sector(size_t offset);
+
+// Non-volatile storage (Preferences namespace on target)
+void hal_nvs_begin(const char *name_space);
+long hal_nvs_get_long(const char *key, long default_value);
+void hal_nvs_put_long(const char *key, long value);
+// 0 unless the stored blob is exactly len bytes
+size_t hal_nvs_get_blob(const char *key, void *data, size_t len);
+// Size of the stored blob, 0 if there is none
+size_t hal_nvs_blob_length(const char *key);
+bool hal_nvs_put_blob(const char *key, const void *data, size_t len);
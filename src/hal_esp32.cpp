@@ -0,0 +1,201 @@
+#include <Arduino.h>
+#include <esp_now.h>
+#include <Preferences.h>
+#include <esp_partition.h>
+#include <driver/adc.h>
+#include "hal.h"
+
+static Preferences prefs;
+
+void hal_pin_input(int pin)
+{
+  pinMode(pin, INPUT);
+}
+
+int IRAM_ATTR hal_digital_read(int pin)
+{
+  return digitalRead(pin);
+}
+
+void hal_attach_falling(int pin, void (*isr)())
+{
+  attachInterrupt(digitalPinToInterrupt(pin), isr, FALLING);
+}
+
+// ADC1 in DMA mode. The driver buffers about 100 ms of samples at 20 kHz,
+// far more than a supervision interval.
+constexpr uint32_t ADC_STREAM_BUFFER = 4096;  // bytes, 2 per sample
+constexpr uint32_t ADC_STREAM_FRAME = 256;    // bytes per DMA interrupt
+constexpr size_t ADC_STREAM_READ_MAX = 64;    // samples per hal_adc_stream_read()
+static bool adc_streaming = false;
+
+bool hal_adc_stream_start(int pin, uint32_t rate_hz, uint32_t &start_us)
+{
+  int8_t channel = digitalPinToAnalogChannel(pin);
+  if (adc_streaming || channel < 0 || channel > 7) return false; // ADC2 is taken by Wi-Fi
+  adc_digi_init_config_t init = {};
+  init.max_store_buf_size = ADC_STREAM_BUFFER;
+  init.conv_num_each_intr = ADC_STREAM_FRAME;
+  init.adc1_chan_mask = 1UL << channel;
+  if (adc_digi_initialize(&init) != ESP_OK) return false;
+  adc_digi_pattern_config_t pattern = {};
+  pattern.atten = ADC_ATTEN_DB_11;
+  pattern.channel = (uint8_t)channel;
+  pattern.unit = 0; // ADC1
+  pattern.bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+  adc_digi_configuration_t config = {};
+  config.conv_limit_en = true; // required on the ESP32
+  config.conv_limit_num = 250;
+  config.pattern_num = 1;
+  config.adc_pattern = &pattern;
+  config.sample_freq_hz = rate_hz;
+  config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+  if (adc_digi_controller_configure(&config) != ESP_OK || adc_digi_start() != ESP_OK) {
+    adc_digi_deinitialize();
+    return false;
+  }
+  start_us = micros();
+  adc_streaming = true;
+  return true;
+}
+
+size_t hal_adc_stream_read(uint16_t *levels, size_t max, bool &overrun)
+{
+  overrun = false;
+  if (!adc_streaming) return 0;
+  adc_digi_output_data_t raw[ADC_STREAM_READ_MAX];
+  uint32_t got = 0;
+  uint32_t want = (uint32_t)(max < ADC_STREAM_READ_MAX ? max : ADC_STREAM_READ_MAX) * sizeof(raw[0]);
+  // ESP_ERR_TIMEOUT: nothing new yet. ESP_ERR_INVALID_STATE: the driver's ring
+  // buffer overflowed and dropped samples; what is left still comes back.
+  esp_err_t err = adc_digi_read_bytes((uint8_t *)raw, want, &got, 0);
+  overrun = err == ESP_ERR_INVALID_STATE;
+  if (err != ESP_OK && !overrun) return 0;
+  size_t count = got / sizeof(raw[0]);
+  for (size_t i = 0; i < count; ++i) levels[i] = raw[i].type1.data;
+  return count;
+}
+
+void hal_adc_stream_stop()
+{
+  if (!adc_streaming) return;
+  adc_digi_stop();
+  adc_digi_deinitialize();
+  adc_streaming = false;
+}
+
+unsigned long IRAM_ATTR hal_millis()
+{
+  return millis();
+}
+
+unsigned long IRAM_ATTR hal_micros()
+{
+  return micros();
+}
+
+void hal_delay_ms(unsigned long ms)
+{
+  delay(ms);
+}
+
+void hal_restart()
+{
+  ESP.restart();
+}
+
+bool hal_set_cpu_mhz(uint32_t mhz)
+{
+  return setCpuFrequencyMhz(mhz);
+}
+
+uint32_t hal_cpu_mhz()
+{
+  return getCpuFrequencyMhz();
+}
+
+void hal_console_write(const uint8_t *data, size_t len)
+{
+  Serial.write(data, len);
+}
+
+bool hal_radio_send(const uint8_t *mac, const uint8_t *data, size_t len)
+{
+  // Peers (including the broadcast address) are added on first use
+  if (!esp_now_is_peer_exist(mac)) {
+    esp_now_peer_info_t peer = {};
+    memcpy(peer.peer_addr, mac, ESP_NOW_ETH_ALEN);
+    peer.channel = 0; // current channel
+    peer.encrypt = false;
+    if (esp_now_add_peer(&peer) != ESP_OK) return false;
+  }
+  return esp_now_send(mac, data, len) == ESP_OK;
+}
+
+// Not cleared by the startup code, so a soft reset keeps it
+RTC_NOINIT_ATTR static uint32_t retained_ram[HAL_RETAINED_SIZE / sizeof(uint32_t)];
+
+void *hal_retained_ram()
+{
+  return retained_ram;
+}
+
+static const esp_partition_t *journal_partition()
+{
+  static const esp_partition_t *partition =
+      esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "journal");
+  return partition;
+}
+
+size_t hal_journal_size()
+{
+  return journal_partition() ? journal_partition()->size : 0;
+}
+
+bool hal_journal_read(size_t offset, void *data, size_t len)
+{
+  return journal_partition() && esp_partition_read(journal_partition(), offset, data, len) == ESP_OK;
+}
+
+bool hal_journal_write(size_t offset, const void *data, size_t len)
+{
+  return journal_partition() && esp_partition_write(journal_partition(), offset, data, len) == ESP_OK;
+}
+
+bool hal_journal_erase_sector(size_t offset)
+{
+  return journal_partition() &&
+         esp_partition_erase_range(journal_partition(), offset, HAL_JOURNAL_SECTOR) == ESP_OK;
+}
+
+void hal_nvs_begin(const char *name_space)
+{
+  prefs.begin(name_space, false);
+}
+
+long hal_nvs_get_long(const char *key, long default_value)
+{
+  return prefs.getLong(key, default_value);
+}
+
+void hal_nvs_put_long(const char *key, long value)
+{
+  prefs.putLong(key, value);
+}
+
+size_t hal_nvs_get_blob(const char *key, void *data, size_t len)
+{
+  if (prefs.getBytesLength(key) != len) return 0;
+  return prefs.getBytes(key, data, len);
+}
+
+size_t hal_nvs_blob_length(const char *key)
+{
+  return prefs.getBytesLength(key);
+}
+
+bool hal_nvs_put_blob(const char *key, const void *data, size_t len)
+{
+  return prefs.putBytes(key, data, len) == len;
+}
@@ -0,0 +1,111 @@
+#include <Arduino.h>
+#include <string.h>
+#include "handshake.h"
+#include "controller_commands.h"
+#include "radio_link.h"
+#include "deferred_log.h"
+#include "hal.h"
+
+static const uint8_t BROADCAST_MAC[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// GUI peer: written by the receive callback (Wi-Fi task), read by any sender
+static HalLock peer_lock;
+static uint8_t gui_mac[ESP_NOW_ETH_ALEN];
+static volatile HandshakeState state = HANDSHAKE_ANNOUNCING;
+static volatile int32_t gui_capabilities = 0;
+static int32_t own_capabilities = 0;
+static bool first_command_logged = false;
+
+// Announce schedule, service task only
+static unsigned long next_announce_ms = HANDSHAKE_ANNOUNCE_FIRST_MS;
+static unsigned long announce_interval_ms = HANDSHAKE_ANNOUNCE_FIRST_MS;
+static bool announced = false;
+
+// flags: HELLO_REPLY when answering a CMD_HELLO
+static void send_hello(const uint8_t *mac, uint8_t messageId, int32_t flags)
+{
+  Message hello;
+  hello.messageId = messageId;
+  hello.command = CMD_HELLO;
+  hello.param = own_capabilities | HELLO_ROLE_CONTROLLER | flags | HELLO_PROTOCOL_VERSION;
+  if (!radio_link_send(mac, hello)) LOG_WARN("[LINK] TX queue full, CMD_HELLO dropped");
+}
+
+static void adopt(const uint8_t *mac, HandshakeState new_state, int32_t capabilities)
+{
+  hal_lock(peer_lock);
+  memcpy(gui_mac, mac, ESP_NOW_ETH_ALEN);
+  state = new_state;
+  gui_capabilities = capabilities;
+  hal_unlock(peer_lock);
+  radio_link_set_batch_peer((capabilities & HELLO_CAP_BATCH) ? mac : nullptr);
+}
+
+void handshake_init(const uint8_t *fallback_mac, int32_t capabilities)
+{
+  memcpy(gui_mac, fallback_mac, ESP_NOW_ETH_ALEN);
+  own_capabilities = capabilities & ~(HELLO_VERSION_MASK | HELLO_FLAGS_MASK);
+}
+
+bool handshake_on_receive(const uint8_t *mac, const Message &msg)
+{
+  if (!first_command_logged) {
+    first_command_logged = true;
+    LOG_INFO("[LINK] first frame %u ms after boot", (unsigned)hal_millis());
+  }
+  if (!mac) return msg.command == CMD_HELLO;
+  if (handshake_from_controller(msg)) {
+    LOG_DEBUG("[LINK] CMD_HELLO from controller %06X%06X ignored", log_mac_hi(mac), log_mac_lo(mac));
+    return true;
+  }
+  if (msg.command == CMD_HELLO) {
+    int32_t capabilities = msg.param & ~(HELLO_VERSION_MASK | HELLO_FLAGS_MASK);
+    adopt(mac, HANDSHAKE_PAIRED, capabilities);
+    LOG_INFO("[LINK] GUI %06X%06X paired: version %d capabilities 0x%x", log_mac_hi(mac), log_mac_lo(mac),
+             msg.param & HELLO_VERSION_MASK, capabilities);
+    // Reusing the messageId makes the reply easy to match; HELLO_REPLY keeps it from being answered
+    if (!(msg.param & HELLO_REPLY)) send_hello(mac, msg.messageId, HELLO_REPLY);
+    return true;
+  }
+  if (state == HANDSHAKE_ANNOUNCING) {
+    adopt(mac, HANDSHAKE_LEGACY, 0);
+    LOG_INFO("[LINK] GUI %06X%06X adopted from its first command", log_mac_hi(mac), log_mac_lo(mac));
+  }
+  return false;
+}
+
+void handshake_service(unsigned long now_ms)
+{
+  if (state != HANDSHAKE_ANNOUNCING || (long)(now_ms - next_announce_ms) < 0) return;
+  send_hello(BROADCAST_MAC, 0, 0);
+  if (!announced) {
+    // GUIs that predate CMD_HELLO learn about the restart from CMD_RESET, as before
+    announced = true;
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    handshake_gui_mac(mac);
+    Message reset;
+    reset.messageId = 0;
+    reset.command = CMD_RESET;
+    reset.param = STEPPER_PARAM_UNUSED;
+    radio_link_send(mac, reset);
+  }
+  announce_interval_ms = min(announce_interval_ms * 2, HANDSHAKE_ANNOUNCE_MAX_MS);
+  next_announce_ms = now_ms + announce_interval_ms;
+}
+
+void handshake_gui_mac(uint8_t *mac)
+{
+  hal_lock(peer_lock);
+  memcpy(mac, gui_mac, ESP_NOW_ETH_ALEN);
+  hal_unlock(peer_lock);
+}
+
+HandshakeState handshake_state()
+{
+  return state;
+}
+
+int32_t handshake_gui_capabilities()
+{
+  return gui_capabilities;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+#include "stepper_commands.h"
+#include "controller_commands.h"
+
+// GUI discovery without blocking setup().
+// The controller broadcasts CMD_HELLO (messageId 0) until a GUI answers, starting
+// HANDSHAKE_ANNOUNCE_FIRST_MS after boot and backing off to
+// HANDSHAKE_ANNOUNCE_MAX_MS. A GUI answers with its own CMD_HELLO (any
+// messageId), either to an announce or on its own start-up. The controller then
+// adopts that MAC as the GUI and replies with a unicast CMD_HELLO marked
+// HELLO_REPLY. A reply is never answered, and a controller ignores CMD_HELLO
+// marked HELLO_ROLE_CONTROLLER, so two controllers in range, or a GUI that
+// answers every CMD_HELLO, cannot bounce them back and forth or take each
+// other as the GUI. GUIs that predate CMD_HELLO are adopted on their first
+// command instead. Announcing stops
+// once a GUI is adopted; a GUI that restarts sends CMD_HELLO itself. Until then,
+// frames go to the fallback MAC given to handshake_init(). ESP-NOW peers are
+// added on first use by hal_radio_send(), so no MAC has to be known in advance.
+//
+// CMD_HELLO param: bits 0-7 protocol version, bits 8-14 HELLO_CAP_* bits of the
+// sender (what it understands), bits 15-16 HELLO_REPLY and HELLO_ROLE_CONTROLLER.
+
+constexpr uint8_t HELLO_PROTOCOL_VERSION = 1;
+constexpr int32_t HELLO_VERSION_MASK = 0xFF;
+constexpr int32_t HELLO_CAP_TELEMETRY = 1 << 8;    // telemetry frames (telemetry.h)
+constexpr int32_t HELLO_CAP_PERF_STATS = 1 << 9;   // CMD_PERF_STATS report frames (perf_stats.h)
+constexpr int32_t HELLO_CAP_POSITION_RESTORE = 1 << 10; // position survives resets (position_journal.h)
+constexpr int32_t HELLO_CAP_BATCH = 1 << 11;       // batch frames (batch_frame.h)
+// Controller only: bits 12-13 hold the number of motor axes minus one (axis.h)
+constexpr uint8_t HELLO_AXES_SHIFT = 12;
+constexpr int32_t HELLO_AXES_MASK = 0x3 << HELLO_AXES_SHIFT;
+constexpr int32_t HELLO_CAP_LATENCY = 1 << 14;     // latency pings and CMD_LATENCY_STATS (latency_probe.h)
+// Not capabilities: what this CMD_HELLO is and who sent it
+constexpr int32_t HELLO_REPLY = 1 << 15;           // answers a CMD_HELLO; never answered itself
+constexpr int32_t HELLO_ROLE_CONTROLLER = 1 << 16; // sent by a controller, not a GUI
+constexpr int32_t HELLO_FLAGS_MASK = HELLO_REPLY | HELLO_ROLE_CONTROLLER;
+
+constexpr unsigned long HANDSHAKE_ANNOUNCE_FIRST_MS = 50;
+constexpr unsigned long HANDSHAKE_ANNOUNCE_MAX_MS = 2000;
+
+enum HandshakeState : uint8_t {
+  HANDSHAKE_ANNOUNCING, // no GUI heard yet; frames go to the fallback MAC
+  HANDSHAKE_LEGACY,     // a GUI without CMD_HELLO sent a command
+  HANDSHAKE_PAIRED      // a GUI answered CMD_HELLO
+};
+
+// capabilities: HELLO_CAP_* bits this controller announces
+void handshake_init(const uint8_t *fallback_mac, int32_t capabilities);
+// Receive callback, for every valid Message. Returns true if it was a CMD_HELLO,
+// which is answered here and must not reach the FSM.
+bool handshake_on_receive(const uint8_t *mac, const Message &msg);
+// Another controller's CMD_HELLO: not adopted, answered or ACKed
+inline bool handshake_from_controller(const Message &msg)
+{
+  return msg.command == CMD_HELLO && (msg.param & HELLO_ROLE_CONTROLLER);
+}
+// Service task: announces while no GUI has answered
+void handshake_service(unsigned long now_ms);
+// MAC that unsolicited frames should go to
+void handshake_gui_mac(uint8_t *mac);
+HandshakeState handshake_state();
+int32_t handshake_gui_capabilities();
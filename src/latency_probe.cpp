@@ -0,0 +1,176 @@
+#include <string.h>
+#include <algorithm>
+#include "latency_probe.h"
+#include "deferred_log.h"
+#include "hal.h"
+
+// Hands a diagnostic frame to the radio link
+extern bool send_diagnostic(const uint8_t *frame, size_t len);
+
+// Outcome of one ping
+struct LatencySample {
+  uint32_t rtt_us; // LATENCY_LOST when no pong came back
+  int32_t offset_us;
+};
+
+constexpr uint32_t LATENCY_LOST = UINT32_MAX;
+
+// Written by the receive callback (pongs) and the service task (pings,
+// timeouts), read by the motion task (reports)
+static HalLock latency_lock;
+static LatencySample samples[LATENCY_WINDOW];
+static size_t sample_count = 0;
+static size_t sample_next = 0;
+static bool ping_pending = false;
+static uint8_t ping_seq = 0;
+static uint32_t ping_sent_us = 0;
+
+// Service task only
+static uint32_t next_ping_us = 0;
+static bool ping_scheduled = false; // the first ping goes out at once, whatever the uptime
+
+// Caller must hold latency_lock
+static void record_locked(const LatencySample &sample)
+{
+  samples[sample_next] = sample;
+  sample_next = (sample_next + 1) % LATENCY_WINDOW;
+  if (sample_count < LATENCY_WINDOW) sample_count++;
+}
+
+// Responder clock minus pinger clock, modulo 2^32 like the clocks themselves.
+// The two legs only differ by the round trip, so the halving is done on that.
+static int32_t clock_offset(const LatencyFrame &pong, uint32_t arrival_us)
+{
+  uint32_t there = pong.receive_us - pong.origin_us; // offset + outbound leg
+  uint32_t back = pong.transmit_us - arrival_us;     // offset - return leg
+  return (int32_t)(back + (uint32_t)((int32_t)(there - back) / 2));
+}
+
+bool latency_on_frame(const uint8_t *data, size_t len, uint32_t now_us, LatencyFrame &pong)
+{
+  if (!latency_is_frame(data, len)) return false;
+  LatencyFrame frame;
+  memcpy(&frame, data, sizeof(frame));
+  if (frame.type == LATENCY_PING) {
+    pong = frame;
+    pong.type = LATENCY_PONG;
+    pong.receive_us = now_us;
+    pong.transmit_us = (uint32_t)hal_micros();
+    return true;
+  }
+  if (frame.type != LATENCY_PONG) return false;
+  hal_lock(latency_lock);
+  bool ours = ping_pending && frame.seq == ping_seq && frame.origin_us == ping_sent_us;
+  if (ours) {
+    ping_pending = false;
+    uint32_t elapsed = now_us - frame.origin_us;
+    uint32_t turnaround = frame.transmit_us - frame.receive_us;
+    LatencySample sample;
+    sample.rtt_us = elapsed > turnaround ? elapsed - turnaround : 0;
+    sample.offset_us = clock_offset(frame, now_us);
+    record_locked(sample);
+  }
+  hal_unlock(latency_lock);
+  if (!ours) LOG_DEBUG("[LATENCY] late or unknown pong seq=%u", frame.seq);
+  return false;
+}
+
+void latency_service(uint32_t now_us, bool enabled)
+{
+  hal_lock(latency_lock);
+  bool expired = ping_pending && now_us - ping_sent_us >= LATENCY_TIMEOUT_MS * 1000UL;
+  if (expired) {
+    ping_pending = false;
+    record_locked(LatencySample{LATENCY_LOST, 0});
+  }
+  bool due = enabled && !ping_pending && (!ping_scheduled || (int32_t)(now_us - next_ping_us) >= 0);
+  LatencyFrame ping = {};
+  if (due) {
+    ping_pending = true;
+    ping_sent_us = now_us;
+    ping.seq = ++ping_seq;
+    ping.kind = LATENCY_KIND;
+    ping.type = LATENCY_PING;
+    ping.origin_us = now_us;
+  }
+  hal_unlock(latency_lock);
+  if (expired) LOG_DEBUG("[LATENCY] ping seq=%u lost", ping_seq);
+  if (!due) return;
+  next_ping_us = now_us + LATENCY_PING_INTERVAL_MS * 1000UL;
+  ping_scheduled = true;
+  if (!send_diagnostic((const uint8_t *)&ping, sizeof(ping))) {
+    // Never went on air, so it is not a lost ping
+    hal_lock(latency_lock);
+    ping_pending = false;
+    hal_unlock(latency_lock);
+  }
+}
+
+// Nearest-rank percentile of sorted values
+static uint32_t percentile(const uint32_t *sorted, size_t count, uint32_t percent)
+{
+  size_t rank = (count * percent + 99) / 100;
+  return sorted[rank ? rank - 1 : 0];
+}
+
+static LatencyReport collect(bool reset)
+{
+  LatencySample window[LATENCY_WINDOW];
+  hal_lock(latency_lock);
+  size_t count = sample_count;
+  memcpy(window, samples, sizeof(window));
+  if (reset) {
+    sample_count = 0;
+    sample_next = 0;
+  }
+  hal_unlock(latency_lock);
+
+  LatencyReport report = {};
+  report.kind = LATENCY_KIND;
+  report.type = LATENCY_REPORT;
+  report.pings = (uint16_t)count;
+  uint32_t rtts[LATENCY_WINDOW];
+  size_t answered = 0;
+  uint32_t fastest = LATENCY_LOST;
+  for (size_t i = 0; i < count; ++i) {
+    const LatencySample &sample = window[i];
+    if (sample.rtt_us == LATENCY_LOST) {
+      report.lost++;
+      continue;
+    }
+    rtts[answered++] = sample.rtt_us;
+    if (sample.rtt_us < fastest) {
+      fastest = sample.rtt_us;
+      report.offset_us = sample.offset_us;
+    }
+  }
+  if (answered == 0) return report;
+  std::sort(rtts, rtts + answered);
+  report.rtt_p50_us = percentile(rtts, answered, 50);
+  report.rtt_p90_us = percentile(rtts, answered, 90);
+  report.rtt_p99_us = percentile(rtts, answered, 99);
+  report.rtt_max_us = rtts[answered - 1];
+  report.one_way_us = report.rtt_p50_us / 2;
+  return report;
+}
+
+LatencyReport latency_snapshot()
+{
+  return collect(false);
+}
+
+void latency_reset()
+{
+  collect(true);
+}
+
+void latency_report(uint8_t messageId, bool reset)
+{
+  LatencyReport report = collect(reset);
+  report.messageId = messageId;
+  send_diagnostic((const uint8_t *)&report, sizeof(report));
+  LOG_INFO("[LATENCY] rtt p50=%u p90=%u p99=%u max=%u us", report.rtt_p50_us, report.rtt_p90_us,
+           report.rtt_p99_us, report.rtt_max_us);
+  LOG_INFO("[LATENCY] one-way=%u us offset=%d us lost=%u of %u", report.one_way_us, report.offset_us, report.lost,
+           report.pings);
+}
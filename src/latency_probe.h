@@ -0,0 +1,85 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "stepper_commands.h"
+
+// Round-trip latency probe and clock-offset estimate between GUI and controller.
+// Either side may ping: a LATENCY_PING frame carries the sender's clock when it
+// went out (t0, microseconds). The other side answers at once with a
+// LATENCY_PONG that echoes t0 and adds its own clock on receiving the ping (t1)
+// and on sending the pong (t2). With t3 the arrival of the pong:
+//
+//   rtt    = (t3 - t0) - (t2 - t1)        both radio legs, without the turnaround
+//   offset = ((t1 - t0) + (t2 - t3)) / 2  responder clock minus pinger clock
+//
+// The offset assumes both legs take equally long, so it is taken from the
+// fastest round trip in the window, the one with the least queueing in it.
+//
+// The controller pings a GUI that announced HELLO_CAP_LATENCY (handshake.h)
+// every LATENCY_PING_INTERVAL_MS and counts the ping as lost when no pong is
+// back within LATENCY_TIMEOUT_MS. It keeps the outcome of the last
+// LATENCY_WINDOW pings; CMD_LATENCY_STATS (controller_commands.h) answers with
+// one LatencyReport frame. Pings from the GUI are always answered, so the GUI
+// can measure the link from its side as well. Like the telemetry frames, byte 1
+// holds a kind outside the command range and neither frame is sizeof(Message)
+// long.
+
+constexpr uint8_t LATENCY_KIND = 0xFA;
+
+enum LatencyType : uint8_t {
+  LATENCY_PING,
+  LATENCY_PONG,
+  LATENCY_REPORT
+};
+
+constexpr unsigned long LATENCY_PING_INTERVAL_MS = 1000;
+constexpr unsigned long LATENCY_TIMEOUT_MS = 500;
+constexpr size_t LATENCY_WINDOW = 64; // pings
+
+struct __attribute__((packed)) LatencyFrame {
+  uint8_t seq;
+  uint8_t kind;         // LATENCY_KIND
+  uint8_t type;         // LATENCY_PING or LATENCY_PONG
+  uint32_t origin_us;   // t0, pinger clock
+  uint32_t receive_us;  // t1, responder clock (pong only)
+  uint32_t transmit_us; // t2, responder clock (pong only)
+};
+
+struct __attribute__((packed)) LatencyReport {
+  uint8_t messageId; // id of the CMD_LATENCY_STATS request
+  uint8_t kind;      // LATENCY_KIND
+  uint8_t type;      // LATENCY_REPORT
+  uint16_t pings;    // pings in the window that were answered or timed out
+  uint16_t lost;     // of those, the ones without a pong
+  uint32_t rtt_p50_us;
+  uint32_t rtt_p90_us;
+  uint32_t rtt_p99_us;
+  uint32_t rtt_max_us;
+  uint32_t one_way_us; // rtt_p50_us / 2
+  int32_t offset_us;   // GUI clock minus controller clock
+};
+
+static_assert(sizeof(LatencyFrame) != sizeof(Message) && sizeof(LatencyReport) != sizeof(Message),
+              "latency frames must be distinguishable from Message by length");
+static_assert(sizeof(LatencyReport) <= 32, "a report must fit RADIO_FRAME_MAX");
+
+// CMD_LATENCY_STATS param bits
+constexpr int32_t LATENCY_PARAM_RESET = 0x1; // clear the window after reporting
+
+inline bool latency_is_frame(const uint8_t *data, size_t len)
+{
+  return len == sizeof(LatencyFrame) && data[1] == LATENCY_KIND;
+}
+
+// Receive callback, for every latency frame; now_us as early as possible after
+// arrival. Returns true with pong filled in when a ping must be answered.
+bool latency_on_frame(const uint8_t *data, size_t len, uint32_t now_us, LatencyFrame &pong);
+// Service task: pings when due (enabled: the GUI understands pings) and
+// expires pings that were not answered in time
+void latency_service(uint32_t now_us, bool enabled);
+// Answer CMD_LATENCY_STATS: one LatencyReport through send_diagnostic(), and
+// the same numbers on the log
+void latency_report(uint8_t messageId, bool reset);
+// Numbers for latency_report(), without sending anything
+LatencyReport latency_snapshot();
+void latency_reset();
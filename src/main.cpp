@@ -5,168 +5,227 @@
 #include <WiFi.h>
 #include "stepper_commands.h"
 #include "stepper_helpers.h"
-#include "circular_buffer.h"
-#include <Preferences.h>
+#include "command_queue.h"
+#include "deferred_log.h"
+#include "radio_link.h"
+#include "telemetry.h"
 #include "fsm/fsm.h"
+#include "step_engine.h"
+#include "hal.h"
+#include "perf_stats.h"
+#include "config_store.h"
+#include "position_journal.h"
+#include "handshake.h"
+#include "batch_frame.h"
+#include "latency_probe.h"
+#include "sensor_profile.h"
+#include "tuning_table.h"
+#include "command_trace.h"
+#include "power_policy.h"
 // ...existing code...
 
-Preferences prefs;
-StepperContext fsm_ctx;
-// Replace with your GUI MAC address (update to your GUI device)
+StepperContext fsm_ctx[AXIS_COUNT];
+// Fallback GUI MAC: used until a GUI answers the CMD_HELLO announce or sends a
+// command (handshake.h), so only GUIs that predate CMD_HELLO depend on it
 const uint8_t GUI_MAC[] = { 0x98, 0xA3, 0x16, 0xE3, 0xFD, 0x4C }; // 98:A3:16:E3:FD:4C
+// Announced in CMD_HELLO
+constexpr int32_t CONTROLLER_CAPABILITIES =
+    HELLO_CAP_TELEMETRY | HELLO_CAP_PERF_STATS | HELLO_CAP_POSITION_RESTORE | HELLO_CAP_BATCH | HELLO_CAP_LATENCY |
+    ((AXIS_COUNT - 1) << HELLO_AXES_SHIFT);
 
-// Command buffer for deferring work from ISR/callback to loop()
-CircularBuffer<Message, 16> cb;
+// Motion task, notified by the radio callback when a command is queued
+TaskHandle_t motion_task_handle = nullptr;
 
-// Optional: log helper
-static void print_mac(const uint8_t *mac)
+// ...existing code...
+void send_message(CommandType cmd, int32_t param = STEPPER_PARAM_UNUSED, uint8_t messageId = 0);
+
+// One inbound Message, alone in its frame or from a batch frame
+static void handle_message(const uint8_t *mac_addr, const Message &msg)
 {
-  for (int i = 0; i < 6; ++i) {
-    Serial.printf("%02X", mac[i]);
-    if (i < 5) Serial.print(":");
+  LOG_INFO("[RECEIVED CMD] id=%u cmd=%s param=%d", msg.messageId, commandToString(msg.command), msg.param);
+
+  // A re-send after a lost ACK is ACKed again but not executed twice
+  bool duplicate = radio_link_is_duplicate(mac_addr, msg);
+  if (duplicate) {
+    LOG_INFO("[RECEIVED CMD] duplicate id=%u ignored", msg.messageId);
+  } else if (handshake_on_receive(mac_addr, msg)) {
+    // CMD_HELLO: answered by the handshake, nothing for the FSM
+  } else {
+    // Enqueue for the motion task (STOP/RESET skip the queue) and wake it
+    if (!command_queue_push(msg)) {
+      LOG_WARN("Command queue full, dropping incoming message id=%u", msg.messageId);
+    }
+    if (motion_task_handle) xTaskNotifyGive(motion_task_handle);
+  }
+
+  // ACK back to the sender through the TX task; another controller's announce
+  // is not ours to ACK, or it would adopt this controller as its GUI
+  if (mac_addr && !handshake_from_controller(msg)) {
+    Message ack{};
+    ack.messageId = msg.messageId;
+    ack.command = CMD_ACK;
+    ack.param = 0;
+    LOG_DEBUG("[SENT CMD] ACK to sender: id=%u", ack.messageId);
+    if (!radio_link_send(mac_addr, ack)) LOG_WARN("ACK dropped, TX queue full: id=%u", ack.messageId);
   }
 }
 
-// ...existing code...
-void send_message(CommandType cmd, int32_t param = STEPPER_PARAM_UNUSED, uint8_t messageId = 0);
+// Latency ping or pong, alone in its frame or from a batch frame; pings are
+// answered straight from the callback so the reply does not wait for any task
+static void handle_latency(const uint8_t *mac_addr, const uint8_t *data, size_t len, uint32_t arrival_us)
+{
+  LatencyFrame pong;
+  if (!latency_on_frame(data, len, arrival_us, pong) || !mac_addr) return;
+  if (!radio_link_send_raw(mac_addr, (const uint8_t *)&pong, sizeof(pong))) LOG_WARN("[LATENCY] pong dropped");
+}
 
 // ESP-NOW receive callback (older Arduino core signature used by PlatformIO)
 void on_data_recv(const uint8_t *mac_addr, const uint8_t *incomingData, int len)
 {
+  // Before anything else, so latency samples only include the radio
+  uint32_t arrival_us = (uint32_t)hal_micros();
+
   // Note: stepperGUI uses newer signature with esp_now_recv_info_t
   // but PlatformIO uses older signature with direct MAC parameter
   
-  Serial.print("[RECEIVED] from ");
-  if (mac_addr) {
-    print_mac(mac_addr);
-    Serial.println();
-  } else {
-    Serial.println("(no mac)");
+  if (mac_addr) LOG_DEBUG("[RECEIVED] from %06X%06X", log_mac_hi(mac_addr), log_mac_lo(mac_addr));
+  else LOG_DEBUG("[RECEIVED] from (no mac)");
+
+  if (incomingData && len > 0 && batch_is_frame(incomingData, (size_t)len)) {
+    // Each Message or latency record is handled (and ACKed) as if it had come alone
+    bool intact = batch_for_each(incomingData, (size_t)len, [&](const uint8_t *record, size_t record_len) {
+      if (latency_is_frame(record, record_len)) {
+        handle_latency(mac_addr, record, record_len, arrival_us);
+        return;
+      }
+      if (record_len != sizeof(Message)) {
+        LOG_DEBUG("[RECEIVED] batch record of %u bytes skipped", (unsigned)record_len);
+        return;
+      }
+      Message msg;
+      memcpy(&msg, record, sizeof(msg));
+      handle_message(mac_addr, msg);
+    });
+    if (!intact) LOG_WARN("[RECEIVED] malformed or newer batch frame: %d bytes", len);
+    return;
+  }
+
+  if (incomingData && latency_is_frame(incomingData, (size_t)len)) {
+    handle_latency(mac_addr, incomingData, (size_t)len, arrival_us);
+    return;
   }
 
   if (!incomingData || len < (int)sizeof(Message)) {
-    Serial.printf("Received too few bytes: %d (need %u)\n", len, (unsigned)sizeof(Message));
+    LOG_WARN("Received too few bytes: %d (need %u)", len, (unsigned)sizeof(Message));
     return;
   }
 
   Message msg;
   memcpy(&msg, incomingData, sizeof(msg));
-
-  Serial.print("[RECEIVED CMD] id="); Serial.print(msg.messageId);
-  Serial.print(" cmd="); Serial.print(commandToString(msg.command));
-  Serial.print(" param="); Serial.println(msg.param);
-
-  // Enqueue for processing in loop()
-  if (!cb.push(msg)) {
-    Serial.println("Command buffer full, dropping incoming message");
-  }
-
-  // Send ACK back to sender (use same sender MAC)
-  Message ack{};
-  ack.messageId = msg.messageId;
-  ack.command = CMD_ACK;
-  ack.param = 0;
-  Serial.print("[SENT CMD] ACK to sender: id="); 
-  Serial.print(ack.messageId);Serial.print("    CMD = ");
-  Serial.println(commandToString(ack.command));
-  Serial.print(" cmd="); Serial.print(commandToString(ack.command));
-  Serial.print(" param="); Serial.println(ack.param);
-  esp_err_t r = esp_now_send(mac_addr, (uint8_t *)&ack, sizeof(ack));
-  if (r == ESP_OK) Serial.println("ACK sent");
-  else Serial.printf("ACK send failed: %d\n", r);
+  handle_message(mac_addr, msg);
 }
 
 
 
-// ESP-NOW send callback for logging
+// ESP-NOW send callback: completes the TX task's in-flight frame
 void on_data_sent(const uint8_t *mac_addr, esp_now_send_status_t status)
 {
-  Serial.print("onDataSent to ");
-  if (mac_addr) print_mac(mac_addr);
-  Serial.print(" status=");
-  Serial.println(status == ESP_NOW_SEND_SUCCESS ? "OK" : "FAIL");
+  radio_link_on_sent(status);
+  LOG_DEBUG("onDataSent to %06X%06X status=%s", mac_addr ? log_mac_hi(mac_addr) : 0,
+            mac_addr ? log_mac_lo(mac_addr) : 0, status == ESP_NOW_SEND_SUCCESS ? "OK" : "FAIL");
 }
 
 // =====================
 // Hardware Pin Definitions
 // =====================
-constexpr int DIR_PIN = 18;
-constexpr int STEP_PIN = 19;
+// Step/DIR/sensor pins of every axis are in AXIS_CONFIGS (axis.h)
 // ...existing code...
 
 // =====================
 // Timing and Speed
 // =====================
-// Runtime-configurable pulse delays (microseconds per half-pulse)
-// Initialized to reasonable defaults; these may be overridden by Preferences or commands
-long slow_pd = 40;
-long med_pd = 20;
-long fast_pd = 10;
-// Pulse delay used for move-to operations (separately configurable)
-long moveto_pd = 10;
-
-long pd = 100;
+// Runtime-configurable pulse delays (microseconds per half-pulse), per axis.
+// config_load() sets the AxisConfig defaults, then Preferences or commands override them
+PulseDelays pulse_delays[AXIS_COUNT];
+
 constexpr int LOOP_DELAY = 5;
-extern int STEPPER_POSITION_MIN;
-extern int STEPPER_POSITION_MAX;
-// Throttle for position sends (ms)
-const unsigned long SEND_INTERVAL_MS = 100;
-unsigned long last_send_time = 0;
+
+// =====================
+// Tasks
+// =====================
+// Motion (command dispatch + FSM supervision) runs in its own task pinned to the
+// APP core. Radio callbacks already run in the Wi-Fi task on the PRO core; the
+// service task (persistence, log drain, reports) runs there too so flash writes and Serial
+// never delay motion. Handoff: radio -> command_queue + task notification -> motion task;
+// motion -> config_mark_dirty() / journal_note() -> service task.
+constexpr BaseType_t MOTION_TASK_CORE = APP_CPU_NUM;
+constexpr UBaseType_t MOTION_TASK_PRIORITY = configMAX_PRIORITIES - 2;
+constexpr uint32_t MOTION_TASK_STACK = 4096;
+// Supervision period when no command arrives (limit, target, sensor checks)
+constexpr TickType_t MOTION_SUPERVISE_TICKS = pdMS_TO_TICKS(1);
+// ... and once every motor is released (power_policy.h)
+constexpr TickType_t MOTION_PARKED_TICKS = pdMS_TO_TICKS(POWER_PARKED_SUPERVISE_MS);
+
+constexpr BaseType_t SERVICE_TASK_CORE = PRO_CPU_NUM;
+constexpr UBaseType_t SERVICE_TASK_PRIORITY = 1;
+constexpr uint32_t SERVICE_TASK_STACK = 4096;
+constexpr TickType_t SERVICE_PERIOD_TICKS = pdMS_TO_TICKS(20);
+// Log records formatted per service pass (~5 KB/s of text at 20 ms)
+constexpr size_t LOG_DRAIN_BATCH = 16;
+
+// Build with -DMOTION_RATE_REPORT=1 to print requested vs achieved step rate once a second while moving
+#ifndef MOTION_RATE_REPORT
+#define MOTION_RATE_REPORT 0
+#endif
+constexpr unsigned long RATE_REPORT_INTERVAL_MS = 1000;
 
 // ...existing code...
 
 // =====================
 // FSM Context
 // =====================
-volatile int last_printed_position = 0; // Track last printed position
-
-// Movement primitives
-void single_step(long pulse_delay, bool dir)
-{
-  digitalWrite(DIR_PIN, dir);
-  digitalWrite(STEP_PIN, HIGH);
-  delayMicroseconds(pulse_delay);
-  digitalWrite(STEP_PIN, LOW);
-  delayMicroseconds(pulse_delay);
-  if (dir) fsm_ctx.position++;
-  else fsm_ctx.position--;
-  fsm_ctx.position = constrain(fsm_ctx.position, STEPPER_POSITION_MIN, STEPPER_POSITION_MAX);
-  // Print position to serial when it changes
-  if (fsm_ctx.position != last_printed_position) {
-    Serial.print("Position: ");
-    Serial.println(fsm_ctx.position);
-    last_printed_position = fsm_ctx.position;
-  }
-}
-
-// Non-blocking stepping state: use micros() to schedule steps so loop() stays responsive
-unsigned long last_step_micros = 0;
-
-// stepPeriodMicros is derived from PD (two pulse halves). We compute it each loop to reflect PD changes.
-static inline unsigned long step_period_from_pd(long pulse_delay) {
-  // single_step uses delayMicroseconds(pulse_delay) twice -> total ~2*pulse_delay
-  unsigned long period = (unsigned long)(2UL * (unsigned long)max(1L, pulse_delay));
-  return period;
-}
-
-// ...existing code...
+// Step pulses are generated by the hardware-timed step engine (step_engine.cpp)
 
 // ...existing code...
 volatile bool stop_flag = true;
 bool direction = true; // true = up
 
-// Helper to send Message to GUI (uses GUI_MAC defined earlier)
+// Helper to send Message to GUI (uses GUI_MAC defined earlier).
+// Only queues for the radio TX task, so it is safe to call from the motion path.
 void send_message(CommandType cmd, int32_t param, uint8_t messageId)
 {
+  if (cmd == CMD_POSITION && messageId == 0) {
+    // Unsolicited position updates: only the newest one matters
+    uint8_t gui_mac[ESP_NOW_ETH_ALEN];
+    handshake_gui_mac(gui_mac);
+    radio_link_post_position(gui_mac, param);
+    return;
+  }
+  uint32_t perf_start = perf_begin();
+  uint8_t gui_mac[ESP_NOW_ETH_ALEN];
+  handshake_gui_mac(gui_mac);
   Message msg;
   msg.messageId = messageId;
   msg.command = cmd;
   msg.param = param;
-  Serial.print("[SENT CMD] to GUI: id="); Serial.print(msg.messageId);
-  Serial.print(" cmd="); Serial.print(commandToString(msg.command));
-  Serial.print(" param="); Serial.println(msg.param);
-  esp_err_t r = esp_now_send(GUI_MAC, (uint8_t *)&msg, sizeof(msg));
-  if (r != ESP_OK) Serial.printf("esp_now_send failed: %d\n", r);
+  LOG_INFO("[SENT CMD] to GUI: id=%u cmd=%s param=%d", msg.messageId, commandToString(msg.command), msg.param);
+  if (!radio_link_send(gui_mac, msg)) LOG_WARN("TX queue full, dropped cmd=%s", commandToString(cmd));
+  perf_end(PERF_SEND, perf_start);
+}
+
+// Each axis' telemetry frames share one coalescing slot; see telemetry.h
+bool send_telemetry(uint8_t axis, const uint8_t *frame, size_t len)
+{
+  uint8_t gui_mac[ESP_NOW_ETH_ALEN];
+  handshake_gui_mac(gui_mac);
+  return radio_link_post_latest((RadioSlot)(RADIO_SLOT_TELEMETRY + axis), gui_mac, frame, len);
+}
+
+bool send_diagnostic(const uint8_t *frame, size_t len)
+{
+  uint8_t gui_mac[ESP_NOW_ETH_ALEN];
+  handshake_gui_mac(gui_mac);
+  return radio_link_send_raw(gui_mac, frame, len);
 }
 
 // ...existing code...
@@ -175,10 +234,112 @@ void send_message(CommandType cmd, int32_t param, uint8_t messageId)
 
 // Command handler now handled in FSM
 
+// Requested (cruise) vs achieved step rate of axis 0 over the last interval
+static void report_step_rate()
+{
+  static unsigned long last_report_ms = 0;
+  static uint32_t last_step_count = 0;
+  unsigned long now = millis();
+  if (now - last_report_ms < RATE_REPORT_INTERVAL_MS) return;
+  uint32_t steps = step_engine_step_count(0);
+  unsigned long elapsed = now - last_report_ms;
+  uint32_t achieved = (uint32_t)((uint64_t)(steps - last_step_count) * 1000UL / elapsed);
+  last_report_ms = now;
+  last_step_count = steps;
+  if (!step_engine_running(0) && achieved == 0) return;
+  uint32_t requested = 500000UL / (uint32_t)max(1L, fsm_ctx[0].pd);
+  LOG_INFO("[RATE] requested=%u steps/s achieved=%u steps/s", requested, achieved);
+}
+
+// Log when the command queue drops or discards messages
+static void report_queue_stats()
+{
+  static CommandQueueStats last = {};
+  CommandQueueStats now = command_queue_stats();
+  if (now.normal_overflows != last.normal_overflows || now.priority_overflows != last.priority_overflows ||
+      now.superseded != last.superseded) {
+    LOG_WARN("[QUEUE] overflows=%u/%u (normal/priority) superseded=%u", now.normal_overflows,
+             now.priority_overflows, now.superseded);
+    LOG_INFO("[QUEUE] high_water=%u/%u", now.normal_high_water, now.priority_high_water);
+  }
+  if (now.coalesced != last.coalesced) LOG_INFO("[QUEUE] coalesced=%u", now.coalesced);
+  last = now;
+}
+
+// Log radio link failures as they accumulate
+static void report_radio_stats()
+{
+  static RadioLinkStats last = {};
+  RadioLinkStats now = radio_link_stats();
+  if (now.failed != last.failed || now.queue_overflows != last.queue_overflows) {
+    LOG_WARN("[TX] sent=%u failed=%u retries=%u overflows=%u", now.sent, now.failed, now.retries,
+             now.queue_overflows);
+  }
+  if (now.duplicates != last.duplicates) LOG_INFO("[RX] duplicates dropped=%u", now.duplicates);
+  if (now.batched != last.batched) LOG_DEBUG("[TX] frames sent in batches=%u", now.batched);
+  last = now;
+}
+
+static void motion_task(void *)
+{
+  for (;;) {
+    // Wake on a new command or after one supervision period
+    ulTaskNotifyTake(pdTRUE, power_parked() ? MOTION_PARKED_TICKS : MOTION_SUPERVISE_TICKS);
+    Message msg;
+    bool cancelled;
+    while (command_queue_pop(msg, cancelled)) {
+      power_command((uint32_t)hal_micros()); // full clock before the command runs
+      LOG_DEBUG("[PROCESSING CMD] id=%u cmd=%s param=%d", msg.messageId, commandToString(msg.command), msg.param);
+      StepperContext *ctx = fsm_route(fsm_ctx, msg);
+      if (ctx && cancelled) fsm_cancel_waypoint(ctx, msg);
+      else if (ctx) fsm_handle_command(ctx, msg);
+    }
+    // Supervise motion; the step engines emit pulses in the background
+    for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+      fsm_handle(&fsm_ctx[axis]);
+      telemetry_update(&fsm_ctx[axis], hal_digital_read(AXIS_CONFIGS[axis].sensor_pin) == LOW, hal_millis());
+      power_update(&fsm_ctx[axis], hal_millis());
+    }
+  }
+}
+
+// CMD_RESET: let the ACK go out and write what is pending, then restart
+static void restart_after_flush()
+{
+  hal_delay_ms(100);
+  config_flush();
+  tuning_service();
+  LOG_DEBUG("[DEBUG] Calling ESP.restart() now...");
+  log_drain(LOG_RING_SIZE);
+  hal_restart();
+  LOG_ERROR("[DEBUG] ESP.restart() returned (should not happen)");
+}
+
+static void service_task(void *)
+{
+  for (;;) {
+    handshake_service(hal_millis());
+    latency_service((uint32_t)hal_micros(), (handshake_gui_capabilities() & HELLO_CAP_LATENCY) != 0);
+    config_service(hal_millis());
+    tuning_service();
+    journal_service();
+    if (config_restart_due()) restart_after_flush();
+    report_queue_stats();
+    report_radio_stats();
+    log_drain(LOG_DRAIN_BATCH);
+    perf_dump_pending();
+    profile_dump_pending();
+    trace_dump_pending();
+    if (MOTION_RATE_REPORT) report_step_rate();
+    vTaskDelay(SERVICE_PERIOD_TICKS);
+  }
+}
+
 void setup()
 {
+  // Nothing here waits: commands are accepted as soon as the tasks run and the
+  // GUI is found by the handshake in the service task
   Serial.begin(115200);
-  delay(300);
   Serial.println("StepperController starting...");
 
   WiFi.mode(WIFI_STA);
@@ -195,94 +356,58 @@ void setup()
   }
   Serial.println("ESP-NOW Initialized");
 
-  // Configure stepper pins only
-  pinMode(DIR_PIN, OUTPUT);
-  pinMode(STEP_PIN, OUTPUT);
-
-  // Register callbacks (old-style signatures expected by this core)
-  esp_now_register_recv_cb(on_data_recv);
-  esp_now_register_send_cb(on_data_sent);
-
-  // Add GUI as peer (optional but helpful)
-  esp_now_peer_info_t peer = {};
-  memcpy(peer.peer_addr, GUI_MAC, 6);
-  peer.channel = 0;
-  peer.encrypt = false;
-  if (esp_now_add_peer(&peer) != ESP_OK) {
-    Serial.println("Failed to add GUI as peer");
+  // Outbound frames are sent by the radio TX task; peers are added on first use
+  radio_link_init();
+  esp_now_register_send_cb(on_data_sent); // old-style signatures expected by this core
+  handshake_init(GUI_MAC, CONTROLLER_CAPABILITIES);
+
+  // Load persisted pulse delay settings (if present); the FSMs start from them
+  hal_nvs_begin("stepper"); // namespace "stepper"
+  // One blob read; the per-value keys of older firmware are migrated once
+  ConfigSource config_source = config_load();
+  Serial.printf("Config: %s\n", config_source == CONFIG_FROM_BLOB ? "loaded"
+                                : config_source == CONFIG_MIGRATED ? "migrated from per-value keys"
+                                : "defaults");
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+    const PulseDelays &pds = pulse_delays[axis];
+    Serial.printf("Axis %u pulse delays: slow=%ld, medium=%ld, fast=%ld, moveto=%ld\n", axis, pds.slow_pd,
+                  pds.med_pd, pds.fast_pd, pds.moveto_pd);
   }
+  Serial.printf("Tuning table: %u points\n", (unsigned)tuning_load());
 
-  Serial.println("Setup done");
-  
-  // ...existing code...
-  Serial.print("Initial position: ");
-  Serial.println(fsm_ctx.position);
-  
-  // Load persisted pulse delay settings (if present)
-  prefs.begin("stepper", false); // namespace "stepper"
-  // Migration: prefer new short/stable keys (slow_pd, med_pd, fast_pd, moveto_pd)
-  // If new key not present, fallback to old keys (slowPD, mediumPD, fastPD, moveToPD)
-  long tmp;
-  tmp = prefs.getLong("slow_pd", 0);
-  if (tmp != 0) slow_pd = tmp;
-  else {
-    tmp = prefs.getLong("slowPD", 0);
-    if (tmp != 0) { prefs.putLong("slow_pd", tmp); slow_pd = tmp; }
-  }
-  tmp = prefs.getLong("med_pd", 0);
-  if (tmp != 0) med_pd = tmp;
-  else {
-    tmp = prefs.getLong("mediumPD", 0);
-    if (tmp != 0) { prefs.putLong("med_pd", tmp); med_pd = tmp; }
-  }
-  tmp = prefs.getLong("fast_pd", 0);
-  if (tmp != 0) fast_pd = tmp;
-  else {
-    tmp = prefs.getLong("fastPD", 0);
-    if (tmp != 0) { prefs.putLong("fast_pd", tmp); fast_pd = tmp; }
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+    // Configure stepper pins and the step pulse timer
+    step_engine_init(axis);
+    // Sensor pin and home-edge interrupt; position unknown until homed or restored
+    fsm_init(&fsm_ctx[axis], axis);
   }
-  tmp = prefs.getLong("moveto_pd", 0);
-  if (tmp != 0) moveto_pd = tmp;
-  else {
-    tmp = prefs.getLong("moveToPD", 0);
-    if (tmp != 0) { prefs.putLong("moveto_pd", tmp); moveto_pd = tmp; }
-  }
-  Serial.print("Loaded pulse delays: slow="); Serial.print(slow_pd);
-  Serial.print(", medium="); Serial.print(med_pd);
-  Serial.print(", fast="); Serial.print(fast_pd);
-  Serial.print(", moveto="); Serial.println(moveto_pd);
-  
-  // Send reset command to GUI after controller startup
-  delay(2000); // Wait for system to stabilize and GUI to be ready
-  Serial.println("Sending reset command to GUI...");
-  send_message(CMD_RESET, STEPPER_PARAM_UNUSED, 0);
-  delay(500); // Give time for message to be sent
-  Serial.print("My IP is ");WiFi.localIP().toString(); Serial.println();
-}
 
-void loop()
-{
-  // ...existing code...
-delay(1);
-  Message msg;
-  // Non-blocking state machine stepping
-  // Small yield to avoid busy loop
-  delay(1);
-  while (cb.pop(msg)) {
-    Serial.print("[PROCESSING CMD] id="); Serial.print(msg.messageId);
-    Serial.print(" cmd="); Serial.print(commandToString(msg.command));
-    Serial.print(" param="); Serial.println(msg.param);
-    fsm_handle_command(&fsm_ctx, msg);
+  // Resume at the last resting position instead of re-homing, if it checks out.
+  // The journal holds axis 0; other axes home before absolute moves.
+  int restored_position = 0;
+  JournalSource journal_source = journal_load(restored_position);
+  if (journal_source != JOURNAL_NONE && fsm_restore_position(&fsm_ctx[0], restored_position)) {
+    Serial.printf("Position restored from %s\n", journal_source == JOURNAL_RETAINED ? "RTC memory" : "flash journal");
+  } else {
+    Serial.println("Position unknown: home before moving to absolute positions");
   }
+  Serial.print("Initial position: ");
+  Serial.println(fsm_ctx[0].position);
+  power_init(hal_millis());
 
-  // Non-blocking state machine stepping
-  unsigned long now_micros = micros();
-  unsigned long step_period = step_period_from_pd(pd);
+  xTaskCreatePinnedToCore(motion_task, "motion", MOTION_TASK_STACK, nullptr,
+                          MOTION_TASK_PRIORITY, &motion_task_handle, MOTION_TASK_CORE);
+  xTaskCreatePinnedToCore(service_task, "service", SERVICE_TASK_STACK, nullptr,
+                          SERVICE_TASK_PRIORITY, nullptr, SERVICE_TASK_CORE);
 
-  fsm_handle(&fsm_ctx, now_micros, step_period);
+  // Take commands once the FSM is ready
+  esp_now_register_recv_cb(on_data_recv);
 
-  // Small yield to avoid busy loop
-  delay(1);
+  Serial.printf("Setup done after %lu ms\n", millis());
 }
 
-// (forward declarations moved earlier in the file)
+void loop()
+{
+  // All work runs in the motion and service tasks created in setup()
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include "hal.h"
+#include <stdint.h>
+#include <array>
+
+// Trapezoidal motion planner used by the step engine.
+// MOTION_RAMP_HALF_PERIOD_US[n] is the half-pulse delay of the n-th step of a
+// constant-acceleration ramp from rest and is generated at compile time.
+// Acceleration walks up the table until the requested pulse delay (cruise) is
+// reached; deceleration walks back down so the last step before the target or a
+// soft limit is taken at the slowest ramp rate. The table length also bounds the
+// top speed: sqrt(2 * ACCEL * RAMP_STEPS) steps/s.
+
+#ifndef MOTION_ACCEL_STEPS_PER_S2
+#define MOTION_ACCEL_STEPS_PER_S2 20000
+#endif
+#ifndef MOTION_RAMP_STEPS
+#define MOTION_RAMP_STEPS 1024
+#endif
+
+// Steps remaining when the motion has no end point (homing sweep)
+constexpr uint32_t MOTION_UNBOUNDED = 0xFFFFFFFFUL;
+
+namespace motion_planner_detail {
+
+constexpr double const_sqrt(double x)
+{
+  if (x <= 0.0) return 0.0;
+  double g = x > 1.0 ? x : 1.0;
+  for (int i = 0; i < 48; ++i) g = 0.5 * (g + x / g);
+  return g;
+}
+
+constexpr std::array<uint16_t, MOTION_RAMP_STEPS> make_ramp()
+{
+  std::array<uint16_t, MOTION_RAMP_STEPS> table{};
+  constexpr double accel = MOTION_ACCEL_STEPS_PER_S2;
+  for (size_t n = 0; n < MOTION_RAMP_STEPS; ++n) {
+    // t(n) = sqrt(2n / a): time at which step n is taken when starting from rest
+    double step_s = const_sqrt(2.0 * (n + 1) / accel) - const_sqrt(2.0 * n / accel);
+    double half_us = step_s * 1e6 / 2.0 + 0.5;
+    table[n] = half_us > 65535.0 ? 65535 : (uint16_t)half_us;
+  }
+  return table;
+}
+
+} // namespace motion_planner_detail
+
+// Kept in DRAM so the step ISR never touches flash
+static constexpr DRAM_ATTR std::array<uint16_t, MOTION_RAMP_STEPS> MOTION_RAMP_HALF_PERIOD_US =
+    motion_planner_detail::make_ramp();
+
+static_assert(MOTION_RAMP_STEPS >= 2 && MOTION_RAMP_STEPS <= 0xFFFF, "ramp index is 16 bits");
+static_assert(MOTION_RAMP_HALF_PERIOD_US[0] > MOTION_RAMP_HALF_PERIOD_US[MOTION_RAMP_STEPS - 1],
+              "ramp table must speed up");
+
+// Per-axis ramp state
+struct MotionRamp {
+  uint16_t index;        // current ramp step (0 = from rest)
+  uint16_t cruise_index; // first ramp step at or faster than cruise
+  uint32_t cruise_half_us;
+};
+
+// First ramp index whose half-period is <= cruise_half_us (table is decreasing)
+inline uint16_t planner_cruise_index(uint32_t cruise_half_us)
+{
+  uint16_t lo = 0, hi = MOTION_RAMP_STEPS - 1;
+  while (lo < hi) {
+    uint16_t mid = (lo + hi) / 2;
+    if (MOTION_RAMP_HALF_PERIOD_US[mid] <= cruise_half_us) hi = mid;
+    else lo = mid + 1;
+  }
+  return lo;
+}
+
+// Start a new motion from rest
+inline void planner_begin(MotionRamp &ramp, uint32_t cruise_half_us)
+{
+  ramp.index = 0;
+  ramp.cruise_half_us = cruise_half_us;
+  ramp.cruise_index = planner_cruise_index(cruise_half_us);
+}
+
+// Change cruise speed while moving; the ramp index converges one step at a time
+inline void planner_set_cruise(MotionRamp &ramp, uint32_t cruise_half_us)
+{
+  ramp.cruise_half_us = cruise_half_us;
+  ramp.cruise_index = planner_cruise_index(cruise_half_us);
+}
+
+// Half-period for the next step. steps_remaining counts the step about to be
+// taken (>= 1) or is MOTION_UNBOUNDED. The index moves by one step at most, in
+// either direction, so the motor is never asked for a sudden slow-down: the
+// engine must leave index+1 steps to stop in (step_engine_decelerate()).
+inline uint32_t IRAM_ATTR planner_next_half_period(MotionRamp &ramp, uint32_t steps_remaining)
+{
+  uint32_t after = steps_remaining - 1; // steps left once this one is taken
+  uint32_t half = MOTION_RAMP_HALF_PERIOD_US[ramp.index];
+  // Above a lowered cruise rate the ramp walks back down the table
+  if (ramp.index == ramp.cruise_index && half < ramp.cruise_half_us) half = ramp.cruise_half_us;
+  if (ramp.index < ramp.cruise_index && ramp.index + 1U < after) ramp.index++;
+  else if ((ramp.index > ramp.cruise_index || ramp.index >= after) && ramp.index > 0) ramp.index--;
+  return half;
+}
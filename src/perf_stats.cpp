@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include "perf_stats.h"
+
+// Hands a diagnostic frame to the radio link
+extern bool send_diagnostic(const uint8_t *frame, size_t len);
+
+constexpr size_t PERF_LINE_MAX = 160;
+
+static PerfHistogram histograms[PERF_PROBE_COUNT];
+static HalLock perf_lock;
+
+// Snapshot taken by perf_report(), printed later by the service task
+static PerfHistogram pending[PERF_PROBE_COUNT];
+static volatile bool dump_pending = false;
+
+static const char *const PROBE_NAMES[PERF_PROBE_COUNT] = {
+  "step_jitter", "step_isr", "command", "supervise", "supervise_interval", "send", "radio_confirm", "queue_wait",
+  "wake",
+};
+
+static inline uint32_t IRAM_ATTR bucket_of(uint32_t ns)
+{
+  uint32_t bucket = ns ? 32 - __builtin_clz(ns) : 0;
+  return bucket < PERF_BUCKETS ? bucket : PERF_BUCKETS - 1;
+}
+
+void IRAM_ATTR perf_record_ns(PerfProbe probe, uint32_t ns)
+{
+  PerfHistogram &hist = histograms[probe];
+  hal_lock(perf_lock);
+  if (hist.count == 0 || ns < hist.min_ns) hist.min_ns = ns;
+  if (ns > hist.max_ns) hist.max_ns = ns;
+  hist.count++;
+  hist.sum_ns += ns;
+  hist.buckets[bucket_of(ns)]++;
+  hal_unlock(perf_lock);
+}
+
+PerfHistogram perf_snapshot(PerfProbe probe)
+{
+  hal_lock(perf_lock);
+  PerfHistogram copy = histograms[probe];
+  hal_unlock(perf_lock);
+  return copy;
+}
+
+void perf_reset()
+{
+  hal_lock(perf_lock);
+  memset(histograms, 0, sizeof(histograms));
+  hal_unlock(perf_lock);
+}
+
+const char *perf_probe_name(PerfProbe probe)
+{
+  return probe < PERF_PROBE_COUNT ? PROBE_NAMES[probe] : "?";
+}
+
+uint32_t perf_percentile_ns(const PerfHistogram &hist, uint32_t percentile)
+{
+  if (hist.count == 0) return 0;
+  uint64_t wanted = ((uint64_t)hist.count * percentile + 99) / 100;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < PERF_BUCKETS; ++i) {
+    seen += hist.buckets[i];
+    if (seen >= wanted) return i + 1 < PERF_BUCKETS ? (1UL << i) : hist.max_ns;
+  }
+  return hist.max_ns;
+}
+
+static void print_histogram(PerfProbe probe, const PerfHistogram &hist)
+{
+  char line[PERF_LINE_MAX];
+  uint32_t mean = hist.count ? (uint32_t)(hist.sum_ns / hist.count) : 0;
+  int n = snprintf(line, sizeof(line), "perf %-18s n=%lu min=%lu mean=%lu p50<=%lu p99<=%lu max=%lu ns\n",
+                   perf_probe_name(probe), (unsigned long)hist.count, (unsigned long)hist.min_ns,
+                   (unsigned long)mean, (unsigned long)perf_percentile_ns(hist, 50),
+                   (unsigned long)perf_percentile_ns(hist, 99), (unsigned long)hist.max_ns);
+  hal_console_write((const uint8_t *)line, (size_t)n);
+  if (hist.count == 0) return;
+  size_t len = (size_t)snprintf(line, sizeof(line), "    ");
+  for (size_t i = 0; i < PERF_BUCKETS; ++i) {
+    if (!hist.buckets[i]) continue;
+    // "<2^i ns:count"; the last bucket is open ended
+    n = snprintf(line + len, sizeof(line) - len, i + 1 < PERF_BUCKETS ? " <%lu:%lu" : " >=%lu:%lu",
+                 (unsigned long)(i + 1 < PERF_BUCKETS ? (1UL << i) : (1UL << (i - 1))),
+                 (unsigned long)hist.buckets[i]);
+    if (n < 0 || len + (size_t)n >= sizeof(line) - 1) break;
+    len += (size_t)n;
+  }
+  line[len++] = '\n';
+  hal_console_write((const uint8_t *)line, len);
+}
+
+void perf_report(uint8_t messageId, bool reset)
+{
+  PerfHistogram snapshot[PERF_PROBE_COUNT];
+  hal_lock(perf_lock);
+  memcpy(snapshot, histograms, sizeof(snapshot));
+  if (reset) memset(histograms, 0, sizeof(histograms));
+  hal_unlock(perf_lock);
+
+  for (uint8_t probe = 0; probe < PERF_PROBE_COUNT; ++probe) {
+    const PerfHistogram &hist = snapshot[probe];
+    PerfReport frame;
+    frame.messageId = messageId;
+    frame.kind = PERF_REPORT_KIND;
+    frame.probe = probe;
+    frame.count = hist.count;
+    frame.min_ns = hist.min_ns;
+    frame.mean_ns = hist.count ? (uint32_t)(hist.sum_ns / hist.count) : 0;
+    frame.p50_ns = perf_percentile_ns(hist, 50);
+    frame.p99_ns = perf_percentile_ns(hist, 99);
+    frame.max_ns = hist.max_ns;
+    send_diagnostic((const uint8_t *)&frame, sizeof(frame));
+  }
+  // A request arriving while the previous dump is still printing only gets frames
+  if (!dump_pending) {
+    memcpy(pending, snapshot, sizeof(pending));
+    dump_pending = true;
+  }
+}
+
+void perf_dump_pending()
+{
+  if (!dump_pending) return;
+  for (uint8_t probe = 0; probe < PERF_PROBE_COUNT; ++probe) print_histogram((PerfProbe)probe, pending[probe]);
+  dump_pending = false;
+}
+
+void perf_dump()
+{
+  for (uint8_t probe = 0; probe < PERF_PROBE_COUNT; ++probe) {
+    print_histogram((PerfProbe)probe, perf_snapshot((PerfProbe)probe));
+  }
+}
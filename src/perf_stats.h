@@ -0,0 +1,87 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "hal.h"
+
+// Timing instrumentation.
+// Probes take cycle-counter timestamps around the step ISR, command handling,
+// FSM supervision and the send path, and time how long commands wait in the
+// command queue (microsecond clock, since the two ends run on different cores), and fold the durations (nanoseconds) into
+// fixed-size log2 histograms: bucket i counts values below 2^i ns. Recording is
+// ISR safe and costs a few dozen cycles; build with -DPERF_STATS=0 to compile the
+// probes out. CMD_PERF_STATS sends one PerfReport frame per probe and prints the
+// full histograms on the console (see README "Diagnostics").
+// Histograms are per probe; each probe should be recorded from one context.
+
+#ifndef PERF_STATS
+#define PERF_STATS 1
+#endif
+
+enum PerfProbe : uint8_t {
+  PERF_STEP_JITTER,        // rising-edge interval vs planned interval (step ISR)
+  PERF_STEP_ISR,           // step ISR execution time
+  PERF_COMMAND,            // fsm_handle_command()
+  PERF_SUPERVISE,          // fsm_handle()
+  PERF_SUPERVISE_INTERVAL, // time between fsm_handle() calls
+  PERF_SEND,               // send_message() until the frame is queued
+  PERF_RADIO_CONFIRM,      // esp_now_send() until the send callback
+  PERF_QUEUE_WAIT,         // command_queue_push() until the motion task pops the command
+  PERF_WAKE,               // command to a released motor until its first step (power_policy.h)
+  PERF_PROBE_COUNT
+};
+
+constexpr size_t PERF_BUCKETS = 25; // last bucket collects everything >= 2^23 ns (8.4 ms)
+
+struct PerfHistogram {
+  uint32_t count;
+  uint32_t min_ns;
+  uint32_t max_ns;
+  uint64_t sum_ns;
+  uint32_t buckets[PERF_BUCKETS];
+};
+
+// Diagnostic frame, one per probe. Byte 1 holds a kind outside the command
+// range, like the telemetry frames.
+constexpr uint8_t PERF_REPORT_KIND = 0xFC;
+
+struct __attribute__((packed)) PerfReport {
+  uint8_t messageId; // id of the CMD_PERF_STATS request
+  uint8_t kind;      // PERF_REPORT_KIND
+  uint8_t probe;     // PerfProbe
+  uint32_t count;
+  uint32_t min_ns;
+  uint32_t mean_ns;
+  uint32_t p50_ns; // bucket upper bounds
+  uint32_t p99_ns;
+  uint32_t max_ns;
+};
+
+// CMD_PERF_STATS param bits
+constexpr int32_t PERF_PARAM_RESET = 0x1; // clear the histograms after reporting
+
+void perf_record_ns(PerfProbe probe, uint32_t ns);
+
+inline uint32_t IRAM_ATTR perf_begin()
+{
+  return PERF_STATS ? hal_cycle_count() : 0;
+}
+
+inline void IRAM_ATTR perf_end(PerfProbe probe, uint32_t start_cycles)
+{
+  if (PERF_STATS) perf_record_ns(probe, (uint32_t)((uint64_t)(hal_cycle_count() - start_cycles) * 1000U / hal_cycles_per_us()));
+}
+
+// Copy of one histogram, taken under the stats lock
+PerfHistogram perf_snapshot(PerfProbe probe);
+void perf_reset();
+const char *perf_probe_name(PerfProbe probe);
+// Upper bound (ns) of the bucket holding the given percentile (0-100)
+uint32_t perf_percentile_ns(const PerfHistogram &hist, uint32_t percentile);
+
+// Answer CMD_PERF_STATS: snapshot every probe, send one PerfReport each through
+// send_diagnostic() and queue the same snapshot for perf_dump_pending()
+void perf_report(uint8_t messageId, bool reset);
+// Print the snapshot queued by perf_report() (service task)
+void perf_dump_pending();
+// Print the live histograms now (simulation)
+void perf_dump();
@@ -0,0 +1,196 @@
+#include <stddef.h>
+#include <string.h>
+#include "position_journal.h"
+#include "crc32.h"
+#include "deferred_log.h"
+#include "hal.h"
+
+constexpr size_t RECORD_SIZE = sizeof(JournalRecord);
+// Boot scan reads this many bytes per flash access
+constexpr size_t SCAN_CHUNK = 256;
+static_assert(HAL_JOURNAL_SECTOR % SCAN_CHUNK == 0 && SCAN_CHUNK % RECORD_SIZE == 0, "records must not straddle sectors");
+
+struct RetainedPosition {
+  uint32_t magic;
+  int32_t position;
+  uint32_t known_good;
+  uint32_t crc; // CRC-32 of everything above
+};
+static_assert(sizeof(RetainedPosition) <= HAL_RETAINED_SIZE, "retained record does not fit");
+
+// Last note from the motion task
+static HalLock note_lock;
+static bool noted = false;
+static bool noted_good = false;
+static int noted_position = 0;
+
+// Flash state, owned by the service task after journal_load()
+static size_t journal_size = 0; // 0: no usable partition
+static size_t next_offset = 0;
+static size_t last_offset = 0;
+static bool have_last = false;
+static JournalRecord last = {};
+static JournalStats stats = {};
+
+static uint32_t record_crc(const JournalRecord &record)
+{
+  return crc32_update(0, &record, offsetof(JournalRecord, crc));
+}
+
+static bool record_valid(const JournalRecord &record)
+{
+  return record.reserved == 0xFFFF && record.seq != 0xFFFFFFFFUL && record.crc == record_crc(record);
+}
+
+static uint32_t retained_crc(const RetainedPosition &retained)
+{
+  return crc32_update(0, &retained, offsetof(RetainedPosition, crc));
+}
+
+static bool slot_blank(size_t offset)
+{
+  uint8_t bytes[RECORD_SIZE];
+  if (!hal_journal_read(offset, bytes, sizeof(bytes))) return false;
+  for (uint8_t b : bytes) {
+    if (b != 0xFF) return false;
+  }
+  return true;
+}
+
+// Find the newest valid record; appends continue in the slot after it
+static void journal_scan()
+{
+  have_last = false;
+  next_offset = 0;
+  journal_size = hal_journal_size();
+  if (journal_size < 2 * HAL_JOURNAL_SECTOR) {
+    // One sector cannot be erased without losing the newest record
+    if (journal_size) LOG_WARN("[JOURNAL] partition too small (%u bytes), disabled", (unsigned)journal_size);
+    journal_size = 0;
+    return;
+  }
+  journal_size -= journal_size % HAL_JOURNAL_SECTOR;
+  uint8_t chunk[SCAN_CHUNK];
+  for (size_t base = 0; base < journal_size; base += SCAN_CHUNK) {
+    if (!hal_journal_read(base, chunk, sizeof(chunk))) continue;
+    for (size_t i = 0; i < SCAN_CHUNK; i += RECORD_SIZE) {
+      JournalRecord record;
+      memcpy(&record, chunk + i, sizeof(record));
+      if (!record_valid(record) || (have_last && record.seq <= last.seq)) continue;
+      last = record;
+      last_offset = base + i;
+      have_last = true;
+    }
+  }
+  if (have_last) next_offset = (last_offset + RECORD_SIZE) % journal_size;
+}
+
+static void journal_append(int position)
+{
+  JournalRecord record;
+  record.seq = have_last ? last.seq + 1 : 1;
+  record.position = position;
+  record.crc = record_crc(record);
+  record.reserved = 0xFFFF;
+  record.live = JOURNAL_LIVE;
+  for (size_t slots = journal_size / RECORD_SIZE; slots; --slots) {
+    size_t offset = next_offset;
+    next_offset = (next_offset + RECORD_SIZE) % journal_size;
+    if (offset % HAL_JOURNAL_SECTOR == 0) {
+      // Entering a sector: it holds the oldest records of the ring
+      if (!hal_journal_erase_sector(offset)) {
+        stats.write_errors++;
+        return;
+      }
+      stats.erases++;
+    } else if (!slot_blank(offset)) {
+      // Left behind by a write that lost power
+      stats.torn_skipped++;
+      continue;
+    }
+    if (!hal_journal_write(offset, &record, sizeof(record))) {
+      stats.write_errors++;
+      return;
+    }
+    last = record;
+    last_offset = offset;
+    have_last = true;
+    stats.appends++;
+    LOG_DEBUG("[JOURNAL] seq=%u position=%d at 0x%x", record.seq, position, (unsigned)offset);
+    return;
+  }
+}
+
+// The motor moved off the newest record: clear its live flag in place
+static void journal_retire()
+{
+  uint16_t moved = 0;
+  if (!hal_journal_write(last_offset + offsetof(JournalRecord, live), &moved, sizeof(moved))) {
+    stats.write_errors++;
+    return;
+  }
+  last.live = moved;
+}
+
+JournalSource journal_load(int &position)
+{
+  journal_scan();
+  hal_lock(note_lock);
+  noted = false;
+  hal_unlock(note_lock);
+
+  const RetainedPosition *retained = (const RetainedPosition *)hal_retained_ram();
+  if (retained->magic == JOURNAL_RETAINED_MAGIC && retained->crc == retained_crc(*retained)) {
+    // Soft reset: RTC memory saw every transition, so it is never stale
+    if (!retained->known_good) return JOURNAL_NONE;
+    position = retained->position;
+    return JOURNAL_RETAINED;
+  }
+  if (have_last && last.live == JOURNAL_LIVE) {
+    position = last.position;
+    return JOURNAL_FLASH;
+  }
+  return JOURNAL_NONE;
+}
+
+void journal_note(bool known_good, int position)
+{
+  // Only the motion task writes the noted values, so it may read them unlocked
+  if (noted && known_good == noted_good && (!known_good || position == noted_position)) return;
+  RetainedPosition retained;
+  retained.magic = JOURNAL_RETAINED_MAGIC;
+  retained.position = position;
+  retained.known_good = known_good;
+  retained.crc = retained_crc(retained);
+  memcpy(hal_retained_ram(), &retained, sizeof(retained));
+
+  hal_lock(note_lock);
+  noted = true;
+  noted_good = known_good;
+  noted_position = position;
+  hal_unlock(note_lock);
+}
+
+void journal_service()
+{
+  if (!journal_size) return;
+  hal_lock(note_lock);
+  bool any = noted;
+  bool known_good = noted_good;
+  int position = noted_position;
+  hal_unlock(note_lock);
+  if (!any) return;
+
+  bool last_live = have_last && last.live == JOURNAL_LIVE;
+  if (known_good) {
+    // A newer record supersedes a live one, no need to retire it first
+    if (!last_live || last.position != position) journal_append(position);
+  } else if (last_live) {
+    journal_retire();
+  }
+}
+
+JournalStats journal_stats()
+{
+  return stats;
+}
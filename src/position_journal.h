@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+
+// Position persistence, so a reset does not cost a homing sweep.
+// Two copies of the last known-good resting position:
+//  - a CRC-checked record in RTC memory (hal_retained_ram()), updated on every
+//    rest/motion transition. It survives CMD_RESET, panics and watchdog resets,
+//    but not a power cut.
+//  - an append-only journal of 16-byte records in the "journal" flash partition
+//    (partitions.csv), appended by the service task when the motor comes to rest.
+//    When it moves off again, the record's live flag is cleared in place (NOR
+//    writes can clear bits without an erase). The records walk through the
+//    sectors as a ring, and each sector is erased only when the ring comes back
+//    to it, so the wear spreads across the whole partition.
+// At boot a valid RTC record wins; otherwise the newest valid journal record is
+// used if it is still live. A power cut within one service period (20 ms) of a
+// move starting can leave a live record behind, so the FSM also checks the
+// position against the TCRT5000 before accepting it (fsm_restore_position).
+
+constexpr uint32_t JOURNAL_RETAINED_MAGIC = 0x4A524E4CUL; // "JRNL"
+constexpr uint16_t JOURNAL_LIVE = 0xFFFF;
+
+struct __attribute__((packed)) JournalRecord {
+  uint32_t seq;      // increases by one per record, the newest valid one wins
+  int32_t position;
+  uint32_t crc;      // CRC-32 of seq and position
+  uint16_t reserved; // 0xFFFF
+  uint16_t live;     // JOURNAL_LIVE while the motor rests there, 0 once it moves off
+};
+
+enum JournalSource : uint8_t {
+  JOURNAL_NONE,     // nothing trustworthy: home before moving to absolute positions
+  JOURNAL_RETAINED, // RTC record from before a soft reset
+  JOURNAL_FLASH     // live journal record from before a power cut
+};
+
+struct JournalStats {
+  uint32_t appends;      // records written
+  uint32_t erases;       // sectors erased
+  uint32_t torn_skipped; // partially written slots stepped over
+  uint32_t write_errors;
+};
+
+// Boot: scan the journal and pick the position to restore, if any
+JournalSource journal_load(int &position);
+// Motion task, every supervision pass: known_good = homed and at rest.
+// Only touches RAM; the flash work happens in journal_service().
+void journal_note(bool known_good, int position);
+// Service task: bring the flash journal up to date with the last note
+void journal_service();
+JournalStats journal_stats();
@@ -0,0 +1,96 @@
+#include "power_policy.h"
+#include "step_engine.h"
+#include "perf_stats.h"
+#include "deferred_log.h"
+#include "axis.h"
+#include "hal.h"
+
+struct AxisPower {
+  uint32_t rest_since_ms;
+  bool resting;
+  bool waking;         // a command arrived while released; PERF_WAKE waits for the first step
+  uint32_t wake_us;    // the latest such command
+  uint32_t wake_steps; // step count when the motor was released
+};
+
+// Motion task only
+static AxisPower axis_power[AXIS_COUNT];
+static uint32_t quiet_ms = IDLE_POWER_QUIET_MS;
+static uint32_t full_mhz = 0;
+static bool parked = false;
+
+void power_init(uint32_t now_ms)
+{
+  full_mhz = hal_cpu_mhz();
+  parked = false;
+  for (AxisPower &p : axis_power) p = AxisPower{now_ms, false, false, 0, 0};
+}
+
+void power_command(uint32_t now_us)
+{
+  if (parked) {
+    if (!hal_set_cpu_mhz(full_mhz)) LOG_ERROR("[POWER] CPU clock %u MHz not restored", full_mhz);
+    parked = false;
+  }
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+    AxisPower &p = axis_power[axis];
+    if (!step_engine_released(axis)) continue;
+    p.waking = true;
+    p.wake_us = now_us;
+  }
+}
+
+static void record_wake(AxisPower &p, uint8_t axis)
+{
+  if (step_engine_released(axis)) return;
+  uint32_t rise_us;
+  if (step_engine_last_step(axis, rise_us) != p.wake_steps) {
+    uint32_t waited_us = rise_us - p.wake_us;
+    perf_record_ns(PERF_WAKE, waited_us < UINT32_MAX / 1000U ? waited_us * 1000U : UINT32_MAX);
+    p.waking = false;
+  } else if (!step_engine_running(axis)) {
+    p.waking = false; // enabled, but stopped before a step
+  }
+}
+
+// Clock down once every axis is released; a command that moved nothing brings it back here
+static void park()
+{
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+    if (!step_engine_released(axis)) return;
+  }
+  parked = true; // the slower supervision still saves power if the clock stays
+  if (!hal_set_cpu_mhz(POWER_IDLE_CPU_MHZ)) LOG_WARN("[POWER] CPU clock %u MHz not supported", POWER_IDLE_CPU_MHZ);
+  else LOG_INFO("[POWER] all axes released, CPU at %u MHz", POWER_IDLE_CPU_MHZ);
+}
+
+void power_update(const StepperContext *ctx, uint32_t now_ms)
+{
+  uint8_t axis = ctx->axis;
+  AxisPower &p = axis_power[axis];
+  if (PERF_STATS && p.waking) record_wake(p, axis);
+  if (ctx->state != STATE_IDLE || step_engine_running(axis)) {
+    p.resting = false;
+    return;
+  }
+  if (!p.resting) {
+    p.resting = true;
+    p.rest_since_ms = now_ms;
+  }
+  if (!quiet_ms || now_ms - p.rest_since_ms < quiet_ms) return;
+  if (!step_engine_released(axis) && step_engine_release(axis)) {
+    p.wake_steps = step_engine_step_count(axis);
+    LOG_INFO("[POWER] axis %u released after %u ms at rest", axis, quiet_ms);
+  }
+  if (!parked) park();
+}
+
+bool power_parked()
+{
+  return parked;
+}
+
+void power_set_quiet_ms(uint32_t ms)
+{
+  quiet_ms = ms;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include "fsm.h"
+
+// Idle power for battery and solar installs.
+// An axis that has rested for the quiet period releases its motor: the step
+// engine drives the DM542 ENA input (AxisConfig::enable_pin) to cut the
+// winding current, and the next run or move-to enables it again
+// STEP_ENGINE_ENABLE_SETUP_US ahead of the first step. Once every axis is
+// released the CPU clock drops to POWER_IDLE_CPU_MHZ and the motion task
+// supervises every POWER_PARKED_SUPERVISE_MS instead of every millisecond.
+//
+// The radio keeps listening, so ESP-NOW commands still wake the controller:
+// the motion task takes the full clock back before it handles the first one.
+// The PERF_WAKE probe times a command that finds its axis released until that
+// axis' first step.
+//
+// Release the motor only if the mechanics hold the capacitor without current;
+// -DIDLE_POWER_QUIET_MS=0 keeps the windings energised and the clock up.
+
+#ifndef IDLE_POWER_QUIET_MS
+#define IDLE_POWER_QUIET_MS 30000
+#endif
+
+constexpr uint32_t POWER_IDLE_CPU_MHZ = 80; // lowest clock Wi-Fi runs at
+constexpr uint32_t POWER_PARKED_SUPERVISE_MS = 20;
+
+// Call once at boot, after step_engine_init(): every axis starts energised at the full clock
+void power_init(uint32_t now_ms);
+// Motion task, before handling each command
+void power_command(uint32_t now_us);
+// Motion task, after supervising the axis
+void power_update(const StepperContext *ctx, uint32_t now_ms);
+// Every axis released and the clock down
+bool power_parked();
+// Rest before an axis is released, 0 for never; IDLE_POWER_QUIET_MS until set
+void power_set_quiet_ms(uint32_t quiet_ms);
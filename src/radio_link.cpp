@@ -0,0 +1,265 @@
+#include <Arduino.h>
+#include "radio_link.h"
+#include "stepper_helpers.h"
+#include "deferred_log.h"
+#include "hal.h"
+#include "perf_stats.h"
+#include "batch_frame.h"
+
+constexpr size_t TX_QUEUE_LENGTH = 24;
+constexpr BaseType_t TX_TASK_CORE = PRO_CPU_NUM;
+constexpr UBaseType_t TX_TASK_PRIORITY = 3;
+constexpr uint32_t TX_TASK_STACK = 3072;
+// How long to wait for the send callback before treating the frame as failed
+constexpr TickType_t TX_CONFIRM_TIMEOUT = pdMS_TO_TICKS(50);
+constexpr uint8_t TX_MAX_ATTEMPTS = 5;
+constexpr uint32_t TX_BACKOFF_BASE_MS = 2;
+constexpr uint32_t TX_BACKOFF_MAX_MS = 32;
+// Idle wait between checks of the coalesced position slot
+constexpr TickType_t TX_IDLE_POLL = pdMS_TO_TICKS(10);
+
+// Inbound duplicate window
+constexpr size_t DEDUPE_SLOTS = 16;
+constexpr unsigned long DEDUPE_WINDOW_MS = 2000;
+
+// Send-callback result passed to the TX task as a notification value
+constexpr uint32_t TX_NOTIFY_OK = 1;
+constexpr uint32_t TX_NOTIFY_FAIL = 2;
+
+struct OutFrame {
+  uint8_t mac[ESP_NOW_ETH_ALEN];
+  uint8_t len;
+  uint8_t data[RADIO_FRAME_MAX];
+};
+
+struct SeenCommand {
+  uint8_t mac[ESP_NOW_ETH_ALEN];
+  uint8_t messageId;
+  unsigned long seen_ms;
+};
+
+static QueueHandle_t tx_queue = nullptr;
+static TaskHandle_t tx_task_handle = nullptr;
+
+// Coalescing slots, written by any task, taken by the TX task. The lock also
+// covers the counters, which the TX task, the receive callback and every
+// producer update.
+static HalLock link_lock;
+static RadioLinkStats stats = {};
+static bool slot_pending[RADIO_SLOT_COUNT] = {};
+static OutFrame slot_frame[RADIO_SLOT_COUNT];
+
+// Peer that accepts batch frames (HELLO_CAP_BATCH); all zero when none
+static uint8_t batch_mac[ESP_NOW_ETH_ALEN] = {};
+static volatile bool batch_enabled = false;
+static uint8_t batch_seq = 0;
+
+// Only the receive callback (Wi-Fi task) touches the dedupe window
+static SeenCommand seen[DEDUPE_SLOTS];
+static size_t seen_next = 0;
+
+static void count(uint32_t RadioLinkStats::*counter, uint32_t n = 1)
+{
+  hal_lock(link_lock);
+  stats.*counter += n;
+  hal_unlock(link_lock);
+}
+
+// Take a pending slot frame; with mac set, only one for mac of at most max_len bytes
+static bool take_slot(OutFrame &frame, const uint8_t *mac = nullptr, size_t max_len = RADIO_FRAME_MAX)
+{
+  bool taken = false;
+  hal_lock(link_lock);
+  for (size_t i = 0; i < RADIO_SLOT_COUNT && !taken; ++i) {
+    if (slot_pending[i] && slot_frame[i].len <= max_len &&
+        (!mac || memcmp(slot_frame[i].mac, mac, ESP_NOW_ETH_ALEN) == 0)) {
+      frame = slot_frame[i];
+      slot_pending[i] = false;
+      taken = true;
+    }
+  }
+  hal_unlock(link_lock);
+  return taken;
+}
+
+static inline const Message *frame_message(const OutFrame &frame)
+{
+  return frame.len == sizeof(Message) ? (const Message *)frame.data : nullptr;
+}
+
+// Send one frame and wait for its send callback, retrying with backoff
+static bool transmit_raw(const uint8_t *mac, const uint8_t *data, size_t len)
+{
+  uint32_t backoff_ms = TX_BACKOFF_BASE_MS;
+  for (uint8_t attempt = 1; attempt <= TX_MAX_ATTEMPTS; ++attempt) {
+    xTaskNotifyWait(0, UINT32_MAX, nullptr, 0); // discard any stale result
+    uint32_t result = TX_NOTIFY_FAIL;
+    uint32_t perf_start = perf_begin();
+    if (hal_radio_send(mac, data, len)) {
+      if (xTaskNotifyWait(0, UINT32_MAX, &result, TX_CONFIRM_TIMEOUT) != pdTRUE) result = TX_NOTIFY_FAIL;
+      else perf_end(PERF_RADIO_CONFIRM, perf_start);
+    }
+    if (result == TX_NOTIFY_OK) {
+      count(&RadioLinkStats::sent);
+      return true;
+    }
+    if (attempt == TX_MAX_ATTEMPTS) break;
+    count(&RadioLinkStats::retries);
+    LOG_DEBUG("[TX] retry len=%u attempt=%u", len, attempt);
+    vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+    backoff_ms = min(backoff_ms * 2, TX_BACKOFF_MAX_MS);
+  }
+  count(&RadioLinkStats::failed);
+  return false;
+}
+
+static void transmit(const OutFrame &frame)
+{
+  if (transmit_raw(frame.mac, frame.data, frame.len)) return;
+  if (const Message *msg = frame_message(frame)) {
+    LOG_WARN("[TX] giving up id=%u cmd=%s", msg->messageId, commandToString(msg->command));
+  } else {
+    LOG_WARN("[TX] giving up frame len=%u", frame.len);
+  }
+}
+
+static bool batching_to(const uint8_t *mac)
+{
+  return batch_enabled && memcmp(mac, batch_mac, ESP_NOW_ETH_ALEN) == 0;
+}
+
+// Pack first and whatever else is already waiting for the same peer into one
+// batch frame. Only frames that were queued anyway are merged, so nothing waits
+// for a batch to fill.
+static void transmit_batch(const OutFrame &first)
+{
+  BatchBuilder batch;
+  batch_begin(batch, batch_seq);
+  batch_append(batch, first.data, first.len);
+  OutFrame next;
+  while (xQueuePeek(tx_queue, &next, 0) == pdTRUE && memcmp(next.mac, first.mac, ESP_NOW_ETH_ALEN) == 0 &&
+         batch_fits(batch, next.len)) {
+    xQueueReceive(tx_queue, &next, 0);
+    batch_append(batch, next.data, next.len);
+  }
+  while (batch_fits(batch, sizeof(Message)) && take_slot(next, first.mac, BATCH_FRAME_MAX - batch.len - 1)) {
+    batch_append(batch, next.data, next.len);
+  }
+  if (batch_records(batch) == 1) {
+    transmit(first);
+    return;
+  }
+  batch_seq++;
+  count(&RadioLinkStats::batched, batch_records(batch));
+  if (!transmit_raw(first.mac, batch.data, batch.len)) {
+    LOG_WARN("[TX] giving up batch of %u frames", (unsigned)batch_records(batch));
+  }
+}
+
+static void tx_task(void *)
+{
+  OutFrame frame;
+  for (;;) {
+    // Queued replies/ACKs first; coalesced slots go out when the queue is idle
+    if (xQueueReceive(tx_queue, &frame, TX_IDLE_POLL) == pdTRUE || take_slot(frame)) {
+      if (batching_to(frame.mac)) transmit_batch(frame);
+      else transmit(frame);
+    }
+  }
+}
+
+void radio_link_init()
+{
+  tx_queue = xQueueCreate(TX_QUEUE_LENGTH, sizeof(OutFrame));
+  xTaskCreatePinnedToCore(tx_task, "radio_tx", TX_TASK_STACK, nullptr, TX_TASK_PRIORITY, &tx_task_handle,
+                          TX_TASK_CORE);
+}
+
+void radio_link_set_batch_peer(const uint8_t *mac)
+{
+  batch_enabled = false;
+  if (!mac) return;
+  memcpy(batch_mac, mac, ESP_NOW_ETH_ALEN);
+  batch_enabled = true;
+}
+
+bool radio_link_send_raw(const uint8_t *mac, const uint8_t *data, size_t len)
+{
+  if (len == 0 || len > RADIO_FRAME_MAX) return false;
+  OutFrame frame;
+  memcpy(frame.mac, mac, ESP_NOW_ETH_ALEN);
+  frame.len = (uint8_t)len;
+  memcpy(frame.data, data, len);
+  if (!tx_queue || xQueueSend(tx_queue, &frame, 0) != pdTRUE) {
+    count(&RadioLinkStats::queue_overflows);
+    return false;
+  }
+  return true;
+}
+
+bool radio_link_send(const uint8_t *mac, const Message &msg)
+{
+  return radio_link_send_raw(mac, (const uint8_t *)&msg, sizeof(msg));
+}
+
+bool radio_link_post_latest(RadioSlot slot, const uint8_t *mac, const uint8_t *data, size_t len)
+{
+  if (slot >= RADIO_SLOT_COUNT || len == 0 || len > RADIO_FRAME_MAX) return false;
+  hal_lock(link_lock);
+  bool replaced = slot_pending[slot];
+  if (replaced) stats.coalesced++;
+  OutFrame &frame = slot_frame[slot];
+  memcpy(frame.mac, mac, ESP_NOW_ETH_ALEN);
+  frame.len = (uint8_t)len;
+  memcpy(frame.data, data, len);
+  slot_pending[slot] = true;
+  hal_unlock(link_lock);
+  return replaced;
+}
+
+void radio_link_post_position(const uint8_t *mac, int32_t position)
+{
+  Message msg;
+  msg.messageId = 0;
+  msg.command = CMD_POSITION;
+  msg.param = position;
+  uint8_t axis = axis_from_param(position);
+  if (axis >= AXIS_COUNT) return;
+  radio_link_post_latest((RadioSlot)(RADIO_SLOT_POSITION + axis), mac, (const uint8_t *)&msg, sizeof(msg));
+}
+
+void radio_link_on_sent(esp_now_send_status_t status)
+{
+  if (tx_task_handle) {
+    xTaskNotify(tx_task_handle, status == ESP_NOW_SEND_SUCCESS ? TX_NOTIFY_OK : TX_NOTIFY_FAIL,
+                eSetValueWithOverwrite);
+  }
+}
+
+bool radio_link_is_duplicate(const uint8_t *mac, const Message &msg)
+{
+  // Id 0 is used for unsequenced messages and is never deduplicated
+  if (msg.messageId == 0 || !mac) return false;
+  unsigned long now = millis();
+  for (const SeenCommand &entry : seen) {
+    if (entry.seen_ms != 0 && entry.messageId == msg.messageId && now - entry.seen_ms < DEDUPE_WINDOW_MS &&
+        memcmp(entry.mac, mac, ESP_NOW_ETH_ALEN) == 0) {
+      count(&RadioLinkStats::duplicates);
+      return true;
+    }
+  }
+  SeenCommand &slot = seen[seen_next];
+  seen_next = (seen_next + 1) % DEDUPE_SLOTS;
+  memcpy(slot.mac, mac, ESP_NOW_ETH_ALEN);
+  slot.messageId = msg.messageId;
+  slot.seen_ms = now ? now : 1;
+  return false;
+}
+
+RadioLinkStats radio_link_stats()
+{
+  hal_lock(link_lock);
+  RadioLinkStats snapshot = stats;
+  hal_unlock(link_lock);
+  return snapshot;
+}
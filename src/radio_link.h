@@ -0,0 +1,57 @@
+#pragma once
+#include <stdint.h>
+#include <esp_now.h>
+#include "stepper_commands.h"
+#include "axis.h"
+
+// Asynchronous ESP-NOW link.
+// Outbound: radio_link_send() only queues; a dedicated TX task sends one frame at
+// a time, waits for the send callback and retries ESP_NOW_SEND_FAIL with bounded
+// exponential backoff. Periodic data (unsolicited CMD_POSITION, telemetry) is
+// posted to "latest" slots instead, so only the newest value goes on air.
+// Frames queued for the peer set with radio_link_set_batch_peer() are packed
+// into batch frames (batch_frame.h) when several are waiting at once.
+// Inbound: radio_link_is_duplicate() remembers recent (sender, messageId) pairs
+// so a command re-sent after a lost ACK is ACKed again but not executed twice.
+
+// Largest payload queued by the link (bytes)
+constexpr size_t RADIO_FRAME_MAX = 32;
+
+// Coalescing slots for periodic data; each holds at most one pending frame.
+// Every axis has its own position and telemetry slot (base + axis).
+enum RadioSlot : uint8_t {
+  RADIO_SLOT_POSITION = 0,
+  RADIO_SLOT_TELEMETRY = AXIS_COUNT,
+  RADIO_SLOT_COUNT = 2 * AXIS_COUNT
+};
+
+struct RadioLinkStats {
+  uint32_t sent;             // frames the peer MAC acknowledged
+  uint32_t failed;           // frames given up on after all retries
+  uint32_t retries;
+  uint32_t queue_overflows;  // frames dropped because the TX queue was full
+  uint32_t coalesced;        // slot frames replaced by a newer one
+  uint32_t duplicates;       // inbound commands dropped as duplicates
+  uint32_t batched;          // frames that went out inside a batch frame
+};
+
+// Create the TX task; call after esp_now_init()
+void radio_link_init();
+
+// Peer that understands batch frames (nullptr: none). Set by the handshake.
+void radio_link_set_batch_peer(const uint8_t *mac);
+
+// Queue msg for mac; never blocks. Returns false if the TX queue is full.
+bool radio_link_send(const uint8_t *mac, const Message &msg);
+bool radio_link_send_raw(const uint8_t *mac, const uint8_t *data, size_t len);
+// Replace the frame pending in slot; returns true if an unsent frame was replaced
+bool radio_link_post_latest(RadioSlot slot, const uint8_t *mac, const uint8_t *data, size_t len);
+// Replace any pending unsolicited position update of the same axis (axis.h) with this one
+void radio_link_post_position(const uint8_t *mac, int32_t position);
+
+// Call from the ESP-NOW send callback
+void radio_link_on_sent(esp_now_send_status_t status);
+// Call from the ESP-NOW receive callback; true if msg was seen recently
+bool radio_link_is_duplicate(const uint8_t *mac, const Message &msg);
+
+RadioLinkStats radio_link_stats();
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <string.h>
+#include "sensor_profile.h"
+#include "axis.h"
+#include "deferred_log.h"
+#include "hal.h"
+
+// Hands a diagnostic frame to the radio link
+extern bool send_diagnostic(const uint8_t *frame, size_t len);
+
+constexpr uint8_t PROFILE_NO_OWNER = 0xFF;
+constexpr size_t PROFILE_NO_BIN = SIZE_MAX;
+// Step edges seen by the last supervision passes; must reach back further
+// than the ADC DMA delivers late
+constexpr size_t PROFILE_HISTORY = 64;
+constexpr size_t PROFILE_READ_CHUNK = 64;
+// Keeps a bin's sum of 12-bit samples in uint16_t (10 per bin at the homing pass speed)
+constexpr uint8_t PROFILE_BIN_MAX_SAMPLES = 16;
+constexpr size_t PROFILE_LINE_MAX = 160;
+constexpr size_t PROFILE_BINS_PER_LINE = 10;
+
+struct ProfileBin {
+  uint16_t sum;
+  uint8_t count;
+};
+
+struct StepMark {
+  uint32_t us;
+  uint32_t steps;
+};
+
+static bool enabled = HOME_PROFILE;
+static uint8_t owner = PROFILE_NO_OWNER;
+
+// The current (or last) pass
+static uint8_t bins_axis = PROFILE_NO_OWNER;
+static ProfileBin bins[PROFILE_BINS];
+static size_t last_bin = 0; // highest bin with a sample
+static bool full = false;
+static bool overrun = false; // samples were dropped; nothing is binned after the gap
+static StepMark history[PROFILE_HISTORY];
+static size_t history_count = 0;
+static size_t history_next = 0;
+static uint32_t stream_start_us = 0;
+static uint32_t start_steps = 0;
+static uint32_t samples_taken = 0;
+static uint32_t samples_binned = 0;
+
+// Dip tracker, over complete bins; levels in 1/16 ADC counts
+static size_t bins_scanned = 0;
+static int32_t baseline_sum = 0;
+static int32_t baseline_count = 0;
+static int32_t floor_level = INT32_MAX;
+static bool in_dip = false;
+static size_t recover_bin = PROFILE_NO_BIN;
+
+// The motion task changes the bins only while it owns the stream, or inside
+// profile_begin(); the service task copies them under the lock while no pass runs
+static HalLock pass_lock;
+static uint32_t pass_count = 0; // profile_begin() calls, so a dump notices a new pass
+
+static ProfileReport results[AXIS_COUNT];
+static volatile bool dump_pending = false;
+static uint8_t dump_axis = 0;
+
+bool profile_enabled()
+{
+  return enabled;
+}
+
+void profile_set_enabled(bool on)
+{
+  enabled = on;
+}
+
+// Mean of a bin in 1/16 ADC counts; -1 when empty
+static int32_t bin_level(const ProfileBin &b)
+{
+  return b.count ? (int32_t)b.sum * 16 / b.count : -1;
+}
+
+static int32_t bin_level(size_t bin)
+{
+  return bin_level(bins[bin]);
+}
+
+static int32_t bin_center_q8(size_t bin)
+{
+  return (int32_t)bin * PROFILE_BIN_Q8 + PROFILE_BIN_Q8 / 2;
+}
+
+static const StepMark &mark_back(size_t n)
+{
+  return history[(history_next + PROFILE_HISTORY - 1 - n) % PROFILE_HISTORY];
+}
+
+static void push_mark(uint32_t us, uint32_t steps)
+{
+  if (history_count && mark_back(0).steps == steps) return; // no step since the last pass
+  history[history_next] = StepMark{us, steps};
+  history_next = (history_next + 1) % PROFILE_HISTORY;
+  if (history_count < PROFILE_HISTORY) history_count++;
+}
+
+// Steps since the pass started at time t (1/256 steps), interpolated between
+// the step edges around t. The carriage shows step n from its edge until the
+// next one, so those samples get n .. n+1. After the last edge the step rate
+// so far carries on, short of the next step. False if t is older than the history.
+static bool steps_at(uint32_t t, int32_t &tag_q8)
+{
+  for (size_t n = 0; n < history_count; ++n) {
+    const StepMark &mark = mark_back(n);
+    if ((int32_t)(t - mark.us) < 0) continue;
+    tag_q8 = (int32_t)(mark.steps - start_steps) * 256;
+    if (n == 0 && history_count < 2) return true;
+    const StepMark &before = n ? mark : mark_back(1);
+    const StepMark &after = n ? mark_back(n - 1) : mark;
+    uint32_t span = after.us - before.us;
+    if (span == 0) return true;
+    int32_t fraction_q8 = (int32_t)((uint64_t)(after.steps - before.steps) * 256 * (t - mark.us) / span);
+    tag_q8 += n ? fraction_q8 : (fraction_q8 < 255 ? fraction_q8 : 255);
+    return true;
+  }
+  return false;
+}
+
+static void bin_sample(uint16_t level, int32_t tag_q8)
+{
+  if (tag_q8 < 0) return;
+  size_t bin = (size_t)(tag_q8 / PROFILE_BIN_Q8);
+  if (bin >= PROFILE_BINS) {
+    full = true;
+    return;
+  }
+  ProfileBin &b = bins[bin];
+  if (b.count < PROFILE_BIN_MAX_SAMPLES) {
+    b.sum += level;
+    b.count++;
+  }
+  samples_binned++;
+  if (bin > last_bin) last_bin = bin;
+}
+
+// Follow the level over the bins completed since the last call: baseline
+// first, then down into the dip and back up to where it has recovered
+static void track_dip()
+{
+  for (; bins_scanned < last_bin; ++bins_scanned) {
+    int32_t level = bin_level(bins_scanned);
+    if (level < 0) continue;
+    if (bins_scanned < PROFILE_BASELINE_BINS) {
+      baseline_sum += level;
+      baseline_count++;
+      continue;
+    }
+    if (baseline_count == 0) continue;
+    int32_t baseline = baseline_sum / baseline_count;
+    if (level < floor_level) floor_level = level;
+    if (baseline - level >= PROFILE_MIN_DEPTH * 16) in_dip = true;
+    if (!in_dip) continue;
+    if (level < baseline - (baseline - floor_level) / 4) recover_bin = PROFILE_NO_BIN;
+    else if (recover_bin == PROFILE_NO_BIN) recover_bin = bins_scanned;
+  }
+}
+
+bool profile_begin(uint8_t axis, int pin, uint32_t step_count)
+{
+  if (owner != PROFILE_NO_OWNER) return false;
+  uint32_t start_us;
+  if (!hal_adc_stream_start(pin, PROFILE_SAMPLE_RATE_HZ, start_us)) {
+    LOG_WARN("[PROFILE] no ADC stream on pin %d", pin);
+    return false;
+  }
+  hal_lock(pass_lock);
+  owner = axis;
+  bins_axis = axis;
+  pass_count++;
+  memset(bins, 0, sizeof(bins));
+  last_bin = 0;
+  hal_unlock(pass_lock);
+  full = false;
+  overrun = false;
+  history_count = 0;
+  history_next = 0;
+  push_mark(start_us, step_count);
+  stream_start_us = start_us;
+  start_steps = step_count;
+  samples_taken = 0;
+  samples_binned = 0;
+  bins_scanned = 0;
+  baseline_sum = 0;
+  baseline_count = 0;
+  floor_level = INT32_MAX;
+  in_dip = false;
+  recover_bin = PROFILE_NO_BIN;
+  return true;
+}
+
+ProfileProgress profile_update(uint32_t step_count, uint32_t step_us)
+{
+  push_mark(step_us, step_count);
+  uint16_t levels[PROFILE_READ_CHUNK];
+  size_t count;
+  // Sample times are counted from the stream start, so after a gap every
+  // sample would land on the wrong step
+  while (!overrun && (count = hal_adc_stream_read(levels, PROFILE_READ_CHUNK, overrun)) > 0 && !overrun) {
+    for (size_t i = 0; i < count; ++i) {
+      samples_taken++;
+      uint32_t taken_us =
+          stream_start_us + (uint32_t)((uint64_t)samples_taken * 1000000U / PROFILE_SAMPLE_RATE_HZ);
+      int32_t tag_q8;
+      if (steps_at(taken_us, tag_q8)) bin_sample(levels[i], tag_q8);
+    }
+  }
+  track_dip();
+  // Checked first: the ramp down after the dip may overrun or run past the last bin
+  if (in_dip && recover_bin != PROFILE_NO_BIN && last_bin >= recover_bin + PROFILE_TAIL_BINS) return PROFILE_PASSED;
+  if (overrun) return PROFILE_OVERRUN;
+  if (full) return PROFILE_FULL;
+  return PROFILE_SCANNING;
+}
+
+// Where the level crosses half from the lowest bin outwards (dir -1: before
+// the dip, +1: after it), interpolated between the bins either side
+static bool half_crossing(size_t lowest, int dir, int32_t half, int32_t &x_q8)
+{
+  size_t inner = lowest;
+  int32_t inner_level = bin_level(lowest);
+  for (long i = (long)lowest + dir; i >= 0 && i < (long)last_bin; i += dir) {
+    int32_t level = bin_level((size_t)i);
+    if (level < 0) continue;
+    if (level >= half) {
+      int32_t x_inner = bin_center_q8(inner);
+      int32_t x_outer = bin_center_q8((size_t)i);
+      x_q8 = x_inner + (int32_t)((int64_t)(x_outer - x_inner) * (half - inner_level) / (level - inner_level));
+      return true;
+    }
+    inner = (size_t)i;
+    inner_level = level;
+  }
+  return false;
+}
+
+bool profile_fit(ProfileFit &fit)
+{
+  if (!in_dip || baseline_count == 0) return false;
+  int32_t baseline = baseline_sum / baseline_count;
+  size_t lowest = PROFILE_NO_BIN;
+  int32_t lowest_level = INT32_MAX;
+  for (size_t i = PROFILE_BASELINE_BINS; i < last_bin; ++i) {
+    int32_t level = bin_level(i);
+    if (level >= 0 && level < lowest_level) {
+      lowest = i;
+      lowest_level = level;
+    }
+  }
+  if (lowest == PROFILE_NO_BIN || baseline - lowest_level < PROFILE_MIN_DEPTH * 16) return false;
+  int32_t half = (baseline + lowest_level) / 2;
+  int32_t falling_q8;
+  int32_t rising_q8;
+  if (!half_crossing(lowest, -1, half, falling_q8) || !half_crossing(lowest, 1, half, rising_q8)) return false;
+  // Samples taken while the carriage rests after step n are tagged n..n+1,
+  // so they sit half a step after the position they show
+  fit.center_q8 = (falling_q8 + rising_q8) / 2 - 128;
+  fit.width_q8 = rising_q8 - falling_q8;
+  fit.baseline = (uint16_t)(baseline / 16);
+  fit.floor = (uint16_t)(lowest_level / 16);
+  fit.samples = samples_binned;
+  return true;
+}
+
+void profile_end(uint8_t axis)
+{
+  if (owner != axis) return;
+  hal_adc_stream_stop();
+  hal_lock(pass_lock);
+  owner = PROFILE_NO_OWNER;
+  hal_unlock(pass_lock);
+}
+
+static int16_t clamp_q8(int32_t value)
+{
+  return (int16_t)(value < INT16_MIN + 1 ? INT16_MIN + 1 : value > INT16_MAX ? INT16_MAX : value);
+}
+
+void profile_record(uint8_t axis, const ProfileFit &fit, int32_t residual_q8, int32_t edge_q8)
+{
+  hal_lock(pass_lock);
+  ProfileReport &result = results[axis];
+  result.valid = 1;
+  result.baseline = fit.baseline;
+  result.floor = fit.floor;
+  result.width_q8 = (uint16_t)(fit.width_q8 < 0 ? 0 : fit.width_q8 > UINT16_MAX ? UINT16_MAX : fit.width_q8);
+  result.residual_q8 = clamp_q8(residual_q8);
+  result.edge_q8 = edge_q8 == PROFILE_NO_EDGE ? PROFILE_NO_EDGE : clamp_q8(edge_q8);
+  result.samples = fit.samples;
+  hal_unlock(pass_lock);
+}
+
+ProfileReport profile_result(uint8_t axis)
+{
+  hal_lock(pass_lock);
+  ProfileReport result = results[axis];
+  hal_unlock(pass_lock);
+  result.kind = PROFILE_REPORT_KIND;
+  result.axis = axis;
+  return result;
+}
+
+void profile_report(uint8_t axis, uint8_t messageId)
+{
+  ProfileReport frame = profile_result(axis);
+  frame.messageId = messageId;
+  send_diagnostic((const uint8_t *)&frame, sizeof(frame));
+  // A request arriving while the previous dump is still printing only gets the frame
+  if (!dump_pending) {
+    dump_axis = axis;
+    dump_pending = true;
+  }
+}
+
+void profile_dump_pending()
+{
+  if (!dump_pending) return;
+  char line[PROFILE_LINE_MAX];
+  ProfileReport result = profile_result(dump_axis);
+  int n = snprintf(line, sizeof(line),
+                   "profile axis %u: valid=%u baseline=%u floor=%u width=%ld/256 residual=%d/256 edge=%d/256\n",
+                   (unsigned)dump_axis, (unsigned)result.valid, (unsigned)result.baseline, (unsigned)result.floor,
+                   (long)result.width_q8, (int)result.residual_q8, (int)result.edge_q8);
+  hal_console_write((const uint8_t *)line, (size_t)n);
+  // Bins of the last pass, if it was this axis': steps since the pass started, mean ADC counts.
+  // Each line is copied under the lock; a pass that starts meanwhile ends the dump.
+  hal_lock(pass_lock);
+  bool idle = owner == PROFILE_NO_OWNER && bins_axis == dump_axis;
+  uint32_t pass = pass_count;
+  size_t last = last_bin;
+  hal_unlock(pass_lock);
+  if (result.valid && idle) {
+    for (size_t first = 0; first <= last; first += PROFILE_BINS_PER_LINE) {
+      ProfileBin copy[PROFILE_BINS_PER_LINE];
+      size_t count = last + 1 - first < PROFILE_BINS_PER_LINE ? last + 1 - first : PROFILE_BINS_PER_LINE;
+      hal_lock(pass_lock);
+      bool same_pass = owner == PROFILE_NO_OWNER && pass_count == pass;
+      if (same_pass) memcpy(copy, bins + first, count * sizeof(ProfileBin));
+      hal_unlock(pass_lock);
+      if (!same_pass) {
+        n = snprintf(line, sizeof(line), "profile bins replaced by a new pass\n");
+        hal_console_write((const uint8_t *)line, (size_t)n);
+        break;
+      }
+      size_t len = (size_t)snprintf(line, sizeof(line), "profile %5.1f:", first * PROFILE_BIN_Q8 / 256.0);
+      for (size_t i = 0; i < count; ++i) {
+        int32_t level = bin_level(copy[i]);
+        n = snprintf(line + len, sizeof(line) - len, " %4ld", (long)(level < 0 ? -1 : level / 16));
+        if (n < 0 || len + (size_t)n >= sizeof(line) - 1) break;
+        len += (size_t)n;
+      }
+      line[len++] = '\n';
+      hal_console_write((const uint8_t *)line, len);
+    }
+  }
+  dump_pending = false;
+}
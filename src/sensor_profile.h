@@ -0,0 +1,90 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "stepper_commands.h"
+
+// Reflectance profile of the TCRT5000 for homing.
+// The D0 edge that edge homing latches on sits wherever the module's comparator
+// threshold cuts the reflectance curve, and that threshold drifts with
+// temperature and ambient light. With profiled homing (-DHOME_PROFILE=1), the
+// slow pass instead samples the analog output (A0, AxisConfig::analog_pin)
+// with the ADC in DMA mode at PROFILE_SAMPLE_RATE_HZ while it crosses the whole
+// mark. Each sample is tagged with the step count at the time it was taken,
+// interpolated between step edges, and binned by half steps. Home is
+// the centre of the dip, taken as the midpoint of its two half-depth crossings
+// and found to a fraction of a step. That centre does not move with the
+// threshold. The fit also yields the baseline, floor and width of the dip,
+// which CMD_SENSOR_PROFILE reports so sensor ageing can be tracked.
+//
+// One ADC stream serves all axes: an axis that homes while another axis holds
+// it falls back to the D0 edge. Motion task only, except the console dump.
+
+#ifndef HOME_PROFILE
+#define HOME_PROFILE 0
+#endif
+
+constexpr uint32_t PROFILE_SAMPLE_RATE_HZ = 20000; // ESP32 ADC DMA minimum
+constexpr int32_t PROFILE_BIN_Q8 = 128;            // bin width in 1/256 steps
+constexpr size_t PROFILE_BINS = 512;               // 256 steps of travel
+constexpr size_t PROFILE_BASELINE_BINS = 32;       // first 16 steps, clear of the mark
+constexpr int32_t PROFILE_MIN_DEPTH = 300;         // ADC counts below the baseline that make a dip
+constexpr size_t PROFILE_TAIL_BINS = 16;           // baseline recorded past the dip before stopping
+
+enum ProfileProgress : uint8_t {
+  PROFILE_SCANNING, // the dip is not behind the sensor yet
+  PROFILE_PASSED,   // dip and some baseline after it are recorded
+  PROFILE_FULL,     // PROFILE_BINS used up without passing a dip
+  PROFILE_OVERRUN   // the ADC dropped samples before the dip was passed; later ones cannot be placed
+};
+
+struct ProfileFit {
+  int32_t center_q8; // dip centre in steps since the pass started, 1/256 steps
+  int32_t width_q8;  // between the half-depth crossings
+  uint16_t baseline; // ADC counts off the mark
+  uint16_t floor;    // ADC counts at the bottom of the dip
+  uint32_t samples;
+};
+
+// Diagnostic frame answering CMD_SENSOR_PROFILE. Byte 1 holds a kind outside
+// the command range, like the telemetry frames.
+constexpr uint8_t PROFILE_REPORT_KIND = 0xF9;
+constexpr int16_t PROFILE_NO_EDGE = INT16_MIN;
+
+struct __attribute__((packed)) ProfileReport {
+  uint8_t messageId; // id of the CMD_SENSOR_PROFILE request
+  uint8_t kind;      // PROFILE_REPORT_KIND
+  uint8_t axis;
+  uint8_t valid;     // 0 until the axis has homed with a profile
+  uint16_t baseline;
+  uint16_t floor;
+  uint16_t width_q8;
+  int16_t residual_q8; // dip centre minus the home step, 1/256 steps
+  int16_t edge_q8;     // D0 edge minus dip centre (PROFILE_NO_EDGE: no edge seen)
+  uint32_t samples;
+};
+
+static_assert(sizeof(ProfileReport) != sizeof(Message), "the report must be distinguishable from Message by length");
+
+// Runtime switch, HOME_PROFILE by default
+bool profile_enabled();
+void profile_set_enabled(bool enabled);
+
+// Claim the ADC stream for axis' pass over the mark, starting at step_count.
+// False if another axis holds it or the pin has no ADC1 channel.
+bool profile_begin(uint8_t axis, int pin, uint32_t step_count);
+// Every supervision pass of the profile pass, with step_engine_last_step()
+ProfileProgress profile_update(uint32_t step_count, uint32_t step_us);
+// Fit the dip of the pass; false if there is none
+bool profile_fit(ProfileFit &fit);
+// Release the ADC stream if axis holds it
+void profile_end(uint8_t axis);
+
+// Keep the result of axis' profiled homing for CMD_SENSOR_PROFILE
+void profile_record(uint8_t axis, const ProfileFit &fit, int32_t residual_q8, int32_t edge_q8);
+// Answer CMD_SENSOR_PROFILE: one ProfileReport through send_diagnostic(), and
+// the binned profile of the last pass on the console (profile_dump_pending())
+void profile_report(uint8_t axis, uint8_t messageId);
+ProfileReport profile_result(uint8_t axis);
+// Service task: print the profile requested by profile_report(). The bins are
+// copied a line at a time under a lock; a pass that starts meanwhile ends the dump.
+void profile_dump_pending();
@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "hal.h"
+#include "axis.h"
+#include "sim.h"
+
+static uint64_t now_us = 0;
+static int mark_lo = 0;
+static int mark_hi = 0;
+static int sensor_drift = 0;
+static uint16_t reflectance_depth = 2200;
+static bool restart_requested = false;
+static uint32_t cpu_mhz = 240;
+static void (*falling_isr[AXIS_COUNT])() = {};
+static int last_sensor_level[AXIS_COUNT];
+static std::vector<SimFrame> radio_frames;
+static std::string *console_capture = nullptr;
+static void (*console_hook)() = nullptr;
+static std::string nvs_namespace;
+static std::map<std::string, std::vector<uint8_t>> nvs;
+static uint32_t nvs_writes = 0;
+
+uint64_t sim_now_us()
+{
+  return now_us;
+}
+
+// ADC stream: samples are taken on the simulated clock, between steps as on target
+static bool adc_running = false;
+static uint8_t adc_axis = 0;
+static uint32_t adc_rate_hz = 0;
+static uint64_t adc_start_us = 0;
+static uint64_t adc_taken = 0;
+static uint32_t adc_noise = 1;
+static std::vector<uint16_t> adc_samples;
+static bool adc_overrun = false;
+
+static uint64_t adc_next_us()
+{
+  return adc_start_us + (adc_taken + 1) * 1000000 / adc_rate_hz;
+}
+
+// TCRT5000 A0: the spot (SIM_SPOT_RADIUS steps) averages over the part of the
+// mark it covers, plus a little noise
+constexpr double SIM_SPOT_RADIUS = 4.0;
+constexpr int SIM_REFLECTANCE_BASELINE = 3000;
+constexpr int SIM_REFLECTANCE_NOISE = 40;
+
+static uint16_t sim_reflectance(uint8_t axis)
+{
+  double x = sim_mechanical_position(axis);
+  double covered = std::min(x + SIM_SPOT_RADIUS, mark_hi + 0.5) - std::max(x - SIM_SPOT_RADIUS, mark_lo - 0.5);
+  double fraction = std::max(0.0, covered) / (2 * SIM_SPOT_RADIUS);
+  adc_noise = adc_noise * 1103515245U + 12345U;
+  int noise = (int)((adc_noise >> 16) % (2 * SIM_REFLECTANCE_NOISE + 1)) - SIM_REFLECTANCE_NOISE;
+  int level = SIM_REFLECTANCE_BASELINE - (int)(reflectance_depth * fraction) + noise;
+  return (uint16_t)std::min(4095, std::max(0, level));
+}
+
+void sim_advance_us(uint64_t us)
+{
+  uint64_t target = now_us + us;
+  while (adc_running && adc_next_us() <= target) {
+    now_us = adc_next_us();
+    sim_step_engine_advance(now_us);
+    adc_samples.push_back(sim_reflectance(adc_axis));
+    adc_taken++;
+  }
+  now_us = target;
+  sim_step_engine_advance(now_us);
+}
+
+void sim_set_home_mark(int lo, int hi)
+{
+  mark_lo = lo;
+  mark_hi = hi;
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) sim_sensor_sync(axis);
+}
+
+void sim_set_sensor_drift(int steps)
+{
+  sensor_drift = steps;
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) sim_sensor_sync(axis);
+}
+
+void sim_set_reflectance(uint16_t depth)
+{
+  reflectance_depth = depth;
+}
+
+void sim_adc_overrun()
+{
+  if (!adc_running) return;
+  adc_samples.clear();
+  adc_overrun = true;
+}
+
+std::vector<SimFrame> &sim_radio_frames()
+{
+  return radio_frames;
+}
+
+bool sim_restart_requested()
+{
+  return restart_requested;
+}
+
+void sim_clear_restart()
+{
+  restart_requested = false;
+}
+
+uint32_t hal_cycle_count()
+{
+  static const auto start = std::chrono::steady_clock::now();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+void hal_pin_input(int)
+{
+}
+
+// Axis whose TCRT5000 is wired to pin, or AXIS_COUNT
+static uint8_t sensor_axis(int pin)
+{
+  uint8_t axis = 0;
+  while (axis < AXIS_COUNT && AXIS_CONFIGS[axis].sensor_pin != pin) axis++;
+  return axis;
+}
+
+void hal_attach_falling(int pin, void (*isr)())
+{
+  uint8_t axis = sensor_axis(pin);
+  if (axis < AXIS_COUNT) falling_isr[axis] = isr;
+}
+
+void sim_sensor_update(uint8_t axis)
+{
+  int level = hal_digital_read(AXIS_CONFIGS[axis].sensor_pin);
+  if (last_sensor_level[axis] && !level && falling_isr[axis]) falling_isr[axis]();
+  last_sensor_level[axis] = level;
+}
+
+void sim_sensor_sync(uint8_t axis)
+{
+  last_sensor_level[axis] = hal_digital_read(AXIS_CONFIGS[axis].sensor_pin);
+}
+
+int hal_digital_read(int pin)
+{
+  uint8_t axis = sensor_axis(pin);
+  if (axis == AXIS_COUNT) return 1;
+  int pos = sim_mechanical_position(axis);
+  return (pos >= mark_lo - sensor_drift && pos <= mark_hi + sensor_drift) ? 0 : 1; // LOW = white mark
+}
+
+bool hal_adc_stream_start(int pin, uint32_t rate_hz, uint32_t &start_us)
+{
+  uint8_t axis = 0;
+  while (axis < AXIS_COUNT && AXIS_CONFIGS[axis].analog_pin != pin) axis++;
+  if (adc_running || axis == AXIS_COUNT || rate_hz == 0) return false;
+  adc_running = true;
+  adc_axis = axis;
+  adc_rate_hz = rate_hz;
+  adc_start_us = now_us;
+  adc_taken = 0;
+  adc_samples.clear();
+  adc_overrun = false;
+  start_us = (uint32_t)now_us;
+  return true;
+}
+
+size_t hal_adc_stream_read(uint16_t *levels, size_t max, bool &overrun)
+{
+  overrun = adc_overrun;
+  adc_overrun = false;
+  size_t count = std::min(max, adc_samples.size());
+  std::copy(adc_samples.begin(), adc_samples.begin() + count, levels);
+  adc_samples.erase(adc_samples.begin(), adc_samples.begin() + count);
+  return count;
+}
+
+void hal_adc_stream_stop()
+{
+  adc_running = false;
+  adc_samples.clear();
+}
+
+unsigned long hal_millis()
+{
+  return (unsigned long)(now_us / 1000);
+}
+
+unsigned long hal_micros()
+{
+  return (unsigned long)now_us;
+}
+
+void hal_delay_ms(unsigned long ms)
+{
+  sim_advance_us((uint64_t)ms * 1000);
+}
+
+void hal_restart()
+{
+  restart_requested = true;
+}
+
+bool hal_set_cpu_mhz(uint32_t mhz)
+{
+  cpu_mhz = mhz;
+  return true;
+}
+
+uint32_t hal_cpu_mhz()
+{
+  return cpu_mhz;
+}
+
+void hal_console_write(const uint8_t *data, size_t len)
+{
+  if (console_capture) console_capture->append((const char *)data, len);
+  else fwrite(data, 1, len, stdout);
+  if (console_hook) console_hook();
+}
+
+void sim_console_capture(std::string *text)
+{
+  console_capture = text;
+}
+
+void sim_console_hook(void (*hook)())
+{
+  console_hook = hook;
+}
+
+bool hal_radio_send(const uint8_t *, const uint8_t *data, size_t len)
+{
+  SimFrame frame = {};
+  if (len > sizeof(frame.data)) return false;
+  frame.time_us = now_us;
+  frame.len = len;
+  memcpy(frame.data, data, len);
+  radio_frames.push_back(frame);
+  return true;
+}
+
+static uint32_t retained_ram[HAL_RETAINED_SIZE / sizeof(uint32_t)];
+
+void *hal_retained_ram()
+{
+  return retained_ram;
+}
+
+void sim_power_cycle()
+{
+  for (uint32_t &word : retained_ram) word = (uint32_t)rand() * 2654435761U;
+}
+
+// NOR flash model: erase sets 0xFF, writes AND bits in
+static std::vector<uint8_t> journal_flash(SIM_JOURNAL_SIZE, 0xFF);
+static uint32_t journal_erases = 0;
+static size_t journal_tear_bytes = SIZE_MAX; // next write stops after this many bytes
+
+size_t hal_journal_size()
+{
+  return journal_flash.size();
+}
+
+bool hal_journal_read(size_t offset, void *data, size_t len)
+{
+  if (offset + len > journal_flash.size()) return false;
+  memcpy(data, journal_flash.data() + offset, len);
+  return true;
+}
+
+bool hal_journal_write(size_t offset, const void *data, size_t len)
+{
+  if (offset + len > journal_flash.size()) return false;
+  const uint8_t *bytes = (const uint8_t *)data;
+  size_t programmed = std::min(len, journal_tear_bytes);
+  journal_tear_bytes = SIZE_MAX;
+  for (size_t i = 0; i < programmed; ++i) journal_flash[offset + i] &= bytes[i];
+  return true;
+}
+
+bool hal_journal_erase_sector(size_t offset)
+{
+  if (offset % HAL_JOURNAL_SECTOR || offset + HAL_JOURNAL_SECTOR > journal_flash.size()) return false;
+  memset(journal_flash.data() + offset, 0xFF, HAL_JOURNAL_SECTOR);
+  journal_erases++;
+  return true;
+}
+
+uint32_t sim_journal_erases()
+{
+  return journal_erases;
+}
+
+void sim_journal_tear_next_write(size_t bytes)
+{
+  journal_tear_bytes = bytes;
+}
+
+void hal_nvs_begin(const char *name_space)
+{
+  nvs_namespace = name_space;
+}
+
+static std::string nvs_key(const char *key)
+{
+  return nvs_namespace + "/" + key;
+}
+
+long hal_nvs_get_long(const char *key, long default_value)
+{
+  auto it = nvs.find(nvs_key(key));
+  if (it == nvs.end() || it->second.size() != sizeof(long)) return default_value;
+  long value;
+  memcpy(&value, it->second.data(), sizeof(value));
+  return value;
+}
+
+void hal_nvs_put_long(const char *key, long value)
+{
+  const uint8_t *bytes = (const uint8_t *)&value;
+  nvs[nvs_key(key)] = std::vector<uint8_t>(bytes, bytes + sizeof(value));
+  nvs_writes++;
+}
+
+size_t hal_nvs_get_blob(const char *key, void *data, size_t len)
+{
+  auto it = nvs.find(nvs_key(key));
+  if (it == nvs.end() || it->second.size() != len) return 0;
+  memcpy(data, it->second.data(), len);
+  return len;
+}
+
+size_t hal_nvs_blob_length(const char *key)
+{
+  auto it = nvs.find(nvs_key(key));
+  return it == nvs.end() ? 0 : it->second.size();
+}
+
+bool hal_nvs_put_blob(const char *key, const void *data, size_t len)
+{
+  const uint8_t *bytes = (const uint8_t *)data;
+  nvs[nvs_key(key)] = std::vector<uint8_t>(bytes, bytes + len);
+  nvs_writes++;
+  return true;
+}
+
+uint32_t sim_nvs_writes()
+{
+  return nvs_writes;
+}
+
+void sim_nvs_corrupt(const char *key, size_t offset)
+{
+  auto it = nvs.find(nvs_key(key));
+  if (it != nvs.end() && offset < it->second.size()) it->second[offset] ^= 0xFF;
+}
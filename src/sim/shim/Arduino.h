@@ -0,0 +1,25 @@
+#pragma once
+// Minimal Arduino surface for the native (host) build: just enough for the shared
+// MagLoop headers and the portable modules to compile. Hardware access goes
+// through hal.h, which src/sim/hal_sim.cpp implements.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+using std::max;
+using std::min;
+
+#ifndef constrain
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#endif
@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Controls for the native simulation (hal_sim.cpp, step_engine_sim.cpp).
+// Time only moves when the simulation advances it, so a run is deterministic and
+// far faster than real time.
+
+struct SimFrame {
+  uint64_t time_us;
+  size_t len;
+  uint8_t data[32];
+};
+
+// Simulated clock. Advancing it also runs the step engine up to the new time.
+uint64_t sim_now_us();
+void sim_advance_us(uint64_t us);
+
+// Emit every step edge due at or before now_us (step_engine_sim.cpp)
+void sim_step_engine_advance(uint64_t now_us);
+
+// Mechanical carriage position in steps: what the TCRT5000 sees. It differs from
+// step_engine_position() by the offset that homing has to remove.
+int sim_mechanical_position(uint8_t axis = 0);
+// Moves the carriage without steps (and without a sensor interrupt)
+void sim_set_mechanical_position(int pos, uint8_t axis = 0);
+
+// Mechanical steps [lo, hi] where the TCRT5000 reads the white mark (LOW), on every axis
+void sim_set_home_mark(int lo, int hi);
+// D0 threshold drift: the band where D0 reads LOW grows by steps on either side
+// of the mark (negative: shrinks). A0 does not change.
+void sim_set_sensor_drift(int steps);
+// How far A0 drops over the mark, in ADC counts (0: a faded mark)
+void sim_set_reflectance(uint16_t depth);
+// Drop the ADC samples not read yet, as the driver does when its buffer overflows
+void sim_adc_overrun();
+// Called after every simulated step: runs the sensor interrupt on a falling edge
+void sim_sensor_update(uint8_t axis);
+// Take the current sensor level as the reference without an interrupt
+void sim_sensor_sync(uint8_t axis = 0);
+
+// Frames handed to hal_radio_send(), oldest first
+std::vector<SimFrame> &sim_radio_frames();
+
+// Collect hal_console_write() output in text instead of printing it; nullptr prints again
+void sim_console_capture(std::string *text);
+// Called after each hal_console_write(), where other tasks run while Serial prints; nullptr for none
+void sim_console_hook(void (*hook)());
+
+// Number of hal_nvs_put_* calls so far
+uint32_t sim_nvs_writes();
+// Overwrite one byte of a stored value (flash corruption)
+void sim_nvs_corrupt(const char *key, size_t offset);
+
+// Power loss: hal_retained_ram() comes back as garbage (a soft reset keeps it)
+void sim_power_cycle();
+
+// Journal flash: 4 sectors so the simulation wraps it quickly
+constexpr size_t SIM_JOURNAL_SIZE = 4 * 4096;
+uint32_t sim_journal_erases();
+// Power fails part way through the next journal write: only the first bytes land
+void sim_journal_tear_next_write(size_t bytes);
+
+// Set by hal_restart(); the caller decides what a reboot means for the scenario
+bool sim_restart_requested();
+void sim_clear_restart();
@@ -0,0 +1,2007 @@
+// Native simulation of the stepper FSM (pio run -e native).
+// Drives fsm_handle_command()/fsm_handle() exactly like the motion task does, one
+// 1 ms supervision tick at a time, against the simulated clock, stepper and
+// TCRT5000 in hal_sim.cpp / step_engine_sim.cpp. Each scenario checks invariants
+// and the process exits non-zero on the first run that breaks one, so it can gate CI.
+//
+//   .pio/build/native/program [seed] [moves]
+//   .pio/build/native/program bench      timing histograms per benchmark scenario
+//   .pio/build/native/program replay <capture>   replay a CMD_TRACE capture (command_trace.h)
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include "stepper_commands.h"
+#include "stepper_config.h"
+#include "fsm.h"
+#include "command_queue.h"
+#include "deferred_log.h"
+#include "step_engine.h"
+#include "motion_planner.h"
+#include "telemetry.h"
+#include "perf_stats.h"
+#include "controller_commands.h"
+#include "config_store.h"
+#include "position_journal.h"
+#include "trajectory.h"
+#include "batch_frame.h"
+#include "latency_probe.h"
+#include "sensor_profile.h"
+#include "tuning_table.h"
+#include "command_trace.h"
+#include "power_policy.h"
+#include "hal.h"
+#include "sim.h"
+
+// Globals main.cpp provides on target
+PulseDelays pulse_delays[AXIS_COUNT];
+
+constexpr uint8_t SIM_GUI_MAC[6] = {0};
+constexpr uint64_t SIM_TICK_US = 1000; // MOTION_SUPERVISE_TICKS on target
+constexpr int SIM_MARK_LO = 0;
+constexpr int SIM_MARK_HI = 19; // white mark about 20 steps wide
+constexpr int SIM_HOME_RUNS = 200;
+constexpr uint64_t SIM_HOME_TIME_LIMIT_US = 2000000; // two ranges above the mark
+constexpr int SIM_JOG_RUNS = 1000;
+constexpr int SIM_MAX_FAILURES_SHOWN = 20;
+// Moves may take this much longer than the ideal trapezoid (ramp quantization,
+// 1 ms supervision)
+constexpr double SIM_MOVE_TIME_SLACK = 1.25;
+constexpr uint64_t SIM_MOVE_TIME_MARGIN_US = 20000;
+
+static StepperContext axes[AXIS_COUNT];
+static StepperContext &ctx = axes[0]; // most scenarios drive axis 0
+static PulseDelays &speeds = pulse_delays[0];
+static std::mt19937 rng;
+static uint8_t next_message_id = 1;
+static int failures = 0;
+static uint64_t ticks = 0;
+static uint64_t moves = 0;
+
+// GUI-side view rebuilt from the frames the controller sent, per axis
+static bool gui_have_position[AXIS_COUNT] = {};
+static int gui_position[AXIS_COUNT] = {};
+static size_t frames_seen = 0;
+
+void send_message(CommandType cmd, int32_t param, uint8_t messageId)
+{
+  uint32_t perf_start = perf_begin();
+  Message msg;
+  msg.messageId = messageId;
+  msg.command = cmd;
+  msg.param = param;
+  hal_radio_send(SIM_GUI_MAC, (const uint8_t *)&msg, sizeof(msg));
+  perf_end(PERF_SEND, perf_start);
+}
+
+bool send_telemetry(uint8_t, const uint8_t *frame, size_t len)
+{
+  hal_radio_send(SIM_GUI_MAC, frame, len);
+  return false; // no coalescing slot in the simulation, nothing is ever replaced
+}
+
+bool send_diagnostic(const uint8_t *frame, size_t len)
+{
+  return hal_radio_send(SIM_GUI_MAC, frame, len);
+}
+
+static void fail(const char *scenario, const char *fmt, ...)
+{
+  if (++failures > SIM_MAX_FAILURES_SHOWN) return;
+  va_list args;
+  va_start(args, fmt);
+  printf("FAIL [%s] t=%llums: ", scenario, (unsigned long long)(sim_now_us() / 1000));
+  vprintf(fmt, args);
+  printf("\n");
+  va_end(args);
+}
+
+static int random_int(int lo, int hi)
+{
+  return std::uniform_int_distribution<int>(lo, hi)(rng);
+}
+
+static uint8_t send_command(CommandType cmd, int32_t param = STEPPER_PARAM_UNUSED)
+{
+  Message msg;
+  msg.messageId = next_message_id++;
+  if (next_message_id == 0) next_message_id = 1; // id 0 is reserved for unsolicited messages
+  msg.command = cmd;
+  msg.param = param;
+  command_queue_push(msg);
+  return msg.messageId;
+}
+
+// Telemetry frames must reconstruct the position the FSM reported at send time
+static void check_frames(const char *scenario)
+{
+  std::vector<SimFrame> &frames = sim_radio_frames();
+  for (; frames_seen < frames.size(); ++frames_seen) {
+    const SimFrame &f = frames[frames_seen];
+    bool full_frame = f.len == sizeof(TelemetryFull) && f.data[1] == TELEMETRY_KIND_FULL;
+    bool delta_frame = f.len == sizeof(TelemetryDelta) && f.data[1] == TELEMETRY_KIND_DELTA;
+    if (!full_frame && !delta_frame) continue;
+    uint8_t axis = f.data[2] >> TELEMETRY_FLAG_AXIS_SHIFT; // flags
+    if (axis >= AXIS_COUNT) {
+      fail(scenario, "telemetry for axis %u", axis);
+      continue;
+    }
+    if (full_frame) {
+      TelemetryFull full;
+      memcpy(&full, f.data, sizeof(full));
+      gui_position[axis] = full.position;
+      gui_have_position[axis] = true;
+    } else {
+      TelemetryDelta delta;
+      memcpy(&delta, f.data, sizeof(delta));
+      if (!gui_have_position[axis]) fail(scenario, "delta frame before any full frame");
+      gui_position[axis] += delta.position_delta;
+    }
+    if (gui_position[axis] != axes[axis].position) {
+      fail(scenario, "axis %u telemetry position %d, controller at %d", axis, gui_position[axis], axes[axis].position);
+      gui_position[axis] = axes[axis].position;
+    }
+  }
+}
+
+// Transitions seen so far: bit t of seen_transitions[s] for s -> t
+static uint16_t seen_transitions[STATE_COUNT];
+// While replaying a trace: the state changes the replay makes, as trace records
+static std::vector<TraceRecord> *replay_log = nullptr;
+
+static void note_transition(const char *scenario, StepperState from, const StepperContext &axis)
+{
+  StepperState to = axis.state;
+  if (from == to) return;
+  if (!fsm_transition_legal(from, to)) fail(scenario, "illegal transition %d -> %d", from, to);
+  seen_transitions[from] |= fsm_state_bit(to);
+  if (replay_log) {
+    replay_log->push_back(TraceRecord{(uint32_t)sim_now_us(), TRACE_STATE, axis.axis, (uint8_t)from, (uint8_t)to,
+                                      axis.position});
+  }
+}
+
+static bool acked(uint8_t id)
+{
+  for (const SimFrame &f : sim_radio_frames()) {
+    if (f.len != sizeof(Message)) continue;
+    Message msg;
+    memcpy(&msg, f.data, sizeof(msg));
+    if (msg.command == CMD_ACK && msg.messageId == id) return true;
+  }
+  return false;
+}
+
+// One motion task iteration
+static void tick(const char *scenario)
+{
+  sim_advance_us(SIM_TICK_US);
+  Message msg;
+  bool cancelled;
+  while (command_queue_pop(msg, cancelled)) {
+    power_command((uint32_t)hal_micros());
+    StepperContext *target = fsm_route(axes, msg);
+    if (!target) continue;
+    if (cancelled) {
+      fsm_cancel_waypoint(target, msg);
+      continue;
+    }
+    StepperState before = target->state;
+    fsm_handle_command(target, msg);
+    note_transition(scenario, before, *target);
+  }
+  if (sim_restart_requested()) return; // hal_restart() does not return on target
+  for (StepperContext &axis : axes) {
+    StepperState before = axis.state;
+    fsm_handle(&axis);
+    note_transition(scenario, before, axis);
+    telemetry_update(&axis, hal_digital_read(AXIS_CONFIGS[axis.axis].sensor_pin) == 0, hal_millis());
+    power_update(&axis, hal_millis());
+  }
+  // Service task work
+  config_service(hal_millis());
+  tuning_service();
+  journal_service();
+  if (config_restart_due()) {
+    hal_delay_ms(100);
+    config_flush();
+    tuning_service();
+    hal_restart();
+  }
+  log_drain(LOG_RING_SIZE);
+  trace_dump_pending();
+  ticks++;
+
+  for (const StepperContext &axis : axes) {
+    if (axis.position < AXIS_CONFIGS[axis.axis].min_pos || axis.position > AXIS_CONFIGS[axis.axis].max_pos) {
+      fail(scenario, "axis %u position %d outside soft limits", axis.axis, axis.position);
+    }
+    if (axis.state == STATE_IDLE && step_engine_running(axis.axis)) {
+      fail(scenario, "axis %u engine running while IDLE", axis.axis);
+    }
+  }
+  check_frames(scenario);
+}
+
+static bool run_until_idle(const char *scenario, uint64_t timeout_us)
+{
+  uint64_t deadline = sim_now_us() + timeout_us;
+  do {
+    tick(scenario);
+  } while (ctx.state != STATE_IDLE && sim_now_us() < deadline);
+  return ctx.state == STATE_IDLE;
+}
+
+// Ideal trapezoid (or triangle) time for a move from rest to rest
+static uint64_t ideal_move_us(int distance, long cruise_half_us)
+{
+  double a = MOTION_ACCEL_STEPS_PER_S2;
+  double v = 1e6 / (2.0 * std::max((long)STEP_ENGINE_MIN_HALF_PERIOD_US, cruise_half_us));
+  v = std::min(v, sqrt(2.0 * a * MOTION_RAMP_STEPS));
+  v = std::min(v, sqrt(a * distance));
+  double t = 2.0 * v / a + (distance - v * v / a) / v;
+  return (uint64_t)(t * 1e6);
+}
+
+static int mechanical_offset()
+{
+  return sim_mechanical_position() - ctx.position;
+}
+
+static void forget_frames()
+{
+  sim_radio_frames().clear();
+  frames_seen = 0;
+}
+
+static bool sent(CommandType cmd)
+{
+  for (const SimFrame &f : sim_radio_frames()) {
+    if (f.len != sizeof(Message)) continue;
+    Message msg;
+    memcpy(&msg, f.data, sizeof(msg));
+    if (msg.command == cmd) return true;
+  }
+  return false;
+}
+
+static void home(const char *scenario)
+{
+  send_command(CMD_HOME);
+  if (!run_until_idle(scenario, 60000000ULL) || !ctx.homed) fail(scenario, "homing failed");
+}
+
+static void move_and_settle(const char *scenario, int target)
+{
+  send_command(CMD_MOVE_TO, target);
+  if (!run_until_idle(scenario, 30000000ULL)) fail(scenario, "move to %d did not finish", target);
+  tick(scenario); // service task pass
+}
+
+// Home from an unknown position: the counted position is wrong and the
+// carriage is anywhere above or on the mark. Homing must stop on the mark's
+// upper edge step every time, whatever the approach speed.
+static void scenario_homing()
+{
+  const char *name = "homing";
+  const long presets[] = {10, 20, 40, 100};
+  const long saved_fast_pd = speeds.fast_pd;
+  uint64_t slowest_us = 0;
+  for (int run = 0; run < SIM_HOME_RUNS; ++run) {
+    forget_frames();
+    bool on_mark = run % 10 == 0;
+    sim_set_mechanical_position(on_mark ? random_int(SIM_MARK_LO, SIM_MARK_HI)
+                                        : random_int(SIM_MARK_HI + 1, STEPPER_POSITION_MAX * 2));
+    step_engine_set_position(0, random_int(STEPPER_POSITION_MIN, STEPPER_POSITION_MAX));
+    speeds.fast_pd = presets[run % 4];
+    uint64_t started_us = sim_now_us();
+    uint8_t id = send_command(CMD_MOVE_TO_HOME);
+    if (!run_until_idle(name, 60000000ULL)) {
+      fail(name, "homing did not finish (mechanical %d)", sim_mechanical_position());
+      send_command(CMD_STOP);
+      run_until_idle(name, SIM_TICK_US);
+      continue;
+    }
+    uint64_t elapsed = sim_now_us() - started_us;
+    slowest_us = std::max(slowest_us, elapsed);
+    if (elapsed > SIM_HOME_TIME_LIMIT_US) fail(name, "homing took %llums", (unsigned long long)(elapsed / 1000));
+    if (!acked(id)) fail(name, "CMD_MOVE_TO_HOME id=%u not acknowledged", id);
+    if (!sent(CMD_HOME_COMPLETE)) fail(name, "no CMD_HOME_COMPLETE (fast_pd=%ld)", speeds.fast_pd);
+    int error = mechanical_offset();
+    if (ctx.position != STEPPER_POSITION_MIN || error != SIM_MARK_HI) {
+      fail(name, "fast_pd=%ld homed to %d, mechanical %d (edge at %d)", speeds.fast_pd, ctx.position,
+           sim_mechanical_position(), SIM_MARK_HI);
+    }
+  }
+  speeds.fast_pd = saved_fast_pd;
+
+  // An aborted homing leaves the same position whether CMD_STOP or the stop flag ends it
+  for (bool by_command : {true, false}) {
+    sim_set_mechanical_position(STEPPER_POSITION_MAX);
+    send_command(CMD_MOVE_TO_HOME);
+    for (int i = 0; i < 20; ++i) tick(name);
+    if (by_command) send_command(CMD_STOP);
+    else ctx.stop_flag = true;
+    tick(name);
+    if (ctx.state != STATE_IDLE || ctx.position != STEPPER_POSITION_MIN) {
+      fail(name, "homing stopped by %s left state %d at %d", by_command ? "CMD_STOP" : "the stop flag", ctx.state,
+           ctx.position);
+    }
+  }
+  home(name);
+  printf("homing: %d runs, slowest %.2fs\n", SIM_HOME_RUNS, slowest_us / 1e6);
+}
+
+// Random absolute moves, some retargeted mid-flight
+static void scenario_move_to(int count)
+{
+  const char *name = "move_to";
+  for (int run = 0; run < count; ++run) {
+    int offset = mechanical_offset();
+    speeds.moveto_pd = random_int(0, 3) == 0 ? random_int(3, 200) : 10;
+    int start = ctx.position;
+    int target = random_int(STEPPER_POSITION_MIN - 50, STEPPER_POSITION_MAX + 50);
+    int landing = std::min(std::max(target, STEPPER_POSITION_MIN), STEPPER_POSITION_MAX);
+    uint64_t started_us = sim_now_us();
+    uint8_t id = send_command(CMD_MOVE_TO, target);
+
+    bool retarget = random_int(0, 3) == 0;
+    if (retarget) {
+      int wait = random_int(1, 200);
+      tick(name);
+      for (int i = 1; i < wait && ctx.state != STATE_IDLE; ++i) tick(name);
+      start = ctx.position;
+      started_us = sim_now_us();
+      target = random_int(STEPPER_POSITION_MIN, STEPPER_POSITION_MAX);
+      landing = target;
+      id = send_command(CMD_MOVE_TO, target);
+    }
+    // A retarget that reverses must stop first, so only time moves from rest
+    bool from_rest = !step_engine_running(0);
+
+    if (!run_until_idle(name, 30000000ULL)) {
+      fail(name, "move %d -> %d did not finish", start, target);
+      continue;
+    }
+    moves++;
+    uint64_t elapsed = sim_now_us() - started_us;
+    uint64_t limit = (uint64_t)(ideal_move_us(abs(landing - start), speeds.moveto_pd) * SIM_MOVE_TIME_SLACK) +
+                     SIM_MOVE_TIME_MARGIN_US;
+    if (!acked(id)) fail(name, "CMD_MOVE_TO id=%u not acknowledged", id);
+    if (ctx.position != landing) fail(name, "move %d -> %d ended at %d", start, target, ctx.position);
+    if (mechanical_offset() != offset) fail(name, "lost steps: offset %d -> %d", offset, mechanical_offset());
+    if (from_rest && !retarget && elapsed > limit) {
+      fail(name, "move %d -> %d at pd=%ld took %llums (limit %llums)", start, landing, speeds.moveto_pd,
+           (unsigned long long)(elapsed / 1000), (unsigned long long)(limit / 1000));
+    }
+    // Keep the radio capture from growing without bound
+    if (sim_radio_frames().size() > 4096) forget_frames();
+  }
+}
+
+// Jogs at every speed, each ended by a STOP or by the soft limit
+static void scenario_jog_stop()
+{
+  const char *name = "jog_stop";
+  const CommandType jogs[] = {CMD_UP_SLOW, CMD_UP_MEDIUM, CMD_UP_FAST, CMD_DOWN_SLOW, CMD_DOWN_MEDIUM, CMD_DOWN_FAST};
+  for (int run = 0; run < SIM_JOG_RUNS; ++run) {
+    int offset = mechanical_offset();
+    send_command(jogs[random_int(0, 5)]);
+    int duration = random_int(1, 400);
+    tick(name);
+    for (int i = 1; i < duration && ctx.state != STATE_IDLE; ++i) tick(name);
+    bool hit_limit = ctx.state == STATE_IDLE;
+    send_command(CMD_STOP);
+    tick(name);
+    if (ctx.state != STATE_IDLE || step_engine_running(0)) {
+      fail(name, "still moving one tick after STOP (state %d)", ctx.state);
+    }
+    int stopped_at = ctx.position;
+    for (int i = 0; i < 5; ++i) tick(name);
+    if (ctx.position != stopped_at) fail(name, "drifted from %d to %d after STOP", stopped_at, ctx.position);
+    if (hit_limit && ctx.position != STEPPER_POSITION_MIN && ctx.position != STEPPER_POSITION_MAX) {
+      fail(name, "jog stopped itself at %d, not at a soft limit", ctx.position);
+    }
+    if (mechanical_offset() != offset) fail(name, "lost steps: offset %d -> %d", offset, mechanical_offset());
+    forget_frames();
+  }
+}
+
+// Slider scrubbing: bursts of CMD_MOVE_TO and pulse-delay updates arrive between
+// two supervision passes. Only the last target of each burst may be executed,
+// and the motor must head straight for it.
+static void scenario_scrub()
+{
+  const char *name = "scrub";
+  const int bursts = 200;
+  uint32_t coalesced_before = command_queue_stats().coalesced;
+  uint32_t expected = 0;
+  for (int run = 0; run < bursts; ++run) {
+    int offset = mechanical_offset();
+    int start = ctx.position;
+    int count = random_int(2, 8);
+    int target = start;
+    long slow = speeds.slow_pd;
+    for (int i = 0; i < count; ++i) {
+      target = random_int(STEPPER_POSITION_MIN, STEPPER_POSITION_MAX);
+      send_command(CMD_MOVE_TO, target);
+      slow = random_int(20, 80);
+      send_command(CMD_SLOW_SPEED_PULSE_DELAY, slow);
+    }
+    // All moves but the last; all delay updates but the last two, which the last move separates
+    expected += (count - 1) + (count - 2);
+    forget_frames();
+    tick(name);
+    if (ctx.state != STATE_IDLE && ctx.move_target != target) {
+      fail(name, "heading for %d, last target %d", ctx.move_target, target);
+    }
+    // Monotonic travel: no partial move towards an earlier target
+    int previous = start;
+    bool reversed = false;
+    while (ctx.state != STATE_IDLE) {
+      tick(name);
+      if ((target - start) * (ctx.position - previous) < 0) reversed = true;
+      previous = ctx.position;
+    }
+    if (reversed) fail(name, "reversed on the way from %d to %d", start, target);
+    if (ctx.position != target) fail(name, "ended at %d, last target %d", ctx.position, target);
+    if (speeds.slow_pd != slow) fail(name, "slow_pd=%ld, last update %ld", speeds.slow_pd, slow);
+    if (mechanical_offset() != offset) fail(name, "lost steps: offset %d -> %d", offset, mechanical_offset());
+  }
+  uint32_t coalesced = command_queue_stats().coalesced - coalesced_before;
+  if (coalesced != expected) fail(name, "%u commands coalesced, expected %u", coalesced, expected);
+  printf("scrub: %d bursts, %u commands coalesced\n", bursts, coalesced);
+  forget_frames();
+}
+
+struct WaypointReport {
+  uint8_t id;
+  int32_t position;
+  uint64_t time_us;
+};
+
+static std::vector<WaypointReport> waypoint_reports()
+{
+  std::vector<WaypointReport> reports;
+  for (const SimFrame &f : sim_radio_frames()) {
+    if (f.len != sizeof(Message)) continue;
+    Message msg;
+    memcpy(&msg, f.data, sizeof(msg));
+    if (msg.command == CMD_WAYPOINT_STATUS) reports.push_back({msg.messageId, msg.param, f.time_us});
+  }
+  return reports;
+}
+
+// Queue waypoints a few per supervision pass, as they would arrive over the
+// radio, and run the trajectory to the end. Returns the CMD_WAYPOINT ids.
+static std::vector<uint8_t> run_waypoints(const char *scenario, const std::vector<int> &positions, uint16_t dwell_ms,
+                                          bool &stopped_between)
+{
+  const size_t per_tick = 8;
+  std::vector<uint8_t> ids;
+  stopped_between = false;
+  for (size_t i = 0; i < positions.size(); ++i) {
+    ids.push_back(send_command(CMD_WAYPOINT, waypoint_param((int16_t)positions[i], dwell_ms)));
+    if (i % per_tick == per_tick - 1) tick(scenario);
+  }
+  bool started = false;
+  uint64_t deadline = sim_now_us() + 60000000ULL;
+  do {
+    tick(scenario);
+    if (step_engine_running(0)) started = true;
+    else if (started && ctx.state == STATE_TRAJECTORY && !ctx.dwelling) stopped_between = true;
+  } while (ctx.state != STATE_IDLE && sim_now_us() < deadline);
+  if (ctx.state != STATE_IDLE) fail(scenario, "trajectory did not finish");
+  return ids;
+}
+
+// Waypoint sweeps: passed at speed without dwells, exact stops with them, stops
+// at reversals, and the buffer limit; compared with one CMD_MOVE_TO per point
+static void scenario_waypoints()
+{
+  const char *name = "waypoints";
+  const int points = 20;
+  move_and_settle(name, STEPPER_POSITION_MIN);
+  int offset = mechanical_offset();
+  std::vector<int> sweep;
+  for (int i = 1; i <= points; ++i) sweep.push_back(STEPPER_POSITION_MIN + i * (STEPPER_POSITION_MAX - STEPPER_POSITION_MIN) / points);
+
+  forget_frames();
+  uint64_t started_us = sim_now_us();
+  bool stopped_between;
+  std::vector<uint8_t> ids = run_waypoints(name, sweep, 0, stopped_between);
+  uint64_t blended_us = sim_now_us() - started_us;
+  std::vector<WaypointReport> reports = waypoint_reports();
+  size_t blended_frames = sim_radio_frames().size();
+  if (reports.size() != sweep.size()) fail(name, "%zu reports for %zu waypoints", reports.size(), sweep.size());
+  for (size_t i = 0; i < reports.size() && i < sweep.size(); ++i) {
+    if (reports[i].id != ids[i] || reports[i].position < sweep[i]) {
+      fail(name, "report %zu: id=%u position=%d, waypoint id=%u at %d", i, reports[i].id, reports[i].position, ids[i], sweep[i]);
+    }
+  }
+  if (stopped_between) fail(name, "motor stopped between waypoints without a dwell");
+  if (ctx.position != sweep.back()) fail(name, "sweep ended at %d", ctx.position);
+  uint64_t ideal = ideal_move_us(sweep.back() - STEPPER_POSITION_MIN, speeds.moveto_pd);
+  if (blended_us > (uint64_t)(ideal * SIM_MOVE_TIME_SLACK) + SIM_MOVE_TIME_MARGIN_US) {
+    fail(name, "blended sweep took %llums, one move takes %llums", (unsigned long long)(blended_us / 1000),
+         (unsigned long long)(ideal / 1000));
+  }
+
+  // The same sweep as one CMD_MOVE_TO per point, each sent once the last one ended
+  move_and_settle(name, STEPPER_POSITION_MIN);
+  forget_frames();
+  started_us = sim_now_us();
+  for (int target : sweep) move_and_settle(name, target);
+  uint64_t sequential_us = sim_now_us() - started_us;
+  size_t sequential_frames = sim_radio_frames().size();
+
+  // Downwards with a dwell at each point: exact stops, dwell honoured
+  const uint16_t dwell_ms = 50;
+  std::vector<int> down(sweep.rbegin() + 1, sweep.rend());
+  forget_frames();
+  ids = run_waypoints(name, down, dwell_ms, stopped_between);
+  reports = waypoint_reports();
+  if (reports.size() != down.size()) fail(name, "%zu dwell reports for %zu waypoints", reports.size(), down.size());
+  for (size_t i = 0; i < reports.size() && i < down.size(); ++i) {
+    if (reports[i].position != down[i]) fail(name, "dwell waypoint %d reported at %d", down[i], reports[i].position);
+    if (i && reports[i].time_us - reports[i - 1].time_us < dwell_ms * 1000ULL) fail(name, "dwell at %d cut short", down[i - 1]);
+  }
+
+  // Reversals stop exactly on the turning waypoints
+  std::vector<int> zigzag = {500, 300, 700, 650};
+  forget_frames();
+  run_waypoints(name, zigzag, 0, stopped_between);
+  reports = waypoint_reports();
+  for (size_t i = 0; i < reports.size() && i < zigzag.size(); ++i) {
+    if (reports[i].position != zigzag[i]) fail(name, "turning waypoint %d reported at %d", zigzag[i], reports[i].position);
+  }
+  if (reports.size() != zigzag.size()) fail(name, "%zu reports for the zigzag", reports.size());
+
+  // A move replaces the rest of the trajectory
+  forget_frames();
+  for (int target : {1500, 100, 1500}) send_command(CMD_WAYPOINT, waypoint_param((int16_t)target, 0));
+  for (int i = 0; i < 30; ++i) tick(name);
+  send_command(CMD_MOVE_TO, 800);
+  if (!run_until_idle(name, 30000000ULL) || ctx.position != 800 || trajectory_count(0)) {
+    fail(name, "CMD_MOVE_TO did not replace the trajectory (at %d, %zu waypoints left)", ctx.position, trajectory_count(0));
+  }
+
+  // The intake discards a waypoint a later move in the same batch replaces, and
+  // waypoints queued before a STOP; each one is still reported as cancelled
+  forget_frames();
+  uint8_t replaced = send_command(CMD_WAYPOINT, waypoint_param(1500, 0));
+  send_command(CMD_MOVE_TO, 300);
+  tick(name);
+  reports = waypoint_reports();
+  if (reports.size() != 1 || reports[0].id != replaced || reports[0].position != WAYPOINT_CANCELLED) {
+    fail(name, "%zu reports for the waypoint a move replaced in its batch", reports.size());
+  }
+  if (!run_until_idle(name, 30000000ULL) || ctx.position != 300) {
+    fail(name, "move behind a waypoint ended at %d", ctx.position);
+  }
+  forget_frames();
+  std::vector<uint8_t> stopped;
+  for (int target : {1500, 100, 1500}) {
+    stopped.push_back(send_command(CMD_WAYPOINT, waypoint_param((int16_t)target, 0)));
+  }
+  send_command(CMD_STOP);
+  tick(name);
+  reports = waypoint_reports();
+  if (reports.size() != stopped.size()) {
+    fail(name, "%zu reports for %zu waypoints behind a STOP", reports.size(), stopped.size());
+  }
+  for (size_t i = 0; i < reports.size() && i < stopped.size(); ++i) {
+    if (reports[i].id != stopped[i] || reports[i].position != WAYPOINT_CANCELLED) {
+      fail(name, "waypoint id=%u behind a STOP reported as id=%u param=%d", stopped[i], reports[i].id,
+           reports[i].position);
+    }
+  }
+  if (ctx.state != STATE_IDLE || trajectory_count(0)) fail(name, "a waypoint behind a STOP started a trajectory");
+
+  // Full buffer: the extra waypoint is rejected; STOP empties the buffer
+  forget_frames();
+  size_t sent = 0;
+  for (int batch = 0; sent < TRAJECTORY_CAPACITY + 4; ++batch) {
+    for (int i = 0; i < 8; ++i, ++sent) send_command(CMD_WAYPOINT, waypoint_param((int16_t)(700 + sent % 2), 60000));
+    tick(name);
+  }
+  int rejected = 0;
+  for (const WaypointReport &r : waypoint_reports()) rejected += r.position == WAYPOINT_REJECTED;
+  if (rejected == 0) fail(name, "no waypoint rejected with %zu queued", sent);
+  std::vector<uint8_t> dropped;
+  for (size_t i = 0; i < trajectory_count(0); ++i) dropped.push_back(trajectory_at(0, i).messageId);
+  forget_frames();
+  send_command(CMD_STOP);
+  tick(name);
+  if (ctx.state != STATE_IDLE || trajectory_count(0)) fail(name, "STOP left the trajectory running");
+  // Every waypoint STOP dropped is reported as cancelled, in buffer order
+  reports = waypoint_reports();
+  if (reports.size() != dropped.size()) fail(name, "%zu cancel reports for %zu dropped waypoints", reports.size(), dropped.size());
+  for (size_t i = 0; i < reports.size() && i < dropped.size(); ++i) {
+    if (reports[i].id != dropped[i] || reports[i].position != WAYPOINT_CANCELLED) {
+      fail(name, "cancel report %zu: id=%u param=%d, waypoint id=%u", i, reports[i].id, reports[i].position, dropped[i]);
+    }
+  }
+  if (mechanical_offset() != offset) fail(name, "lost steps: offset %d -> %d", offset, mechanical_offset());
+
+  printf("waypoints: %d-point sweep %.0fms and %zu frames, one CMD_MOVE_TO per point %.0fms and %zu frames\n", points,
+         blended_us / 1e3, blended_frames, sequential_us / 1e3, sequential_frames);
+  forget_frames();
+}
+
+static void bench_move(int target)
+{
+  send_command(CMD_MOVE_TO, target);
+  if (!run_until_idle("bench", 30000000ULL)) fail("bench", "move to %d did not finish", target);
+  forget_frames();
+}
+
+// Jog up and down at each preset until the soft limit stops it
+static void bench_jog_presets()
+{
+  const CommandType jogs[] = {CMD_UP_SLOW, CMD_DOWN_SLOW, CMD_UP_MEDIUM, CMD_DOWN_MEDIUM, CMD_UP_FAST, CMD_DOWN_FAST};
+  for (CommandType jog : jogs) {
+    send_command(jog);
+    if (!run_until_idle("bench", 30000000ULL)) fail("bench", "jog did not reach a soft limit");
+    forget_frames();
+  }
+}
+
+static void bench_full_range()
+{
+  bench_move(STEPPER_POSITION_MIN);
+  for (int i = 0; i < 10; ++i) {
+    bench_move(STEPPER_POSITION_MAX);
+    bench_move(STEPPER_POSITION_MIN);
+  }
+}
+
+// Full-range moves while the GUI floods the intake: every tick brings more
+// commands than the normal lane holds, retargeting to the same end point
+static void bench_move_flood()
+{
+  const int burst = 80;
+  for (int i = 0; i < 5; ++i) {
+    int target = i % 2 ? STEPPER_POSITION_MIN : STEPPER_POSITION_MAX;
+    send_command(CMD_MOVE_TO, target);
+    uint64_t deadline = sim_now_us() + 30000000ULL;
+    do {
+      for (int k = 0; k < burst; ++k) send_command(k % 4 ? CMD_GET_POSITION : CMD_MOVE_TO, target);
+      tick("bench");
+    } while (ctx.state != STATE_IDLE && sim_now_us() < deadline);
+    if (ctx.position != target) fail("bench", "flooded move ended at %d, not %d", ctx.position, target);
+    forget_frames();
+  }
+}
+
+static void run_bench(const char *name, void (*workload)())
+{
+  perf_reset();
+  printf("== bench %s\n", name);
+  uint64_t started_us = sim_now_us();
+  workload();
+  perf_dump();
+  printf("   simulated %.2fs\n", (sim_now_us() - started_us) / 1e6);
+}
+
+static int run_benchmarks()
+{
+  run_bench("jog_presets", bench_jog_presets);
+  run_bench("full_range_move_to", bench_full_range);
+  run_bench("move_to_flood", bench_move_flood);
+  CommandQueueStats q = command_queue_stats();
+  printf("queue overflows=%u high_water=%u\n", q.normal_overflows, q.normal_high_water);
+  return failures ? 1 : 0;
+}
+
+// A slider drag of pulse delay updates costs one flash write once it settles,
+// the blob reloads intact, and a corrupt blob is rejected
+static void scenario_config()
+{
+  const char *name = "config";
+  config_flush(); // earlier scenarios may have left a commit pending
+  uint32_t writes_before = sim_nvs_writes();
+  for (int value = 100; value >= 41; --value) {
+    send_command(CMD_SLOW_SPEED_PULSE_DELAY, value);
+    for (int i = 0; i < 10; ++i) tick(name);
+  }
+  if (sim_nvs_writes() != writes_before) fail(name, "wrote NVS during the drag");
+  for (int i = 0; i < (int)CONFIG_COMMIT_QUIET_MS + 10; ++i) tick(name);
+  if (sim_nvs_writes() != writes_before + 1) fail(name, "%u writes after the drag, expected 1", sim_nvs_writes() - writes_before);
+
+  long expected = speeds.slow_pd;
+  speeds.slow_pd = 1;
+  if (config_load() != CONFIG_FROM_BLOB || speeds.slow_pd != expected) {
+    fail(name, "blob did not reload (slow_pd=%ld)", speeds.slow_pd);
+  }
+  sim_nvs_corrupt("config", 6);
+  speeds.slow_pd = 1;
+  if (config_load() == CONFIG_FROM_BLOB) fail(name, "corrupt blob accepted");
+  speeds.slow_pd = expected;
+  forget_frames();
+}
+
+// Reboot where the carriage stands: the counted position starts from scratch
+// and only the journal can bring it back
+static JournalSource reboot(bool power_cut)
+{
+  if (power_cut) sim_power_cycle();
+  step_engine_stop(0);
+  step_engine_set_position(0, 0);
+  fsm_init(&ctx, 0);
+  int restored = 0;
+  JournalSource source = journal_load(restored);
+  if (source != JOURNAL_NONE && !fsm_restore_position(&ctx, restored)) source = JOURNAL_NONE;
+  tick("journal");
+  return source;
+}
+
+static void expect_restore(const char *what, JournalSource got, JournalSource expected, int offset)
+{
+  if (got != expected) fail("journal", "%s: restored from source %d, expected %d", what, got, expected);
+  else if (expected != JOURNAL_NONE && mechanical_offset() != offset) {
+    fail("journal", "%s: restored with offset %d, expected %d", what, mechanical_offset(), offset);
+  }
+  if (ctx.homed != (expected != JOURNAL_NONE)) fail("journal", "%s: homed=%d", what, ctx.homed);
+}
+
+// Resets and power cuts at rest, in motion and mid-write; the journal ring
+// wrapping; a carriage moved while powered off
+static void scenario_journal()
+{
+  const char *name = "journal";
+  forget_frames();
+  home(name);
+  int offset = mechanical_offset();
+
+  move_and_settle(name, random_int(STEPPER_POSITION_MIN + 1, STEPPER_POSITION_MAX));
+  // A pulse delay changed just before the reset is written before the restart
+  const long slow_pd = speeds.slow_pd;
+  send_command(CMD_SLOW_SPEED_PULSE_DELAY, slow_pd + 1);
+  tick(name);
+  send_command(CMD_RESET);
+  tick(name);
+  if (!sim_restart_requested()) fail(name, "CMD_RESET did not restart");
+  sim_clear_restart();
+  speeds.slow_pd = 1;
+  if (config_load() != CONFIG_FROM_BLOB || speeds.slow_pd != slow_pd + 1) {
+    fail(name, "pulse delay set before CMD_RESET not saved (slow_pd=%ld)", speeds.slow_pd);
+  }
+  speeds.slow_pd = slow_pd;
+  config_mark_dirty();
+  config_flush();
+  expect_restore("soft reset at rest", reboot(false), JOURNAL_RETAINED, offset);
+
+  move_and_settle(name, random_int(STEPPER_POSITION_MIN + 1, STEPPER_POSITION_MAX));
+  expect_restore("power cut at rest", reboot(true), JOURNAL_FLASH, offset);
+  move_and_settle(name, STEPPER_POSITION_MIN);
+  expect_restore("power cut on the mark", reboot(true), JOURNAL_FLASH, offset);
+
+  send_command(CMD_MOVE_TO, STEPPER_POSITION_MAX);
+  for (int i = 0; i < 50; ++i) tick(name);
+  expect_restore("power cut in motion", reboot(true), JOURNAL_NONE, offset);
+  home(name);
+  offset = mechanical_offset();
+
+  // The append of the new resting position is cut off after 5 bytes
+  send_command(CMD_MOVE_TO, STEPPER_POSITION_MAX / 2);
+  for (int i = 0; i < 5; ++i) tick(name);
+  sim_journal_tear_next_write(5);
+  run_until_idle(name, 30000000ULL);
+  tick(name);
+  uint32_t torn_before = journal_stats().torn_skipped;
+  expect_restore("power cut mid-write", reboot(true), JOURNAL_NONE, offset);
+  home(name);
+  offset = mechanical_offset();
+  move_and_settle(name, STEPPER_POSITION_MAX / 3);
+  if (journal_stats().torn_skipped == torn_before) fail(name, "torn slot not skipped");
+  expect_restore("power cut after a torn write", reboot(true), JOURNAL_FLASH, offset);
+
+  // Three times round the ring
+  uint32_t erases_before = sim_journal_erases();
+  int rests = (int)(3 * SIM_JOURNAL_SIZE / sizeof(JournalRecord));
+  for (int i = 0; i < rests; ++i) move_and_settle(name, STEPPER_POSITION_MAX / 3 + 1 + i % 2);
+  uint32_t erases = sim_journal_erases() - erases_before;
+  if (erases < 3 * SIM_JOURNAL_SIZE / HAL_JOURNAL_SECTOR) fail(name, "%u erases for %d rests", erases, rests);
+  expect_restore("power cut after wrapping", reboot(true), JOURNAL_FLASH, offset);
+
+  // Pushed onto the mark by hand while off: the sensor vetoes the journal
+  move_and_settle(name, STEPPER_POSITION_MAX / 2);
+  sim_set_mechanical_position(SIM_MARK_LO + 5);
+  expect_restore("carriage moved while off", reboot(true), JOURNAL_NONE, offset);
+  sim_set_mechanical_position(STEPPER_POSITION_MAX / 2 + offset);
+  expect_restore("vetoed record reused", reboot(true), JOURNAL_NONE, offset);
+  home(name);
+
+  JournalStats stats = journal_stats();
+  printf("journal: %u appends, %u erases, %u torn slots skipped, %u write errors\n", stats.appends, stats.erases,
+         stats.torn_skipped, stats.write_errors);
+  if (stats.write_errors) fail(name, "flash write errors");
+  forget_frames();
+}
+
+static Message make_message(CommandType cmd, int32_t param)
+{
+  Message msg;
+  msg.messageId = next_message_id++;
+  if (next_message_id == 0) next_message_id = 1;
+  msg.command = cmd;
+  msg.param = param;
+  return msg;
+}
+
+// Receive side of on_data_recv(): every Message record of a batch frame goes to
+// the intake. Returns the number of records taken.
+static int receive_batch(const uint8_t *data, size_t len, bool &intact)
+{
+  int taken = 0;
+  intact = batch_for_each(data, len, [&taken](const uint8_t *record, size_t record_len) {
+    if (record_len != sizeof(Message)) return;
+    Message msg;
+    memcpy(&msg, record, sizeof(msg));
+    command_queue_push(msg);
+    taken++;
+  });
+  return taken;
+}
+
+// Command that takes the FSM from any command state to `state`
+static void send_state_command(StepperState state)
+{
+  // Far from where the carriage is, so a move always starts
+  int target = ctx.position > (STEPPER_POSITION_MIN + STEPPER_POSITION_MAX) / 2 ? STEPPER_POSITION_MIN + 100
+                                                                                 : STEPPER_POSITION_MAX - 100;
+  switch (state) {
+    case STATE_IDLE: send_command(CMD_STOP); break;
+    case STATE_MOVING_UP: send_command(CMD_UP_SLOW); break;
+    case STATE_MOVING_DOWN: send_command(CMD_DOWN_SLOW); break;
+    case STATE_MOVING_TO: send_command(CMD_MOVE_TO, target); break;
+    case STATE_MOVE_TO_HOME: send_command(CMD_HOME); break;
+    case STATE_RESETTING: send_command(CMD_RESET); break;
+    case STATE_TRAJECTORY: send_command(CMD_WAYPOINT, waypoint_param((int16_t)target, 0)); break;
+    case STATE_VELOCITY: send_command(CMD_JOG_VELOCITY, 2000); break;
+  }
+}
+
+// Drives every transition FSM_TRANSITIONS allows, from a command in the source
+// state; the tick() check fails any transition it does not allow
+static void scenario_transitions()
+{
+  const char *name = "transitions";
+  for (uint8_t from = 0; from < STATE_COUNT; ++from) {
+    for (uint8_t to = 0; to < STATE_COUNT; ++to) {
+      if (from == to || !fsm_transition_legal((StepperState)from, (StepperState)to)) continue;
+      if (!ctx.homed) home(name);
+      move_and_settle(name, (STEPPER_POSITION_MIN + STEPPER_POSITION_MAX) / 2);
+      if (from != STATE_IDLE) {
+        send_state_command((StepperState)from);
+        tick(name);
+      }
+      if (ctx.state != from) {
+        fail(name, "could not enter state %d (in %d)", from, ctx.state);
+        continue;
+      }
+      // Pending commands collapse in the intake, so seen_transitions only
+      // counts this one if the command really ran in `from`
+      seen_transitions[from] &= (uint16_t)~fsm_state_bit((StepperState)to);
+      send_state_command((StepperState)to);
+      tick(name);
+      if (!(seen_transitions[from] & fsm_state_bit((StepperState)to))) {
+        fail(name, "command for state %d in state %d ended in %d", to, from, ctx.state);
+      }
+      if (sim_restart_requested()) {
+        sim_clear_restart();
+        reboot(false);
+      }
+      send_command(CMD_STOP);
+      run_until_idle(name, SIM_TICK_US);
+    }
+  }
+  if (!ctx.homed) home(name);
+  forget_frames();
+}
+
+// A config upload in one batch frame; truncated and newer-version batches
+static void scenario_batch()
+{
+  const char *name = "batch";
+  const CommandType config[] = {CMD_SLOW_SPEED_PULSE_DELAY, CMD_MEDIUM_SPEED_PULSE_DELAY, CMD_FAST_SPEED_PULSE_DELAY,
+                                CMD_MOVE_TO_PULSE_DELAY};
+  const long values[] = {55, 27, 12, 11};
+  const long saved[] = {speeds.slow_pd, speeds.med_pd, speeds.fast_pd, speeds.moveto_pd};
+  BatchBuilder batch;
+  batch_begin(batch, 1);
+  for (int i = 0; i < 4; ++i) {
+    Message msg = make_message(config[i], values[i]);
+    batch_append(batch, (const uint8_t *)&msg, sizeof(msg));
+  }
+  Message query = make_message(CMD_GET_POSITION, STEPPER_PARAM_UNUSED);
+  batch_append(batch, (const uint8_t *)&query, sizeof(query));
+  // A telemetry-sized record rides along and is skipped by the command intake
+  const uint8_t other[] = {0, TELEMETRY_KIND_DELTA, 0, 0, 0};
+  batch_append(batch, other, sizeof(other));
+  while (batch_fits(batch, sizeof(Message))) {
+    Message filler = make_message(CMD_SENSOR_STATUS, STEPPER_PARAM_UNUSED);
+    batch_append(batch, (const uint8_t *)&filler, sizeof(filler));
+  }
+  if (batch.len > BATCH_FRAME_MAX || batch_records(batch) != BATCH_MAX_MESSAGES) {
+    fail(name, "%zu records in %zu bytes", batch_records(batch), batch.len);
+  }
+
+  forget_frames();
+  uint32_t overflows = command_queue_stats().normal_overflows;
+  bool intact;
+  int taken = receive_batch(batch.data, batch.len, intact);
+  if (command_queue_stats().normal_overflows != overflows) fail(name, "full batch overflowed the intake");
+  if (!intact || taken != (int)batch_records(batch) - 1) fail(name, "took %d of %zu records", taken, batch_records(batch));
+  for (int i = 0; i < 4; ++i) tick(name);
+  if (speeds.slow_pd != values[0] || speeds.med_pd != values[1] || speeds.fast_pd != values[2] ||
+      speeds.moveto_pd != values[3]) {
+    fail(name, "config upload not applied: %ld %ld %ld %ld", speeds.slow_pd, speeds.med_pd, speeds.fast_pd,
+         speeds.moveto_pd);
+  }
+  bool answered = false;
+  for (const SimFrame &f : sim_radio_frames()) {
+    Message msg;
+    memcpy(&msg, f.data, sizeof(msg));
+    if (f.len == sizeof(msg) && msg.command == CMD_GET_POSITION && msg.messageId == query.messageId) answered = true;
+  }
+  if (!answered) fail(name, "CMD_GET_POSITION in the batch not answered");
+
+  // Cut short: the complete records before the damage still count
+  if (receive_batch(batch.data, 4 + 2 * 7 + 3, intact) != 2 || intact) fail(name, "truncated batch");
+  batch.data[offsetof(BatchHeader, version)] = BATCH_VERSION + 1;
+  if (receive_batch(batch.data, batch.len, intact) != 0 || intact) fail(name, "newer batch version accepted");
+  for (int i = 0; i < 4; ++i) tick(name);
+
+  speeds.slow_pd = saved[0];
+  speeds.med_pd = saved[1];
+  speeds.fast_pd = saved[2];
+  speeds.moveto_pd = saved[3];
+  config_flush();
+  forget_frames();
+}
+
+// Streams CMD_JOG_VELOCITY every period_ms for duration_ms. The step rate may
+// only change as fast as the ramp allows, and the direction only flips at rest.
+static void stream_velocity(const char *scenario, int32_t velocity, int duration_ms, int period_ms = 20)
+{
+  const int window = 20;
+  std::vector<uint32_t> rates = {step_engine_step_rate(0)};
+  bool was_running = step_engine_running(0);
+  bool was_up = step_engine_direction(0);
+  for (int t = 0; t < duration_ms; ++t) {
+    if (t % period_ms == 0) send_command(CMD_JOG_VELOCITY, velocity);
+    tick(scenario);
+    bool running = step_engine_running(0);
+    // A reversal may stop and restart within one tick, but only from the bottom of the ramp
+    if (running && was_running && step_engine_direction(0) != was_up &&
+        rates.back() > 500000UL / MOTION_RAMP_HALF_PERIOD_US[16]) {
+      fail(scenario, "reversed at %u steps/s", rates.back());
+    }
+    was_running = running;
+    was_up = step_engine_direction(0);
+    rates.push_back(step_engine_step_rate(0));
+    if (rates.size() > window) {
+      uint32_t before = rates[rates.size() - 1 - window];
+      uint32_t change = rates.back() > before ? rates.back() - before : before - rates.back();
+      // Ramp quantization and the jump from the last ramp step to rest come on top
+      if (change > 1.5 * MOTION_ACCEL_STEPS_PER_S2 * window / 1000.0 + 150) {
+        fail(scenario, "step rate %u -> %u within %d ms", before, rates.back(), window);
+      }
+    }
+  }
+}
+
+// Knob-style velocity jog: track the setpoint, reverse through rest, stop at the
+// soft limits and ramp down once the setpoints stop
+static void scenario_velocity()
+{
+  const char *name = "velocity";
+  move_and_settle(name, (STEPPER_POSITION_MIN + STEPPER_POSITION_MAX) / 2);
+  int offset = mechanical_offset();
+  forget_frames();
+
+  stream_velocity(name, 2000, 400);
+  if (ctx.state != STATE_VELOCITY || abs((int)step_engine_step_rate(0) - 2000) > 100) {
+    fail(name, "state %d at %u steps/s, setpoint 2000", ctx.state, step_engine_step_rate(0));
+  }
+  stream_velocity(name, -1500, 400);
+  if (step_engine_direction(0) || abs((int)step_engine_step_rate(0) - 1500) > 100) {
+    fail(name, "%s at %u steps/s, setpoint -1500", step_engine_direction(0) ? "up" : "down", step_engine_step_rate(0));
+  }
+
+  // Setpoints stop: keep going until the timeout, then ramp down
+  uint64_t last_setpoint_us = sim_now_us();
+  while (sim_now_us() - last_setpoint_us < (VELOCITY_TIMEOUT_MS - 20) * 1000ULL) tick(name);
+  if (!step_engine_running(0)) fail(name, "stopped before the setpoint timeout");
+  if (!run_until_idle(name, 1000000ULL) || !sent(CMD_POSITION)) fail(name, "no stop after the setpoint timeout");
+
+  // Pressed against the top limit, then backed off and stopped with a zero setpoint
+  move_and_settle(name, STEPPER_POSITION_MAX - 200);
+  stream_velocity(name, 3000, 500);
+  if (ctx.state != STATE_VELOCITY || ctx.position != STEPPER_POSITION_MAX || step_engine_running(0)) {
+    fail(name, "at %d (state %d) after streaming into the top limit", ctx.position, ctx.state);
+  }
+  stream_velocity(name, -800, 200);
+  if (ctx.position >= STEPPER_POSITION_MAX) fail(name, "did not back off the limit");
+  forget_frames();
+  send_command(CMD_JOG_VELOCITY, 0);
+  if (!run_until_idle(name, 1000000ULL) || !sent(CMD_POSITION)) fail(name, "zero setpoint did not stop");
+
+  // A burst within one tick: only the newest setpoint is applied
+  uint32_t coalesced = command_queue_stats().coalesced;
+  for (int32_t v : {400, 900, -300, 1200}) send_command(CMD_JOG_VELOCITY, v);
+  tick(name);
+  if (ctx.pd != 500000L / 1200 || command_queue_stats().coalesced - coalesced != 3) {
+    fail(name, "burst applied pd=%ld, %u coalesced", ctx.pd, command_queue_stats().coalesced - coalesced);
+  }
+  send_command(CMD_STOP);
+  tick(name);
+
+  if (mechanical_offset() != offset) fail(name, "lost steps: offset %d -> %d", offset, mechanical_offset());
+  forget_frames();
+}
+
+static bool all_idle()
+{
+  for (const StepperContext &axis : axes) {
+    if (axis.state != STATE_IDLE) return false;
+  }
+  return true;
+}
+
+static bool run_until_all_idle(const char *scenario, uint64_t timeout_us)
+{
+  uint64_t deadline = sim_now_us() + timeout_us;
+  do {
+    tick(scenario);
+  } while (!all_idle() && sim_now_us() < deadline);
+  return all_idle();
+}
+
+// Two axes at once: concurrent moves, axis-tagged replies and telemetry, a
+// STOP that only stops its own axis, no coalescing across axes, unknown axes
+// rejected. Only runs in builds with STEPPER_AXIS_COUNT > 1.
+static void scenario_axes()
+{
+  const char *name = "axes";
+  if (AXIS_COUNT < 2) return;
+  const uint8_t second = AXIS_COUNT - 1;
+  StepperContext &other = axes[second];
+  const AxisConfig &limits = AXIS_CONFIGS[second];
+  forget_frames();
+
+  send_command(CMD_MOVE_TO_HOME, axis_param(second, STEPPER_PARAM_UNUSED));
+  if (!run_until_all_idle(name, 60000000ULL) || !other.homed || other.position != limits.min_pos) {
+    fail(name, "axis %u did not home (state %d, position %d)", second, other.state, other.position);
+  }
+  if (ctx.state != STATE_IDLE || step_engine_running(0)) fail(name, "homing axis %u moved axis 0", second);
+  move_and_settle(name, STEPPER_POSITION_MIN);
+  int offsets[2] = {mechanical_offset(), sim_mechanical_position(second) - other.position};
+
+  // Concurrent moves take as long as the longer one, not the sum
+  int distance0 = STEPPER_POSITION_MAX - STEPPER_POSITION_MIN;
+  int distance1 = (limits.max_pos - limits.min_pos) / 2;
+  uint32_t coalesced = command_queue_stats().coalesced;
+  uint64_t started_us = sim_now_us();
+  send_command(CMD_MOVE_TO, STEPPER_POSITION_MAX);
+  send_command(CMD_MOVE_TO, axis_param(second, limits.min_pos + distance1));
+  if (!run_until_all_idle(name, 30000000ULL)) fail(name, "concurrent moves did not finish");
+  uint64_t elapsed = sim_now_us() - started_us;
+  uint64_t limit = (uint64_t)(ideal_move_us(std::max(distance0, distance1), speeds.moveto_pd) * SIM_MOVE_TIME_SLACK) +
+                   SIM_MOVE_TIME_MARGIN_US;
+  if (elapsed > limit) {
+    fail(name, "concurrent moves took %llums (limit %llums)", (unsigned long long)(elapsed / 1000),
+         (unsigned long long)(limit / 1000));
+  }
+  if (command_queue_stats().coalesced != coalesced) fail(name, "moves for different axes coalesced");
+  if (ctx.position != STEPPER_POSITION_MAX || other.position != limits.min_pos + distance1) {
+    fail(name, "landed at %d / %d", ctx.position, other.position);
+  }
+
+  // Replies and telemetry name their axis
+  uint8_t id = send_command(CMD_GET_POSITION, axis_param(second, STEPPER_PARAM_UNUSED));
+  tick(name);
+  bool answered = false;
+  bool axis_telemetry = false;
+  for (const SimFrame &f : sim_radio_frames()) {
+    Message msg;
+    memcpy(&msg, f.data, sizeof(msg));
+    if (f.len == sizeof(msg) && msg.command == CMD_GET_POSITION && msg.messageId == id) {
+      answered = axis_from_param(msg.param) == second && axis_value(msg.param) == other.position;
+    }
+    if (f.len == sizeof(TelemetryFull) && f.data[1] == TELEMETRY_KIND_FULL &&
+        f.data[2] >> TELEMETRY_FLAG_AXIS_SHIFT == second) {
+      axis_telemetry = true;
+    }
+  }
+  if (!answered) fail(name, "CMD_GET_POSITION for axis %u not answered with its position", second);
+  if (!axis_telemetry) fail(name, "no telemetry for axis %u", second);
+
+  // A STOP for one axis leaves the other running, and does not discard its
+  // queued move
+  send_command(CMD_MOVE_TO, axis_param(second, limits.max_pos));
+  send_command(CMD_MOVE_TO, STEPPER_POSITION_MIN);
+  for (int i = 0; i < 50; ++i) tick(name);
+  send_command(CMD_MOVE_TO, STEPPER_POSITION_MIN + distance0 / 4);
+  send_command(CMD_STOP, axis_param(second, STEPPER_PARAM_UNUSED));
+  for (int i = 0; i < 5; ++i) tick(name);
+  if (other.state != STATE_IDLE || step_engine_running(second)) fail(name, "axis %u did not stop", second);
+  if (!step_engine_running(0)) fail(name, "STOP for axis %u stopped axis 0", second);
+  if (!run_until_all_idle(name, 30000000ULL) || ctx.position != STEPPER_POSITION_MIN + distance0 / 4) {
+    fail(name, "axis 0 move behind the STOP lost (at %d)", ctx.position);
+  }
+
+  // Unknown axes are dropped
+  if (AXIS_COUNT < AXIS_MAX) {
+    int before[2] = {ctx.position, other.position};
+    send_command(CMD_MOVE_TO, axis_param(AXIS_COUNT, STEPPER_POSITION_MAX));
+    for (int i = 0; i < 20; ++i) tick(name);
+    if (!all_idle() || ctx.position != before[0] || other.position != before[1]) {
+      fail(name, "command for axis %u moved a motor", AXIS_COUNT);
+    }
+  }
+
+  if (mechanical_offset() != offsets[0] || sim_mechanical_position(second) - other.position != offsets[1]) {
+    fail(name, "lost steps");
+  }
+  forget_frames();
+}
+
+// CMD_PERF_STATS answers with one report frame per probe
+static void scenario_perf_report()
+{
+  const char *name = "perf_report";
+  forget_frames();
+  uint8_t id = send_command(CMD_PERF_STATS, PERF_PARAM_RESET);
+  tick(name);
+  int reports = 0;
+  for (const SimFrame &f : sim_radio_frames()) {
+    if (f.len == sizeof(PerfReport) && f.data[1] == PERF_REPORT_KIND && f.data[0] == id) reports++;
+  }
+  if (!acked(id)) fail(name, "CMD_PERF_STATS id=%u not acknowledged", id);
+  if (reports != PERF_PROBE_COUNT) fail(name, "%d report frames, expected %d", reports, (int)PERF_PROBE_COUNT);
+  if (perf_snapshot(PERF_COMMAND).count > 1) fail(name, "histograms not reset");
+}
+
+// Latest controller ping handed to the radio since frame index `from`
+static bool find_ping(size_t &from, LatencyFrame &ping)
+{
+  std::vector<SimFrame> &frames = sim_radio_frames();
+  bool found = false;
+  for (; from < frames.size(); ++from) {
+    const SimFrame &f = frames[from];
+    if (!latency_is_frame(f.data, f.len) || f.data[2] != LATENCY_PING) continue;
+    memcpy(&ping, f.data, sizeof(ping));
+    found = true;
+  }
+  return found;
+}
+
+// Pings answered by a GUI whose clock runs far ahead of the controller's (so
+// the offset wraps), over a link that loses every seventh pong. The report must
+// match the round trips the simulation imposed, and late pongs must not count.
+static void scenario_latency()
+{
+  const char *name = "latency";
+  const uint32_t gui_offset_us = 0x9ABCDEF0;
+  const int ping_count = 40;
+  std::vector<uint32_t> rtts;
+  int lost = 0;
+  size_t frame_index = sim_radio_frames().size();
+  LatencyFrame late_pong = {};
+  bool have_late_pong = false;
+  latency_reset();
+  for (int i = 0; i < ping_count; ++i) {
+    // Service task passes until the controller pings
+    LatencyFrame ping;
+    uint64_t deadline = sim_now_us() + 2 * LATENCY_PING_INTERVAL_MS * 1000;
+    do {
+      sim_advance_us(20000);
+      latency_service((uint32_t)hal_micros(), true);
+    } while (!find_ping(frame_index, ping) && sim_now_us() < deadline);
+    if (sim_now_us() >= deadline) {
+      fail(name, "no ping %d", i);
+      return;
+    }
+    if (have_late_pong) {
+      // The pong of an expired ping turns up after all
+      LatencyFrame unused;
+      latency_on_frame((const uint8_t *)&late_pong, sizeof(late_pong), (uint32_t)hal_micros(), unused);
+      have_late_pong = false;
+    }
+    // Equal legs, so the offset estimate has no error to allow for
+    uint32_t leg_us = (uint32_t)random_int(400, 4000);
+    sim_advance_us(leg_us);
+    LatencyFrame pong = ping;
+    pong.type = LATENCY_PONG;
+    pong.receive_us = (uint32_t)hal_micros() + gui_offset_us;
+    sim_advance_us((uint32_t)random_int(20, 800)); // GUI turnaround
+    pong.transmit_us = (uint32_t)hal_micros() + gui_offset_us;
+    if (i % 7 == 3) {
+      late_pong = pong;
+      have_late_pong = true;
+      lost++;
+      continue;
+    }
+    sim_advance_us(leg_us);
+    LatencyFrame reply;
+    if (latency_on_frame((const uint8_t *)&pong, sizeof(pong), (uint32_t)hal_micros(), reply)) {
+      fail(name, "controller answered a pong");
+    }
+    rtts.push_back(2 * leg_us);
+  }
+  // Let the last ping expire if it was lost
+  sim_advance_us(LATENCY_TIMEOUT_MS * 1000);
+  latency_service((uint32_t)hal_micros(), false);
+
+  // A GUI ping is answered with its stamps
+  LatencyFrame gui_ping = {7, LATENCY_KIND, LATENCY_PING, 123456, 0, 0};
+  LatencyFrame pong;
+  uint32_t arrival_us = (uint32_t)hal_micros();
+  if (!latency_on_frame((const uint8_t *)&gui_ping, sizeof(gui_ping), arrival_us, pong) || pong.seq != 7 ||
+      pong.type != LATENCY_PONG || pong.origin_us != 123456 || pong.receive_us != arrival_us) {
+    fail(name, "GUI ping not answered with its stamps");
+  }
+
+  forget_frames();
+  perf_reset();
+  uint8_t id = send_command(CMD_LATENCY_STATS, LATENCY_PARAM_RESET);
+  tick(name);
+  if (!acked(id)) fail(name, "CMD_LATENCY_STATS id=%u not acknowledged", id);
+  if (perf_snapshot(PERF_QUEUE_WAIT).count == 0) fail(name, "queue wait not recorded");
+  LatencyReport report = {};
+  bool reported = false;
+  for (const SimFrame &f : sim_radio_frames()) {
+    if (f.len == sizeof(LatencyReport) && f.data[1] == LATENCY_KIND && f.data[2] == LATENCY_REPORT &&
+        f.data[0] == id) {
+      memcpy(&report, f.data, sizeof(report));
+      reported = true;
+    }
+  }
+  if (!reported) {
+    fail(name, "no latency report");
+    return;
+  }
+  std::sort(rtts.begin(), rtts.end());
+  auto rank = [&rtts](size_t percent) { return rtts[(rtts.size() * percent + 99) / 100 - 1]; };
+  if (report.pings != ping_count || report.lost != lost) {
+    fail(name, "%u pings %u lost, expected %d and %d", report.pings, report.lost, ping_count, lost);
+  }
+  if (report.rtt_p50_us != rank(50) || report.rtt_p90_us != rank(90) || report.rtt_p99_us != rank(99) ||
+      report.rtt_max_us != rtts.back() || report.one_way_us != rank(50) / 2) {
+    fail(name, "rtt p50=%u p90=%u p99=%u max=%u, expected %u %u %u %u", report.rtt_p50_us, report.rtt_p90_us,
+         report.rtt_p99_us, report.rtt_max_us, rank(50), rank(90), rank(99), rtts.back());
+  }
+  if (report.offset_us != (int32_t)gui_offset_us) {
+    fail(name, "clock offset %d, expected %d", report.offset_us, (int32_t)gui_offset_us);
+  }
+  if (latency_snapshot().pings != 0) fail(name, "window not reset");
+  printf("latency: rtt p50=%uus p99=%uus lost %u of %u\n", report.rtt_p50_us, report.rtt_p99_us, report.lost,
+         report.pings);
+  forget_frames();
+}
+
+// Profiled homing lands on the centre of the dip whatever the D0 threshold
+// does, which edge homing follows. A mark with no dip fails homing cleanly.
+// profile_begin() from the motion task once the service task has printed the
+// report line and the first line of bins
+static int profile_lines_printed = 0;
+static void profile_pass_while_printing()
+{
+  if (++profile_lines_printed < 2) return;
+  sim_console_hook(nullptr);
+  if (!profile_begin(0, AXIS_CONFIGS[0].analog_pin, 0)) fail("profile", "pass did not start");
+}
+
+static void scenario_profile()
+{
+  const char *name = "profile";
+  const int mark_hi = SIM_MARK_HI + 1; // odd width, so the centre is a whole step
+  const int center = (SIM_MARK_LO + mark_hi) / 2;
+  const int drifts[] = {0, 3, -3, 6};
+  const int runs = 20;
+  sim_set_home_mark(SIM_MARK_LO, mark_hi);
+  profile_set_enabled(true);
+  int worst_residual = 0;
+  for (int run = 0; run < runs; ++run) {
+    int drift = drifts[run % 4];
+    sim_set_sensor_drift(drift);
+    sim_set_mechanical_position(random_int(mark_hi + drift + 1, STEPPER_POSITION_MAX));
+    step_engine_set_position(0, random_int(STEPPER_POSITION_MIN, STEPPER_POSITION_MAX));
+    home(name);
+    if (ctx.position != STEPPER_POSITION_MIN || mechanical_offset() != center) {
+      fail(name, "D0 drift %d: homed to mechanical %d, dip centre at %d", drift, mechanical_offset(), center);
+    }
+    ProfileReport result = profile_result(0);
+    worst_residual = std::max(worst_residual, abs(result.residual_q8));
+    // D0 fires drift steps early (moving down), so its edge sits above the centre by that much
+    int edge_steps = (mark_hi - center) + drift;
+    if (result.edge_q8 == PROFILE_NO_EDGE || abs(result.edge_q8 + edge_steps * 256) > 128) {
+      fail(name, "D0 drift %d: edge %d/256 from the centre, expected %d steps", drift, result.edge_q8, -edge_steps);
+    }
+  }
+  // Edge homing follows the drift
+  profile_set_enabled(false);
+  sim_set_sensor_drift(3);
+  sim_set_mechanical_position(STEPPER_POSITION_MAX / 2);
+  home(name);
+  if (mechanical_offset() != mark_hi + 3) fail(name, "edge homing to %d with D0 drift 3", mechanical_offset());
+  sim_set_sensor_drift(0);
+  profile_set_enabled(true);
+
+  forget_frames();
+  uint8_t id = send_command(CMD_SENSOR_PROFILE);
+  tick(name);
+  tick(name);
+  if (!acked(id)) fail(name, "CMD_SENSOR_PROFILE id=%u not acknowledged", id);
+  ProfileReport report = {};
+  for (const SimFrame &f : sim_radio_frames()) {
+    if (f.len == sizeof(ProfileReport) && f.data[1] == PROFILE_REPORT_KIND && f.data[0] == id) {
+      memcpy(&report, f.data, sizeof(report));
+    }
+  }
+  // Half-depth width of the dip: the mark's width
+  int width_q8 = (mark_hi - SIM_MARK_LO + 1) * 256;
+  if (!report.valid || abs(report.width_q8 - width_q8) > 128 || report.floor >= report.baseline) {
+    fail(name, "report valid=%u width=%u/256 (expected %d) baseline=%u floor=%u", report.valid, report.width_q8,
+         width_q8, report.baseline, report.floor);
+  }
+  profile_dump_pending();
+
+  // A homing pass that starts while the bins are printed ends the bin dump
+  std::string console;
+  sim_console_capture(&console);
+  send_command(CMD_SENSOR_PROFILE);
+  tick(name);
+  profile_lines_printed = 0;
+  sim_console_hook(profile_pass_while_printing);
+  profile_dump_pending();
+  sim_console_capture(nullptr);
+  profile_end(0);
+  if (console.find("profile   0.0:") == std::string::npos || console.find("profile   5.0:") != std::string::npos ||
+      console.find("replaced by a new pass") == std::string::npos) {
+    fail(name, "bins printed while a new pass filled them");
+  }
+
+  // A faded mark: D0 still switches, A0 shows no dip
+  sim_set_reflectance(0);
+  sim_set_mechanical_position(STEPPER_POSITION_MAX / 2);
+  forget_frames();
+  send_command(CMD_HOME);
+  run_until_idle(name, 60000000ULL);
+  if (!sent(CMD_HOME_FAILED) || ctx.homed) fail(name, "homing without a dip did not fail");
+  sim_set_reflectance(2200);
+
+  // The ADC drops samples halfway through the pass: the later ones cannot be
+  // placed, so homing fails instead of landing on a shifted centre
+  sim_set_mechanical_position(STEPPER_POSITION_MAX / 2);
+  forget_frames();
+  send_command(CMD_HOME);
+  tick(name); // starts the new run, out of the failed run's phase
+  uint64_t deadline = sim_now_us() + 60000000ULL;
+  while (ctx.home_phase != HOME_PROFILE_PASS && ctx.state != STATE_IDLE && sim_now_us() < deadline) tick(name);
+  for (int i = 0; i < 20; ++i) tick(name);
+  sim_adc_overrun();
+  run_until_idle(name, 60000000ULL);
+  if (!sent(CMD_HOME_FAILED) || ctx.homed) fail(name, "homing after dropped ADC samples did not fail");
+
+  profile_set_enabled(HOME_PROFILE);
+  sim_set_home_mark(SIM_MARK_LO, SIM_MARK_HI);
+  sim_set_mechanical_position(STEPPER_POSITION_MAX / 2); // the failed pass ran on below the mark
+  home(name);
+  forget_frames();
+  printf("profile: %d runs, worst centre residual %d/256 step, width %u/256\n", runs, worst_residual,
+         report.width_q8);
+}
+
+// Value of the reply to the command with this id, if one was sent
+static bool reply_value(CommandType cmd, uint8_t id, int32_t &value)
+{
+  for (const SimFrame &f : sim_radio_frames()) {
+    if (f.len != sizeof(Message)) continue;
+    Message msg;
+    memcpy(&msg, f.data, sizeof(msg));
+    if (msg.command == cmd && msg.messageId == id) {
+      value = axis_value(msg.param);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Loop capacitor model: capacitance linear in the step with a little bow, and
+// resonance where C ~ 1/f^2
+static int tuned_position(uint32_t freq_hz)
+{
+  const double lo = 6.9e6, hi = 30.0e6;
+  double f = freq_hz;
+  double u = (1 / (f * f) - 1 / (hi * hi)) / (1 / (lo * lo) - 1 / (hi * hi));
+  u = u + 0.05 * u * (1 - u);
+  return STEPPER_POSITION_MIN + 50 + (int)lround(u * (STEPPER_POSITION_MAX - STEPPER_POSITION_MIN - 100));
+}
+
+static int32_t send_and_reply(const char *scenario, CommandType cmd, uint32_t freq_hz)
+{
+  forget_frames();
+  uint8_t id = send_command(cmd, (int32_t)freq_hz);
+  tick(scenario);
+  int32_t value = INT32_MAX; // no reply: a CMD_MOVE_TO_FREQ that ran
+  if (cmd == CMD_MOVE_TO_FREQ) run_until_idle(scenario, 30000000ULL);
+  if (!acked(id)) fail(scenario, "command %d id=%u not acknowledged", (int)cmd, id);
+  reply_value(cmd, id, value);
+  return value;
+}
+
+static bool tuning_monotonic(uint8_t axis)
+{
+  for (size_t i = 1; i < tuning_count(axis); ++i) {
+    TuningPoint a = tuning_at(axis, i - 1), b = tuning_at(axis, i);
+    if (b.freq_hz <= a.freq_hz || b.position > a.position) return false;
+  }
+  return true;
+}
+
+// Teach the band edges, then tune anywhere in between with one move each
+static void scenario_tuning()
+{
+  const char *name = "tuning";
+  const uint32_t bands[][2] = {{7000000, 7300000},   {10100000, 10150000}, {14000000, 14350000},
+                               {18068000, 18168000}, {21000000, 21450000}, {24890000, 24990000},
+                               {28000000, 29700000}};
+  home(name);
+  if (send_and_reply(name, CMD_TUNE_POINT, TUNING_CLEAR) != 0) fail(name, "table not cleared");
+  if (send_and_reply(name, CMD_MOVE_TO_FREQ, 14100000) != TUNING_REJECTED) fail(name, "empty table not rejected");
+
+  size_t taught = 0;
+  for (const auto &band : bands) {
+    for (uint32_t edge : band) {
+      move_and_settle(name, tuned_position(edge));
+      if (send_and_reply(name, CMD_TUNE_POINT, edge) != (int32_t)++taught) fail(name, "%u Hz not learned", edge);
+    }
+  }
+
+  // In-band frequencies land on the model; between bands the bow shows a little
+  int worst_in_band = 0, worst_between = 0;
+  uint64_t slowest_us = 0;
+  for (int run = 0; run < 200; ++run) {
+    const auto &band = bands[random_int(0, 6)];
+    bool in_band = run % 2 == 0;
+    uint32_t freq = in_band ? band[0] + (uint32_t)random_int(0, (int)(band[1] - band[0]))
+                            : (uint32_t)random_int(7000000, 29700000);
+    uint64_t started_us = sim_now_us();
+    int32_t value = send_and_reply(name, CMD_MOVE_TO_FREQ, freq);
+    slowest_us = std::max(slowest_us, sim_now_us() - started_us);
+    if (value == TUNING_REJECTED) fail(name, "%u Hz rejected", freq);
+    int error = abs(ctx.position - tuned_position(freq));
+    int &worst = in_band ? worst_in_band : worst_between;
+    worst = std::max(worst, error);
+  }
+  if (worst_in_band > 1 || worst_between > 6) {
+    fail(name, "tuned %d steps off in band, %d between bands", worst_in_band, worst_between);
+  }
+  if (send_and_reply(name, CMD_MOVE_TO_FREQ, 3600000) != TUNING_REJECTED ||
+      send_and_reply(name, CMD_MOVE_TO_FREQ, 30500000) != TUNING_REJECTED) {
+    fail(name, "frequency outside the table not rejected");
+  }
+  // A refused CMD_MOVE_TO_FREQ does not throw away the move queued before it
+  int target = ctx.position < (STEPPER_POSITION_MIN + STEPPER_POSITION_MAX) / 2 ? STEPPER_POSITION_MAX - 100
+                                                                                : STEPPER_POSITION_MIN + 100;
+  send_command(CMD_MOVE_TO, target);
+  send_command(CMD_MOVE_TO_FREQ, 3600000);
+  if (!run_until_idle(name, 30000000ULL) || ctx.position != target) {
+    fail(name, "move to %d followed by a refused CMD_MOVE_TO_FREQ ended at %d", target, ctx.position);
+  }
+
+  // A confirmation next to a point replaces it
+  move_and_settle(name, tuned_position(14000000) + 3);
+  if (send_and_reply(name, CMD_TUNE_POINT, 14003000) != (int32_t)taught) fail(name, "close point not merged");
+  int position;
+  if (!tuning_lookup(0, 14003000, position) || position != tuned_position(14000000) + 3) {
+    fail(name, "merged point not used");
+  }
+  // One beyond its neighbours (a slipped coupling) drops them
+  move_and_settle(name, tuned_position(18168000) - 10);
+  int32_t count = send_and_reply(name, CMD_TUNE_POINT, 14200000);
+  if (count >= (int32_t)taught || !tuning_monotonic(0)) fail(name, "stale neighbours kept (%d points)", count);
+
+  // Full table: the points the others predict best go
+  for (int i = 0; i < 40; ++i) {
+    uint32_t freq = (uint32_t)random_int(7000000, 29700000);
+    move_and_settle(name, tuned_position(freq));
+    send_and_reply(name, CMD_TUNE_POINT, freq);
+  }
+  if (tuning_count(0) != TUNING_CAPACITY || !tuning_monotonic(0)) {
+    fail(name, "%zu points after overfilling, or out of order", tuning_count(0));
+  }
+
+  // Not homed, or not at rest: refused
+  ctx.homed = false;
+  if (send_and_reply(name, CMD_MOVE_TO_FREQ, 14100000) != TUNING_REJECTED ||
+      send_and_reply(name, CMD_TUNE_POINT, 14100000) != TUNING_REJECTED) {
+    fail(name, "accepted while not homed");
+  }
+  ctx.homed = true;
+
+  // Survives a reboot; a corrupt blob loads as an empty table
+  std::vector<TuningPoint> before;
+  for (size_t i = 0; i < tuning_count(0); ++i) before.push_back(tuning_at(0, i));
+  tuning_load();
+  bool same = tuning_count(0) == before.size();
+  for (size_t i = 0; same && i < before.size(); ++i) {
+    same = tuning_at(0, i).freq_hz == before[i].freq_hz && tuning_at(0, i).position == before[i].position;
+  }
+  if (!same) fail(name, "table changed across a reload");
+  sim_nvs_corrupt("tune0", 10);
+  tuning_load();
+  if (tuning_count(0) != 0) fail(name, "corrupt table loaded");
+
+  send_and_reply(name, CMD_TUNE_POINT, TUNING_CLEAR);
+  forget_frames();
+  printf("tuning: %zu band edges, worst %d steps in band, %d between bands, slowest band change %.2fs\n", taught,
+         worst_in_band, worst_between, slowest_us / 1e6);
+}
+
+// ---------------------------------------------------------------------------
+// Trace replay (command_trace.h): commands from a capture go back into the
+// command queue at their recorded times, and the state changes the FSM makes
+// are compared with the captured ones axis by axis. A gap in the capture ends
+// the comparison of every axis; each one starts again at its next sync record.
+
+struct ReplayReport {
+  size_t commands;      // fed back into the command queue
+  size_t matched;       // state changes made as captured
+  size_t missing;       // captured state changes the replay did not make
+  size_t extra;         // state changes the capture does not have
+  uint32_t timing_p50_us; // over the matched state changes
+  uint32_t timing_max_us;
+  int position_max;     // steps
+  size_t gaps;          // in the capture, not compared
+  uint32_t lost;        // records the gaps hide
+};
+
+// Trace records from one sync record of an axis up to the next gap, or the end
+struct ReplayWindow {
+  uint8_t axis;
+  size_t from; // the sync record
+  size_t to;   // the gap record, or trace.size()
+};
+
+// The trace records in console text, oldest first. Other lines are skipped,
+// and so is anything a serial monitor puts in front of "trace".
+static std::vector<TraceRecord> parse_trace(const std::string &text)
+{
+  std::vector<TraceRecord> trace;
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t end = text.find('\n', start);
+    if (end == std::string::npos) end = text.size();
+    std::string line = text.substr(start, end - start);
+    size_t at = line.find("trace ");
+    TraceRecord record;
+    if (at != std::string::npos && trace_parse(line.c_str() + at, record)) trace.push_back(record);
+    start = end + 1;
+  }
+  return trace;
+}
+
+// Mechanical minus counted position after homing, per axis
+static int replay_offsets[AXIS_COUNT];
+
+static void replay_measure_offsets(const char *scenario)
+{
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+    const AxisConfig &limits = AXIS_CONFIGS[axis];
+    sim_set_mechanical_position(SIM_MARK_HI + (limits.max_pos - limits.min_pos) / 2, axis);
+    send_command(CMD_MOVE_TO_HOME, axis_param(axis, STEPPER_PARAM_UNUSED));
+    if (!run_until_all_idle(scenario, 60000000ULL) || !axes[axis].homed) fail(scenario, "axis %u did not home", axis);
+    replay_offsets[axis] = sim_mechanical_position(axis) - axes[axis].position;
+  }
+}
+
+// Boot the axis where its sync record says it rested
+static void replay_place(const TraceRecord &sync)
+{
+  StepperContext &axis = axes[sync.arg0];
+  step_engine_stop(axis.axis);
+  fsm_init(&axis, axis.axis);
+  sim_set_mechanical_position(sync.value + replay_offsets[axis.axis], axis.axis);
+  sim_sensor_sync(axis.axis);
+  bool homed = sync.arg2 & TRACE_SYNC_HOMED;
+  if (!homed || !fsm_restore_position(&axis, sync.value)) {
+    step_engine_set_position(axis.axis, sync.value);
+    axis.position = sync.value;
+    axis.homed = homed;
+  }
+  if (sync.arg2 & TRACE_SYNC_RELEASED) step_engine_release(axis.axis);
+}
+
+static bool replay_trace(const char *scenario, const std::vector<TraceRecord> &trace, ReplayReport &report)
+{
+  report = ReplayReport{};
+  // Each axis starts at its first sync record; what it did before that is not replayed
+  std::vector<ReplayWindow> windows;
+  bool live[AXIS_COUNT] = {};
+  for (size_t i = 0; i < trace.size(); ++i) {
+    const TraceRecord &r = trace[i];
+    if (r.type == TRACE_GAP) {
+      for (ReplayWindow &w : windows) {
+        if (w.to == trace.size()) w.to = i;
+      }
+      std::fill(live, live + AXIS_COUNT, false);
+      continue;
+    }
+    if (r.type != TRACE_SYNC) continue;
+    if (r.arg0 >= AXIS_COUNT) {
+      printf("%s: the capture has axis %u, this build drives %u\n", scenario, r.arg0, (unsigned)AXIS_COUNT);
+      return false;
+    }
+    if (!live[r.arg0]) windows.push_back({r.arg0, i, trace.size()});
+    live[r.arg0] = true;
+  }
+  if (windows.empty()) {
+    printf("%s: no sync record in the capture\n", scenario);
+    return false;
+  }
+  size_t first = windows.front().from;
+  replay_measure_offsets(scenario);
+  forget_frames();
+
+  std::vector<TraceRecord> replayed;
+  replay_log = &replayed;
+  const uint32_t t0 = trace[first].time_us;
+  const uint32_t end_us = trace.back().time_us - t0;
+  const uint64_t base_us = sim_now_us();
+  bool started[AXIS_COUNT] = {};
+  size_t next = first;
+  while (next < trace.size()) {
+    // Everything due by now goes in before the next motion task pass
+    while (next < trace.size() && base_us + (uint32_t)(trace[next].time_us - t0) <= sim_now_us()) {
+      size_t i = next++;
+      const TraceRecord &r = trace[i];
+      if (r.type == TRACE_GAP) {
+        printf("%s: %ld records lost at %.3fs; each axis resumes at its next sync record\n", scenario,
+               (long)r.value, (r.time_us - t0) / 1e6);
+        report.gaps++;
+        report.lost += (uint32_t)r.value;
+        std::fill(started, started + AXIS_COUNT, false);
+      }
+      if (r.type == TRACE_SYNC && !started[r.arg0]) {
+        replay_place(r);
+        started[r.arg0] = true;
+      }
+      if (r.type != TRACE_COMMAND) continue;
+      Message msg;
+      msg.messageId = r.arg0;
+      msg.command = (CommandType)r.arg1;
+      msg.param = r.value;
+      uint8_t axis = axis_from_param(msg.param);
+      if (msg.command == CMD_TRACE || (axis < AXIS_COUNT && !started[axis])) continue;
+      if (msg.command == CMD_RESET) {
+        printf("%s: capture continues past a CMD_RESET; replaying up to it\n", scenario);
+        next = trace.size();
+        break;
+      }
+      command_queue_push(msg);
+      report.commands++;
+    }
+    tick(scenario);
+  }
+  run_until_all_idle(scenario, 60000000ULL);
+  replay_log = nullptr;
+
+  std::vector<uint32_t> timing;
+  for (const ReplayWindow &w : windows) {
+    const uint8_t axis = w.axis;
+    const bool last = w.to == trace.size();
+    const uint32_t from_us = trace[w.from].time_us - t0;
+    const uint32_t to_us = last ? end_us : trace[w.to].time_us - t0;
+    std::vector<TraceRecord> captured;
+    std::vector<TraceRecord> made;
+    for (size_t i = w.from; i < w.to; ++i) {
+      if (trace[i].type == TRACE_STATE && trace[i].arg0 == axis) captured.push_back(trace[i]);
+    }
+    // What the replay did while a gap hid the axis is not compared either
+    for (const TraceRecord &r : replayed) {
+      uint32_t at_us = r.time_us - (uint32_t)base_us;
+      if (r.arg0 == axis && at_us >= from_us && (last || at_us < to_us)) made.push_back(r);
+    }
+    size_t k = 0;
+    for (; k < captured.size() && k < made.size(); ++k) {
+      const TraceRecord &c = captured[k];
+      const TraceRecord &m = made[k];
+      if (c.arg1 != m.arg1 || c.arg2 != m.arg2) break;
+      int64_t dt = (int64_t)(m.time_us - (uint32_t)base_us) - (int64_t)(c.time_us - t0);
+      timing.push_back((uint32_t)std::min<int64_t>(llabs(dt), UINT32_MAX));
+      report.position_max = std::max(report.position_max, abs(m.value - c.value));
+    }
+    report.matched += k;
+    report.missing += captured.size() - k;
+    // State changes after the capture ended are the replay finishing what was under way
+    size_t extra = 0;
+    for (size_t j = k; j < made.size(); ++j) {
+      if (made[j].time_us - (uint32_t)base_us <= to_us) extra++;
+    }
+    report.extra += extra;
+    if (k < captured.size() || extra) {
+      const TraceRecord *c = k < captured.size() ? &captured[k] : nullptr;
+      const TraceRecord *m = k < made.size() ? &made[k] : nullptr;
+      printf("%s: axis %u diverges at state change %zu after %.3fs: captured %d -> %d at %.3fs, replayed %d -> %d "
+             "at %.3fs\n",
+             scenario, axis, k + 1, from_us / 1e6, c ? c->arg1 : -1, c ? c->arg2 : -1,
+             c ? (c->time_us - t0) / 1e6 : 0.0, m ? m->arg1 : -1, m ? m->arg2 : -1,
+             m ? (m->time_us - (uint32_t)base_us) / 1e6 : 0.0);
+    }
+  }
+  if (!timing.empty()) {
+    std::sort(timing.begin(), timing.end());
+    report.timing_p50_us = timing[timing.size() / 2];
+    report.timing_max_us = timing.back();
+  }
+  forget_frames();
+  return true;
+}
+
+static void print_replay(const char *scenario, const ReplayReport &report)
+{
+  printf("%s: %zu commands, %zu state changes matched, %zu missing, %zu extra; timing divergence p50 %uus max %uus, "
+         "position divergence max %d steps\n",
+         scenario, report.commands, report.matched, report.missing, report.extra, report.timing_p50_us,
+         report.timing_max_us, report.position_max);
+  if (report.gaps) {
+    printf("%s: %zu gaps hide %lu records, not compared\n", scenario, report.gaps, (unsigned long)report.lost);
+  }
+}
+
+// `program replay <capture>`: exits non-zero when the replay makes other state changes than the capture
+static int run_replay(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    printf("replay: cannot open %s\n", path);
+    return 2;
+  }
+  std::string text;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0) text.append(buf, n);
+  fclose(file);
+  ReplayReport report;
+  if (!replay_trace("replay", parse_trace(text), report)) return 2;
+  print_replay("replay", report);
+  return report.missing || report.extra || failures ? 1 : 0;
+}
+
+// A move to the far end that arrives over the radio while the ring is printed, once
+static void trace_move_while_printing()
+{
+  sim_console_hook(nullptr);
+  const AxisConfig &limits = AXIS_CONFIGS[0];
+  bool low = axes[0].position < (limits.min_pos + limits.max_pos) / 2;
+  send_command(CMD_MOVE_TO, axis_param(0, low ? limits.max_pos : limits.min_pos));
+}
+
+// Capture a session through CMD_TRACE exactly as on target, replay it, and
+// expect the same state changes at the same times and positions. A move sent
+// while a dump mid-session prints is lost to the trace: the replay must flag
+// the gap rather than diverge.
+static void scenario_trace()
+{
+  const char *name = "trace";
+  std::string console;
+  sim_console_capture(&console);
+  run_until_all_idle(name, 60000000ULL);
+  send_command(CMD_TRACE, TRACE_PARAM_RESTART);
+  tick(name);
+  tick(name); // syncs at rest
+  if (console.find("trace end") == std::string::npos) fail(name, "CMD_TRACE printed nothing");
+  PulseDelays speeds_at_start[AXIS_COUNT];
+  std::copy(pulse_delays, pulse_delays + AXIS_COUNT, speeds_at_start);
+
+  // A session: moves retargeted mid-flight, jogs stopped at random, a speed change, waypoints
+  for (int i = 0; i < 40; ++i) {
+    if (i == 20) {
+      run_until_all_idle(name, 60000000ULL);
+      sim_console_hook(trace_move_while_printing);
+      send_command(CMD_TRACE);
+      for (int ms = 0; ms < 50; ++ms) tick(name); // the lost move gets under way
+    }
+    uint8_t axis = (uint8_t)random_int(0, AXIS_COUNT - 1);
+    const AxisConfig &limits = AXIS_CONFIGS[axis];
+    switch (random_int(0, 4)) {
+      case 0:
+      case 1:
+        send_command(CMD_MOVE_TO, axis_param(axis, random_int(limits.min_pos, limits.max_pos)));
+        break;
+      case 2:
+        send_command(random_int(0, 1) ? CMD_UP_MEDIUM : CMD_DOWN_FAST, axis_param(axis, STEPPER_PARAM_UNUSED));
+        break;
+      case 3:
+        send_command(CMD_STOP, axis_param(axis, STEPPER_PARAM_UNUSED));
+        break;
+      default:
+        send_command(CMD_MOVE_TO_PULSE_DELAY, axis_param(axis, random_int(20, 60)));
+        send_command(CMD_WAYPOINT, axis_param(axis, random_int(limits.min_pos, limits.max_pos)));
+        break;
+    }
+    int wait_ms = random_int(1, 400);
+    for (int ms = 0; ms < wait_ms; ++ms) tick(name);
+  }
+  run_until_all_idle(name, 60000000ULL);
+  console.clear();
+  send_command(CMD_TRACE);
+  tick(name);
+  sim_console_capture(nullptr);
+
+  std::vector<TraceRecord> trace = parse_trace(console);
+  unsigned count = 0;
+  unsigned long overwritten = 0;
+  size_t begin = console.find("trace begin");
+  if (begin == std::string::npos || sscanf(console.c_str() + begin, "trace begin %u %lu", &count, &overwritten) != 2 ||
+      count != trace.size()) {
+    fail(name, "dump header says %u records, %zu parsed", count, trace.size());
+  }
+  // The replay starts from the speeds the session started with
+  std::copy(speeds_at_start, speeds_at_start + AXIS_COUNT, pulse_delays);
+  ReplayReport report;
+  if (!replay_trace(name, trace, report)) {
+    fail(name, "capture not replayable");
+  } else if (report.missing || report.extra || report.position_max || report.timing_max_us) {
+    fail(name, "replay diverged: %zu missing, %zu extra, timing max %uus, position max %d", report.missing,
+         report.extra, report.timing_max_us, report.position_max);
+  } else if (report.gaps != 1 || report.lost == 0) {
+    fail(name, "%zu gaps hiding %lu records, expected the mid-session dump's", report.gaps, (unsigned long)report.lost);
+  }
+  print_replay(name, report);
+  std::copy(speeds_at_start, speeds_at_start + AXIS_COUNT, pulse_delays);
+  home(name);
+}
+
+// Idle power: resting axes release their motors after the quiet period and the
+// clock drops once all are released. A command brings the clock back before it
+// runs, and a move from a released motor starts within the enable setup time
+// without losing a step.
+static void scenario_power()
+{
+  const char *name = "power";
+  const uint32_t quiet_ms = 200;
+  const int runs = 20;
+  const uint32_t full_mhz = hal_cpu_mhz();
+  power_set_quiet_ms(quiet_ms);
+  home(name);
+  run_until_all_idle(name, 60000000ULL);
+  int offset = mechanical_offset();
+  perf_reset();
+  uint64_t slowest_us = 0;
+  for (int run = 0; run < runs; ++run) {
+    for (uint32_t ms = 0; ms < quiet_ms + 10; ++ms) tick(name);
+    for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+      if (!step_engine_released(axis)) fail(name, "axis %u not released after %u ms at rest", axis, quiet_ms);
+    }
+    if (!power_parked() || hal_cpu_mhz() != POWER_IDLE_CPU_MHZ) fail(name, "clock at %u MHz", hal_cpu_mhz());
+    if (run % 4 == 0) {
+      // A command that moves nothing runs at the full clock and parks again in the same pass
+      send_command(CMD_GET_POSITION);
+      tick(name);
+      if (!step_engine_released(0) || !power_parked()) fail(name, "CMD_GET_POSITION woke the motor");
+    }
+    uint32_t steps_before = step_engine_step_count(0);
+    uint64_t sent_us = sim_now_us();
+    int target = random_int(STEPPER_POSITION_MIN + 1, STEPPER_POSITION_MAX);
+    if (target == ctx.position) target--;
+    send_command(CMD_MOVE_TO, target);
+    tick(name);
+    if (hal_cpu_mhz() != full_mhz || step_engine_released(0)) fail(name, "move did not wake axis 0");
+    while (step_engine_step_count(0) == steps_before && sim_now_us() - sent_us < 100000) tick(name);
+    uint32_t rise_us;
+    step_engine_last_step(0, rise_us);
+    slowest_us = std::max(slowest_us, (uint64_t)(rise_us - (uint32_t)sent_us));
+    if (!run_until_idle(name, 30000000ULL) || ctx.position != target) fail(name, "move to %d after wake", target);
+    if (mechanical_offset() != offset) fail(name, "lost %d steps after a wake", mechanical_offset() - offset);
+  }
+  // Radio to first step: one motion pass plus the enable setup time
+  if (slowest_us > SIM_TICK_US + STEP_ENGINE_ENABLE_SETUP_US) {
+    fail(name, "first step %lluus after the command", (unsigned long long)slowest_us);
+  }
+  PerfHistogram wake = perf_snapshot(PERF_WAKE);
+  if (wake.count != (uint32_t)runs || wake.max_ns > STEP_ENGINE_ENABLE_SETUP_US * 1000U) {
+    fail(name, "%u wakes recorded, slowest %uns", wake.count, wake.max_ns);
+  }
+
+  // Quiet period 0: the motors stay energised
+  power_set_quiet_ms(0);
+  move_and_settle(name, STEPPER_POSITION_MAX / 2);
+  for (int ms = 0; ms < 1000; ++ms) tick(name);
+  if (step_engine_released(0) || power_parked()) fail(name, "released with the policy off");
+  power_set_quiet_ms(IDLE_POWER_QUIET_MS);
+  forget_frames();
+  printf("power: %d wakes, first step at most %lluus after the command\n", runs, (unsigned long long)slowest_us);
+}
+
+// setup() on target
+static void init_axes()
+{
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+    step_engine_init(axis);
+    fsm_init(&axes[axis], axis);
+  }
+  power_init(hal_millis());
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    hal_nvs_begin("stepper");
+    config_load();
+    init_axes();
+    return run_benchmarks();
+  }
+  if (argc > 2 && strcmp(argv[1], "replay") == 0) {
+    hal_nvs_begin("stepper");
+    config_load();
+    sim_set_home_mark(SIM_MARK_LO, SIM_MARK_HI);
+    init_axes();
+    return run_replay(argv[2]);
+  }
+  unsigned seed = argc > 1 ? (unsigned)strtoul(argv[1], nullptr, 0) : 1;
+  int move_count = argc > 2 ? atoi(argv[2]) : 5000;
+  rng.seed(seed);
+
+  hal_nvs_begin("stepper");
+  // Boot against NVS written by older firmware: migrates once, then loads the blob
+  hal_nvs_put_long("slowPD", 40);
+  hal_nvs_put_long("fast_pd", 10);
+  if (config_load() != CONFIG_MIGRATED || config_load() != CONFIG_FROM_BLOB || speeds.slow_pd != 40 ||
+      speeds.fast_pd != 10) {
+    fail("config", "legacy key migration");
+  }
+  sim_set_home_mark(SIM_MARK_LO, SIM_MARK_HI);
+  tuning_load();
+  init_axes();
+
+  auto wall_start = std::chrono::steady_clock::now();
+  scenario_homing();
+  scenario_move_to(move_count);
+  scenario_jog_stop();
+  scenario_scrub();
+  scenario_waypoints();
+  scenario_velocity();
+  scenario_axes();
+  scenario_perf_report();
+  scenario_latency();
+  scenario_profile();
+  scenario_tuning();
+  scenario_trace();
+  scenario_power();
+  scenario_batch();
+  scenario_config();
+  scenario_journal();
+  scenario_transitions();
+  double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+  CommandQueueStats q = command_queue_stats();
+  printf("seed=%u moves=%llu ticks=%llu simulated=%.1fs wall=%.2fs (%.0f moves/s) queue_overflows=%u\n", seed,
+         (unsigned long long)moves, (unsigned long long)ticks, sim_now_us() / 1e6, wall_s,
+         wall_s > 0 ? moves / wall_s : 0.0, q.normal_overflows + q.priority_overflows);
+  int legal = 0;
+  int seen = 0;
+  for (uint8_t from = 0; from < STATE_COUNT; ++from) {
+    for (uint8_t to = 0; to < STATE_COUNT; ++to) {
+      if (from == to || !fsm_transition_legal((StepperState)from, (StepperState)to)) continue;
+      legal++;
+      if (seen_transitions[from] & fsm_state_bit((StepperState)to)) seen++;
+    }
+  }
+  printf("transitions exercised: %d of %d legal\n", seen, legal);
+  if (failures) {
+    printf("%d invariant failure(s)\n", failures);
+    return 1;
+  }
+  printf("all invariants held\n");
+  return 0;
+}
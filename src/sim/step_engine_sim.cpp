@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include "step_engine.h"
+#include "motion_planner.h"
+#include "axis.h"
+#include "sim.h"
+
+// Host model of step_engine.cpp: the same modes, planner and limit handling, with
+// rising edges scheduled on the simulated clock instead of a hardware timer.
+// The modelled rotor follows the step train only as fast as the ramp allows: a
+// slow-down of more than one ramp step, or a reversal or end of motion above the
+// slowest ramp rate, lets it run on by the ramp steps that were skipped, so the
+// scenarios' lost-step checks see it. step_engine_stop() is taken as exact.
+
+enum EngineMode : uint8_t {
+  MODE_RUN_BOUNDED,
+  MODE_RUN_UNBOUNDED,
+  MODE_MOVE_TO,
+  MODE_STOP // ramping down; target holds the step count to stop at
+};
+
+struct Engine {
+  int limit_min;
+  int limit_max;
+  int32_t position;
+  int32_t target;
+  int32_t mechanical_position;
+  uint32_t step_count;
+  uint64_t last_rise_us;
+  uint32_t half_period_us;
+  bool running;
+  bool dir;
+  bool released;
+  EngineMode mode;
+  MotionRamp ramp;
+  bool pending; // leg held back while ramping down for a reversal
+  EngineMode pending_mode;
+  bool pending_dir;
+  int32_t pending_target;
+  uint32_t pending_cruise;
+  uint32_t motor_half_us; // the rotor's pace at its last step, 0 = at rest
+  bool motor_dir;
+  uint64_t next_edge_us;
+  bool capture_armed;
+  bool capture_valid;
+  int32_t capture_position;
+  uint32_t capture_step_count;
+};
+
+static Engine engines[AXIS_COUNT];
+
+static uint32_t steps_remaining(const Engine &e)
+{
+  switch (e.mode) {
+    case MODE_MOVE_TO:
+      return (uint32_t)abs(e.target - e.position);
+    case MODE_RUN_BOUNDED:
+      return (uint32_t)std::max(0, e.dir ? e.limit_max - e.position : e.position - e.limit_min);
+    case MODE_STOP:
+      return (uint32_t)e.target - e.step_count;
+    case MODE_RUN_UNBOUNDED:
+    default:
+      return MOTION_UNBOUNDED;
+  }
+}
+
+// The rotor moves on to a step at half_us (0 = stop). Returns the steps it runs
+// past the step train: the ramp steps it would have needed to slow down.
+static int32_t motor_follow(Engine &e, uint32_t half_us)
+{
+  if (!e.motor_half_us) return 0;
+  int32_t pace = planner_cruise_index(e.motor_half_us);
+  int32_t next = half_us ? (int32_t)planner_cruise_index(half_us) : -1;
+  if (pace == 0 || (half_us && half_us <= MOTION_RAMP_HALF_PERIOD_US[pace - 1])) return 0;
+  int32_t lost = std::max(1, pace - 1 - next);
+  return e.motor_dir ? lost : -lost;
+}
+
+static void motor_stop(Engine &e)
+{
+  e.mechanical_position += motor_follow(e, 0);
+  e.motor_half_us = 0;
+}
+
+// Same as begin_pending_locked() in step_engine.cpp
+static bool begin_pending(Engine &e)
+{
+  e.pending = false;
+  e.mode = e.pending_mode;
+  e.target = e.pending_target;
+  e.dir = e.mode == MODE_MOVE_TO ? e.target > e.position : e.pending_dir;
+  if (steps_remaining(e) == 0) return false;
+  planner_begin(e.ramp, e.pending_cruise);
+  e.half_period_us = 0;
+  e.next_edge_us += STEP_ENGINE_DIR_SETUP_US;
+  return true;
+}
+
+static void advance_axis(uint8_t axis, uint64_t now_us)
+{
+  Engine &e = engines[axis];
+  while (e.running && e.next_edge_us <= now_us) {
+    uint32_t remaining = steps_remaining(e);
+    if (remaining == 0) {
+      motor_stop(e);
+      if (!e.pending || !begin_pending(e)) e.running = false;
+      continue;
+    }
+    e.half_period_us = planner_next_half_period(e.ramp, remaining);
+    int step = e.dir ? 1 : -1;
+    e.position = std::min(std::max(e.position + step, (int32_t)e.limit_min), (int32_t)e.limit_max);
+    if (!e.released) {
+      // A released motor does not turn
+      if (e.motor_half_us && e.dir != e.motor_dir) motor_stop(e);
+      e.mechanical_position += motor_follow(e, e.half_period_us) + step;
+      e.motor_half_us = e.half_period_us;
+      e.motor_dir = e.dir;
+    }
+    e.step_count++;
+    e.last_rise_us = e.next_edge_us;
+    sim_sensor_update(axis); // may run the sensor edge interrupt
+    e.next_edge_us += 2 * (uint64_t)e.half_period_us;
+  }
+}
+
+void sim_step_engine_advance(uint64_t now_us)
+{
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) advance_axis(axis, now_us);
+}
+
+int sim_mechanical_position(uint8_t axis)
+{
+  return engines[axis].mechanical_position;
+}
+
+void sim_set_mechanical_position(int pos, uint8_t axis)
+{
+  engines[axis].mechanical_position = pos;
+  sim_sensor_sync(axis);
+}
+
+static void engine_start(uint8_t axis, EngineMode mode, bool dir, long pulse_delay, int target)
+{
+  Engine &e = engines[axis];
+  uint32_t cruise = (uint32_t)std::max((long)STEP_ENGINE_MIN_HALF_PERIOD_US, pulse_delay);
+  e.pending = false;
+  if (e.running) {
+    if (e.dir == dir && (mode != MODE_MOVE_TO || (uint32_t)abs(target - e.position) > e.ramp.index)) {
+      e.mode = mode;
+      e.target = target;
+      planner_set_cruise(e.ramp, cruise);
+    } else {
+      step_engine_decelerate(axis);
+      e.pending_mode = mode;
+      e.pending_dir = dir;
+      e.pending_target = target;
+      e.pending_cruise = cruise;
+      e.pending = true;
+    }
+    return;
+  }
+  if (mode == MODE_MOVE_TO && target == e.position) return;
+  e.mode = mode;
+  e.target = target;
+  planner_begin(e.ramp, cruise);
+  uint32_t setup_us = e.released ? STEP_ENGINE_ENABLE_SETUP_US : STEP_ENGINE_DIR_SETUP_US;
+  e.released = false;
+  e.dir = dir;
+  e.running = true;
+  e.half_period_us = 0; // no step rate until the first step
+  e.next_edge_us = sim_now_us() + setup_us;
+}
+
+void step_engine_init(uint8_t axis)
+{
+  engines[axis].limit_min = AXIS_CONFIGS[axis].min_pos;
+  engines[axis].limit_max = AXIS_CONFIGS[axis].max_pos;
+}
+
+void step_engine_run(uint8_t axis, long pulse_delay, bool dir, bool bounded)
+{
+  engine_start(axis, bounded ? MODE_RUN_BOUNDED : MODE_RUN_UNBOUNDED, dir, pulse_delay, 0);
+}
+
+void step_engine_move_to(uint8_t axis, int target, long pulse_delay)
+{
+  Engine &e = engines[axis];
+  target = std::min(std::max(target, e.limit_min), e.limit_max);
+  engine_start(axis, MODE_MOVE_TO, target > e.position, pulse_delay, target);
+}
+
+void step_engine_stop(uint8_t axis)
+{
+  engines[axis].running = false;
+  engines[axis].pending = false;
+  engines[axis].motor_half_us = 0;
+}
+
+bool step_engine_release(uint8_t axis)
+{
+  Engine &e = engines[axis];
+  if (!e.running) e.released = true;
+  return e.released;
+}
+
+bool step_engine_released(uint8_t axis)
+{
+  return engines[axis].released;
+}
+
+void step_engine_decelerate(uint8_t axis)
+{
+  Engine &e = engines[axis];
+  if (!e.running) return;
+  e.pending = false;
+  uint32_t distance = e.ramp.index + 1U;
+  e.target = (int32_t)(e.step_count + std::min(steps_remaining(e), distance));
+  e.mode = MODE_STOP;
+}
+
+bool step_engine_running(uint8_t axis)
+{
+  return engines[axis].running;
+}
+
+bool step_engine_direction(uint8_t axis)
+{
+  return engines[axis].dir;
+}
+
+int step_engine_position(uint8_t axis)
+{
+  return engines[axis].position;
+}
+
+uint32_t step_engine_step_rate(uint8_t axis)
+{
+  const Engine &e = engines[axis];
+  if (!e.running || e.half_period_us == 0) return 0;
+  return 500000UL / e.half_period_us;
+}
+
+uint32_t step_engine_step_count(uint8_t axis)
+{
+  return engines[axis].step_count;
+}
+
+uint32_t step_engine_last_step(uint8_t axis, uint32_t &rise_us)
+{
+  rise_us = (uint32_t)engines[axis].last_rise_us;
+  return engines[axis].step_count;
+}
+
+void step_engine_set_position(uint8_t axis, int pos)
+{
+  engines[axis].position = pos;
+}
+
+void step_engine_capture_arm(uint8_t axis)
+{
+  engines[axis].capture_valid = false;
+  engines[axis].capture_armed = true;
+}
+
+template <size_t AXIS>
+static void on_capture_edge()
+{
+  Engine &e = engines[AXIS];
+  if (!e.capture_armed) return;
+  e.capture_position = e.position;
+  e.capture_step_count = e.step_count;
+  e.capture_valid = true;
+  e.capture_armed = false;
+}
+
+template <size_t... AXES>
+static constexpr std::array<void (*)(), AXIS_COUNT> capture_isrs(std::index_sequence<AXES...>)
+{
+  return {{&on_capture_edge<AXES>...}};
+}
+
+void (*step_engine_capture_isr(uint8_t axis))()
+{
+  static constexpr std::array<void (*)(), AXIS_COUNT> isrs = capture_isrs(std::make_index_sequence<AXIS_COUNT>());
+  return isrs[axis];
+}
+
+bool step_engine_captured(uint8_t axis, int &position, uint32_t &step_count)
+{
+  position = engines[axis].capture_position;
+  step_count = engines[axis].capture_step_count;
+  return engines[axis].capture_valid;
+}
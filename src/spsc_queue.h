@@ -0,0 +1,72 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Lock-free single-producer / single-consumer ring buffer.
+// push() must only be called from one context (e.g. the Wi-Fi task) and pop()
+// from one other (e.g. the motion task). head_ is written only by the producer,
+// tail_ only by the consumer; release/acquire on those indices publishes the slot
+// contents. Full pushes are counted as overflows instead of blocking.
+template <typename T, size_t N>
+class SpscQueue {
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+public:
+  bool push(const T &item)
+  {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    uint32_t used = head - tail;
+    if (used >= N) {
+      overflows_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    buf_[head & (N - 1)] = item;
+    head_.store(head + 1, std::memory_order_release);
+    if (used + 1 > high_water_.load(std::memory_order_relaxed)) {
+      high_water_.store(used + 1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  bool pop(T &item)
+  {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    uint32_t head = head_.load(std::memory_order_acquire);
+    if (head == tail) return false;
+    item = buf_[tail & (N - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side: look at the oldest entry without removing it
+  bool peek(T &item) const
+  {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    uint32_t head = head_.load(std::memory_order_acquire);
+    if (head == tail) return false;
+    item = buf_[tail & (N - 1)];
+    return true;
+  }
+
+  // Producer-side sequence number of the next push; consumers compare it
+  // against read_index() to tell which entries were queued before a point in time
+  uint32_t write_index() const { return head_.load(std::memory_order_acquire); }
+  uint32_t read_index() const { return tail_.load(std::memory_order_relaxed); }
+
+  size_t size() const
+  {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+  static constexpr size_t capacity() { return N; }
+  uint32_t overflow_count() const { return overflows_.load(std::memory_order_relaxed); }
+  uint32_t high_water() const { return high_water_.load(std::memory_order_relaxed); }
+
+private:
+  T buf_[N];
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+  std::atomic<uint32_t> overflows_{0};
+  std::atomic<uint32_t> high_water_{0};
+};
@@ -0,0 +1,389 @@
+#include <Arduino.h>
+#include <array>
+#include <utility>
+#include "step_engine.h"
+#include "motion_planner.h"
+#include "perf_stats.h"
+#include "axis.h"
+
+// Hardware timers at 80 MHz / 80 = 1 tick per microsecond
+constexpr uint16_t STEP_TIMER_DIVIDER = 80;
+
+enum EngineMode : uint8_t {
+  MODE_RUN_BOUNDED,
+  MODE_RUN_UNBOUNDED,
+  MODE_MOVE_TO,
+  MODE_STOP // ramping down; target holds the step count to stop at
+};
+
+// Per-axis state, shared with that axis' ISR; multi-field updates happen under mux
+struct Engine {
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  hw_timer_t *timer = nullptr;
+  int limit_min = 0;
+  int limit_max = 0;
+  volatile int32_t position = 0;
+  volatile int32_t target = 0;
+  volatile uint32_t step_count = 0;
+  volatile uint32_t half_period_us = 0;
+  volatile bool running = false;
+  volatile bool dir = true;
+  volatile bool pulse_high = false;
+  volatile bool released = false; // ENA holds the driver disabled
+  volatile EngineMode mode = MODE_RUN_BOUNDED;
+  MotionRamp ramp = {};
+  // Leg held back while the engine ramps down for a reversal; the ISR starts it
+  // from rest where the engine stops
+  volatile bool pending = false;
+  EngineMode pending_mode = MODE_RUN_BOUNDED;
+  bool pending_dir = true;
+  int32_t pending_target = 0;
+  uint32_t pending_cruise = 0;
+  // Jitter probe and step rate: cycle count of the last rising edge and the
+  // interval planned to the next one (0 = first edge of a motion)
+  uint32_t last_rise_cycles = 0;
+  volatile uint32_t planned_rise_us = 0;
+  uint32_t last_rise_us = 0; // for step_engine_last_step()
+  // Homing edge latch, written by the sensor GPIO interrupt
+  volatile bool capture_armed = false;
+  volatile bool capture_valid = false;
+  int32_t capture_position = 0;
+  uint32_t capture_step_count = 0;
+};
+
+static Engine engines[AXIS_COUNT];
+
+// Steps left before the engine must stop (0 = stop now)
+static inline uint32_t IRAM_ATTR steps_remaining(const Engine &e)
+{
+  switch (e.mode) {
+    case MODE_MOVE_TO:
+      return (uint32_t)abs(e.target - e.position);
+    case MODE_RUN_BOUNDED:
+      return (uint32_t)max(0, e.dir ? e.limit_max - e.position : e.position - e.limit_min);
+    case MODE_STOP:
+      return (uint32_t)e.target - e.step_count;
+    case MODE_RUN_UNBOUNDED:
+    default:
+      return MOTION_UNBOUNDED;
+  }
+}
+
+// Caller must hold e.mux. Stop after the index+1 steps the ramp needs to walk
+// back down, counted in steps: an unbounded run may sit clamped at a soft limit.
+// Never moves the end of the motion further away, so repeated calls converge.
+static inline void IRAM_ATTR stop_ahead_locked(Engine &e)
+{
+  uint32_t distance = e.ramp.index + 1U;
+  uint32_t remaining = steps_remaining(e);
+  e.target = (int32_t)(e.step_count + (remaining < distance ? remaining : distance));
+  e.mode = MODE_STOP;
+}
+
+// Caller must hold e.mux. Start the pending leg from rest; false when it has no
+// steps to take from here.
+static inline bool IRAM_ATTR begin_pending_locked(Engine &e, uint8_t dir_pin)
+{
+  e.pending = false;
+  e.mode = e.pending_mode;
+  e.target = e.pending_target;
+  e.dir = e.mode == MODE_MOVE_TO ? e.target > e.position : e.pending_dir;
+  if (steps_remaining(e) == 0) return false;
+  planner_begin(e.ramp, e.pending_cruise);
+  digitalWrite(dir_pin, e.dir);
+  e.half_period_us = STEP_ENGINE_DIR_SETUP_US;
+  e.planned_rise_us = 0;
+  return true;
+}
+
+// Caller must hold e.mux
+static inline void IRAM_ATTR record_step_jitter(Engine &e, uint32_t now_cycles)
+{
+  if (e.planned_rise_us) {
+    uint32_t actual_ns = (uint32_t)((uint64_t)(now_cycles - e.last_rise_cycles) * 1000U / hal_cycles_per_us());
+    uint32_t planned_ns = e.planned_rise_us * 1000U;
+    perf_record_ns(PERF_STEP_JITTER, actual_ns > planned_ns ? actual_ns - planned_ns : planned_ns - actual_ns);
+  }
+  e.last_rise_cycles = now_cycles;
+}
+
+// Each alarm is one half-pulse: rising edge (counts a step) then falling edge.
+// The step period is chosen by the planner on every rising edge. One instance
+// per axis, with that axis' pins as constants.
+template <size_t AXIS>
+static void IRAM_ATTR on_step_timer()
+{
+  constexpr uint8_t step_pin = AXIS_CONFIGS[AXIS].step_pin;
+  constexpr uint8_t dir_pin = AXIS_CONFIGS[AXIS].dir_pin;
+  Engine &e = engines[AXIS];
+  uint32_t perf_start = perf_begin();
+  portENTER_CRITICAL_ISR(&e.mux);
+  uint32_t remaining;
+  if (e.pulse_high) {
+    digitalWrite(step_pin, LOW);
+    e.pulse_high = false;
+  } else if (e.running && (remaining = steps_remaining(e)) > 0) {
+    if (PERF_STATS) record_step_jitter(e, perf_start);
+    e.half_period_us = planner_next_half_period(e.ramp, remaining);
+    e.planned_rise_us = 2 * e.half_period_us;
+    digitalWrite(step_pin, HIGH);
+    e.pulse_high = true;
+    int32_t next = e.position + (e.dir ? 1 : -1);
+    e.position = constrain(next, e.limit_min, e.limit_max);
+    e.step_count++;
+    e.last_rise_us = micros();
+  } else if (e.running && e.pending && begin_pending_locked(e, dir_pin)) {
+    // At rest after ramping down: the next edge starts the new leg after the DIR setup time
+  } else {
+    timerAlarmDisable(e.timer);
+    e.running = false;
+  }
+  timerAlarmWrite(e.timer, e.half_period_us, true);
+  portEXIT_CRITICAL_ISR(&e.mux);
+  perf_end(PERF_STEP_ISR, perf_start);
+}
+
+template <size_t AXIS>
+static void IRAM_ATTR on_capture_edge()
+{
+  Engine &e = engines[AXIS];
+  portENTER_CRITICAL_ISR(&e.mux);
+  if (e.capture_armed) {
+    e.capture_position = e.position;
+    e.capture_step_count = e.step_count;
+    e.capture_valid = true;
+    e.capture_armed = false;
+  }
+  portEXIT_CRITICAL_ISR(&e.mux);
+}
+
+using EngineIsr = void (*)();
+
+template <size_t... AXES>
+static constexpr std::array<EngineIsr, AXIS_COUNT> step_timer_isrs(std::index_sequence<AXES...>)
+{
+  return {{&on_step_timer<AXES>...}};
+}
+
+template <size_t... AXES>
+static constexpr std::array<EngineIsr, AXIS_COUNT> capture_isrs(std::index_sequence<AXES...>)
+{
+  return {{&on_capture_edge<AXES>...}};
+}
+
+static constexpr std::array<EngineIsr, AXIS_COUNT> STEP_TIMER_ISRS =
+    step_timer_isrs(std::make_index_sequence<AXIS_COUNT>());
+static constexpr std::array<EngineIsr, AXIS_COUNT> CAPTURE_ISRS = capture_isrs(std::make_index_sequence<AXIS_COUNT>());
+
+static inline uint32_t half_period_from_pd(long pulse_delay)
+{
+  return (uint32_t)max((long)STEP_ENGINE_MIN_HALF_PERIOD_US, pulse_delay);
+}
+
+// Caller must hold e.mux
+static void engine_halt_locked(Engine &e, uint8_t step_pin)
+{
+  timerAlarmDisable(e.timer);
+  if (e.pulse_high) {
+    digitalWrite(step_pin, LOW);
+    e.pulse_high = false;
+  }
+  e.running = false;
+  e.pending = false;
+  e.planned_rise_us = 0;
+}
+
+static void engine_start(uint8_t axis, EngineMode mode, bool dir, long pulse_delay, int target)
+{
+  Engine &e = engines[axis];
+  if (!e.timer) return;
+  const AxisConfig &config = AXIS_CONFIGS[axis];
+  uint32_t cruise = half_period_from_pd(pulse_delay);
+  portENTER_CRITICAL(&e.mux);
+  e.pending = false;
+  if (e.running) {
+    // The planner needs index+1 steps to stop
+    if (e.dir == dir && (mode != MODE_MOVE_TO || (uint32_t)abs(target - e.position) > e.ramp.index)) {
+      // Same direction: keep the current speed and let the planner converge on
+      // the new cruise rate / decelerate into the new target
+      e.mode = mode;
+      e.target = target;
+      planner_set_cruise(e.ramp, cruise);
+    } else {
+      // A reversal, or a target inside the stopping distance: ramp down past it
+      // and come back from rest (on_step_timer())
+      stop_ahead_locked(e);
+      e.pending_mode = mode;
+      e.pending_dir = dir;
+      e.pending_target = target;
+      e.pending_cruise = cruise;
+      e.pending = true;
+    }
+    portEXIT_CRITICAL(&e.mux);
+    return;
+  }
+  if (mode == MODE_MOVE_TO && target == e.position) {
+    portEXIT_CRITICAL(&e.mux);
+    return;
+  }
+  e.mode = mode;
+  e.target = target;
+  engine_halt_locked(e, config.step_pin);
+  planner_begin(e.ramp, cruise);
+  // The driver samples DIR on STEP edges, so DIR may follow ENA at once as long
+  // as the first edge waits for the enable setup time
+  uint32_t setup_us = e.released ? STEP_ENGINE_ENABLE_SETUP_US : STEP_ENGINE_DIR_SETUP_US;
+  if (e.released) {
+    digitalWrite(config.enable_pin, !STEPPER_ENA_RELEASE_LEVEL);
+    e.released = false;
+  }
+  e.dir = dir;
+  digitalWrite(config.dir_pin, dir);
+  e.running = true;
+  e.half_period_us = setup_us;
+  timerWrite(e.timer, 0);
+  timerAlarmWrite(e.timer, setup_us, true);
+  timerAlarmEnable(e.timer);
+  portEXIT_CRITICAL(&e.mux);
+}
+
+void step_engine_init(uint8_t axis)
+{
+  Engine &e = engines[axis];
+  const AxisConfig &config = AXIS_CONFIGS[axis];
+  e.limit_min = config.min_pos;
+  e.limit_max = config.max_pos;
+  pinMode(config.step_pin, OUTPUT);
+  pinMode(config.dir_pin, OUTPUT);
+  digitalWrite(config.step_pin, LOW);
+  pinMode(config.enable_pin, OUTPUT);
+  digitalWrite(config.enable_pin, !STEPPER_ENA_RELEASE_LEVEL);
+
+  e.timer = timerBegin(config.timer, STEP_TIMER_DIVIDER, true);
+  timerAttachInterrupt(e.timer, STEP_TIMER_ISRS[axis], true);
+  timerAlarmDisable(e.timer);
+}
+
+void step_engine_run(uint8_t axis, long pulse_delay, bool dir, bool bounded)
+{
+  engine_start(axis, bounded ? MODE_RUN_BOUNDED : MODE_RUN_UNBOUNDED, dir, pulse_delay, 0);
+}
+
+void step_engine_move_to(uint8_t axis, int target, long pulse_delay)
+{
+  Engine &e = engines[axis];
+  target = constrain(target, e.limit_min, e.limit_max);
+  // A running engine already there ramps down past the target and comes back
+  engine_start(axis, MODE_MOVE_TO, target > e.position, pulse_delay, target);
+}
+
+void step_engine_stop(uint8_t axis)
+{
+  Engine &e = engines[axis];
+  if (!e.timer) return;
+  portENTER_CRITICAL(&e.mux);
+  engine_halt_locked(e, AXIS_CONFIGS[axis].step_pin);
+  portEXIT_CRITICAL(&e.mux);
+}
+
+bool step_engine_release(uint8_t axis)
+{
+  Engine &e = engines[axis];
+  if (!e.timer) return false;
+  portENTER_CRITICAL(&e.mux);
+  if (!e.running && !e.released) {
+    digitalWrite(AXIS_CONFIGS[axis].enable_pin, STEPPER_ENA_RELEASE_LEVEL);
+    e.released = true;
+  }
+  bool released = e.released;
+  portEXIT_CRITICAL(&e.mux);
+  return released;
+}
+
+bool step_engine_released(uint8_t axis)
+{
+  return engines[axis].released;
+}
+
+void step_engine_decelerate(uint8_t axis)
+{
+  Engine &e = engines[axis];
+  portENTER_CRITICAL(&e.mux);
+  if (e.running) {
+    e.pending = false; // a reversal in progress ends at rest instead
+    stop_ahead_locked(e);
+  }
+  portEXIT_CRITICAL(&e.mux);
+}
+
+bool step_engine_running(uint8_t axis)
+{
+  return engines[axis].running;
+}
+
+bool step_engine_direction(uint8_t axis)
+{
+  return engines[axis].dir;
+}
+
+int step_engine_position(uint8_t axis)
+{
+  return engines[axis].position;
+}
+
+uint32_t step_engine_step_rate(uint8_t axis)
+{
+  const Engine &e = engines[axis];
+  // Not half_period_us: before the first step that is the DIR setup delay
+  uint32_t rise = e.planned_rise_us;
+  if (!e.running || rise == 0) return 0;
+  return 1000000UL / rise;
+}
+
+uint32_t step_engine_step_count(uint8_t axis)
+{
+  return engines[axis].step_count;
+}
+
+uint32_t step_engine_last_step(uint8_t axis, uint32_t &rise_us)
+{
+  Engine &e = engines[axis];
+  portENTER_CRITICAL(&e.mux);
+  uint32_t count = e.step_count;
+  rise_us = e.last_rise_us;
+  portEXIT_CRITICAL(&e.mux);
+  return count;
+}
+
+void step_engine_set_position(uint8_t axis, int pos)
+{
+  Engine &e = engines[axis];
+  portENTER_CRITICAL(&e.mux);
+  e.position = pos;
+  portEXIT_CRITICAL(&e.mux);
+}
+
+void step_engine_capture_arm(uint8_t axis)
+{
+  Engine &e = engines[axis];
+  portENTER_CRITICAL(&e.mux);
+  e.capture_valid = false;
+  e.capture_armed = true;
+  portEXIT_CRITICAL(&e.mux);
+}
+
+void (*step_engine_capture_isr(uint8_t axis))()
+{
+  return CAPTURE_ISRS[axis];
+}
+
+bool step_engine_captured(uint8_t axis, int &position, uint32_t &step_count)
+{
+  Engine &e = engines[axis];
+  portENTER_CRITICAL(&e.mux);
+  bool valid = e.capture_valid;
+  position = e.capture_position;
+  step_count = e.capture_step_count;
+  portEXIT_CRITICAL(&e.mux);
+  return valid;
+}
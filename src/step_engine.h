@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+
+// Hardware-timed step pulse generator, one per axis (axis.h).
+// A hardware timer ISR emits the STEP edges in the background, so the FSM only
+// sets a rate, a direction and (for move-to) a target. Position is counted in the
+// ISR on every rising edge. Every motion ramps up from rest and decelerates into
+// its target or soft limit (see motion_planner.h); pulse_delay is the cruise rate.
+// Each axis has its own timer and ISR instance, so axes step concurrently and
+// independently.
+
+// Minimum half-pulse width the DM542 accepts reliably (microseconds)
+constexpr uint32_t STEP_ENGINE_MIN_HALF_PERIOD_US = 3;
+// DIR must be stable this long before the first STEP edge (DM542 datasheet: 5us)
+constexpr uint32_t STEP_ENGINE_DIR_SETUP_US = 5;
+// First STEP edge after a released motor is enabled again: ENA leads DIR by 5us,
+// and the winding current needs a few hundred microseconds to build up
+constexpr uint32_t STEP_ENGINE_ENABLE_SETUP_US = 1000;
+
+// Level on an axis' enable_pin that releases the motor. With ENA+ on the pin and
+// ENA- on GND a HIGH disables the DM542; an unconnected ENA keeps it enabled.
+#ifndef STEPPER_ENA_RELEASE_LEVEL
+#define STEPPER_ENA_RELEASE_LEVEL 1
+#endif
+
+// Configure the axis' pins, soft limits and step timer from its AxisConfig
+void step_engine_init(uint8_t axis);
+
+// Step continuously at pulse_delay (microseconds per half-pulse) in direction dir.
+// When bounded, the engine stops itself at the soft limit; when unbounded (homing)
+// it keeps stepping and the position is clamped to the limits instead.
+void step_engine_run(uint8_t axis, long pulse_delay, bool dir, bool bounded = true);
+
+// Step towards target at pulse_delay and stop on arrival.
+void step_engine_move_to(uint8_t axis, int target, long pulse_delay);
+
+// Stop at once. Any STEP pulse in progress is cut short.
+void step_engine_stop(uint8_t axis);
+// Cut the winding current of a stopped axis through its ENA pin; false while it
+// runs. The next run or move-to enables the driver again by itself, with
+// STEP_ENGINE_ENABLE_SETUP_US before its first step.
+bool step_engine_release(uint8_t axis);
+bool step_engine_released(uint8_t axis);
+// Ramp down to a stop from the current speed (index+1 steps of the ramp table).
+void step_engine_decelerate(uint8_t axis);
+
+bool step_engine_running(uint8_t axis);
+// Direction of the current (or last) motion: true = up
+bool step_engine_direction(uint8_t axis);
+int step_engine_position(uint8_t axis);
+// Current step rate in steps/s (0 when stopped)
+uint32_t step_engine_step_rate(uint8_t axis);
+// Total steps emitted since boot (wraps); used to measure the achieved step rate
+uint32_t step_engine_step_count(uint8_t axis);
+// The same, with the clock (hal_micros()) of that step's rising edge, read together
+uint32_t step_engine_last_step(uint8_t axis, uint32_t &rise_us);
+void step_engine_set_position(uint8_t axis, int pos);
+
+// Edge capture for homing: once armed, the next capture edge (the axis' sensor
+// GPIO interrupt, step_engine_capture_isr()) latches the position and step count
+// of the step that moved the carriage onto the mark.
+void step_engine_capture_arm(uint8_t axis);
+// ISR for hal_attach_falling() on the axis' sensor pin
+void (*step_engine_capture_isr(uint8_t axis))();
+// True once an armed capture has latched; the latch stays until the next arm
+bool step_engine_captured(uint8_t axis, int &position, uint32_t &step_count);
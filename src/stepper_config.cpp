@@ -1,5 +1,7 @@
 #include "stepper_config.h"
+#include "axis.h"
 
-const int STEPPER_POSITION_MIN = 0;
-const int STEPPER_POSITION_MAX = 1600;
+// Axis 0 soft limits; every axis has its own in AXIS_CONFIGS
+const int STEPPER_POSITION_MIN = AXIS_CONFIGS[0].min_pos;
+const int STEPPER_POSITION_MAX = AXIS_CONFIGS[0].max_pos;
 const unsigned long SEND_INTERVAL_MS = 100;
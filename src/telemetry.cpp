@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <algorithm>
+#include "telemetry.h"
+#include "step_engine.h"
+
+// Hands a frame to the axis' radio telemetry slot; true if it replaced an unsent frame
+extern bool send_telemetry(uint8_t axis, const uint8_t *frame, size_t len);
+
+constexpr unsigned long TELEMETRY_FAST_MS = 20;
+constexpr unsigned long TELEMETRY_MOVING_MS = 100;
+constexpr unsigned long TELEMETRY_IDLE_MS = 2000;
+constexpr int TELEMETRY_NEAR_TARGET_STEPS = 100;
+constexpr uint8_t TELEMETRY_FULL_EVERY = 16;
+
+struct TelemetryStream {
+  uint8_t seq = 0;
+  bool have_reference = false;
+  int16_t ref_position = 0; // what the GUI reconstructs from the frames sent so far
+  uint16_t ref_rate = 0;
+  uint8_t last_flags = 0xFF;
+  unsigned long last_sent_ms = 0;
+  uint8_t frames_since_full = 0;
+};
+
+static TelemetryStream streams[AXIS_COUNT];
+
+static unsigned long telemetry_interval(const StepperContext *ctx, uint16_t rate)
+{
+  uint16_t ref_rate = streams[ctx->axis].ref_rate;
+  if (ctx->state == STATE_IDLE || ctx->state == STATE_RESETTING) return TELEMETRY_IDLE_MS;
+  bool near_target = (ctx->state == STATE_MOVING_TO || ctx->state == STATE_TRAJECTORY) &&
+                     abs(ctx->move_target - ctx->position) <= TELEMETRY_NEAR_TARGET_STEPS;
+  bool ramping = abs((int)rate - (int)ref_rate) > (int)(rate / 8);
+  return (near_target || ramping) ? TELEMETRY_FAST_MS : TELEMETRY_MOVING_MS;
+}
+
+static bool send_full(uint8_t axis, uint8_t flags, int16_t position, uint16_t rate)
+{
+  TelemetryStream &s = streams[axis];
+  TelemetryFull frame;
+  frame.seq = s.seq++;
+  frame.kind = TELEMETRY_KIND_FULL;
+  frame.flags = flags;
+  frame.position = position;
+  frame.step_rate = rate;
+  s.ref_position = position;
+  s.ref_rate = rate;
+  s.have_reference = true;
+  s.frames_since_full = 0;
+  return send_telemetry(axis, (const uint8_t *)&frame, sizeof(frame));
+}
+
+// Returns false when the change does not fit a delta frame
+static bool try_send_delta(uint8_t axis, uint8_t flags, int16_t position, uint16_t rate, bool &replaced)
+{
+  TelemetryStream &s = streams[axis];
+  int position_delta = position - s.ref_position;
+  int rate_delta = ((int)rate - (int)s.ref_rate) / (int)TELEMETRY_RATE_DELTA_UNIT;
+  if (!s.have_reference || s.frames_since_full >= TELEMETRY_FULL_EVERY || position_delta < INT8_MIN ||
+      position_delta > INT8_MAX || rate_delta < INT8_MIN || rate_delta > INT8_MAX) {
+    return false;
+  }
+  TelemetryDelta frame;
+  frame.seq = s.seq++;
+  frame.kind = TELEMETRY_KIND_DELTA;
+  frame.flags = flags;
+  frame.position_delta = (int8_t)position_delta;
+  frame.rate_delta = (int8_t)rate_delta;
+  s.ref_position = position;
+  s.ref_rate = (uint16_t)((int)s.ref_rate + rate_delta * (int)TELEMETRY_RATE_DELTA_UNIT);
+  s.frames_since_full++;
+  replaced = send_telemetry(axis, (const uint8_t *)&frame, sizeof(frame));
+  return true;
+}
+
+void telemetry_update(const StepperContext *ctx, bool sensor_detected, unsigned long now_ms)
+{
+  uint8_t axis = ctx->axis;
+  TelemetryStream &s = streams[axis];
+  uint16_t rate = (uint16_t)std::min(step_engine_step_rate(axis), (uint32_t)UINT16_MAX);
+  uint8_t flags = (uint8_t)((ctx->state & TELEMETRY_FLAG_STATE_MASK) | (axis << TELEMETRY_FLAG_AXIS_SHIFT));
+  if (sensor_detected) flags |= TELEMETRY_FLAG_SENSOR;
+  if (step_engine_running(axis)) flags |= TELEMETRY_FLAG_RUNNING;
+
+  bool flags_changed = flags != s.last_flags;
+  if (!flags_changed && now_ms - s.last_sent_ms < telemetry_interval(ctx, rate)) return;
+  s.last_flags = flags;
+  s.last_sent_ms = now_ms;
+
+  int16_t position = (int16_t)ctx->position;
+  bool replaced = false;
+  if (!try_send_delta(axis, flags, position, rate, replaced)) {
+    send_full(axis, flags, position, rate);
+  } else if (replaced) {
+    // The superseded frame never went out, so the GUI cannot apply this delta
+    send_full(axis, flags, position, rate);
+  }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include "fsm.h"
+
+// Packed telemetry frames pushed to the GUI.
+// One frame carries position, FSM state, sensor state, current step rate and a
+// sequence number. After a full frame, small changes are sent as delta frames
+// relative to the previous frame; a full frame follows every
+// TELEMETRY_FULL_EVERY frames, on any delta overflow and whenever a queued frame
+// was superseded before it went on air. Byte 1 holds a frame kind outside the
+// command range and neither size equals sizeof(Message), so older GUIs that only
+// understand Message frames ignore them.
+//
+// Send rate adapts to the motion: TELEMETRY_FAST_MS while the speed is ramping or
+// a move is near its target, TELEMETRY_MOVING_MS at cruise, and a
+// TELEMETRY_IDLE_MS heartbeat when idle. State or sensor changes go out at once.
+//
+// Each axis has its own stream (sequence, reference and radio slot); the flags
+// name the axis, so axis 0 frames are unchanged.
+
+constexpr uint8_t TELEMETRY_KIND_FULL = 0xFE;
+constexpr uint8_t TELEMETRY_KIND_DELTA = 0xFD;
+
+// flags: bits 0-3 StepperState, bit 4 sensor (1 = mark detected), bit 5 engine running,
+// bits 6-7 axis
+constexpr uint8_t TELEMETRY_FLAG_STATE_MASK = 0x0F;
+constexpr uint8_t TELEMETRY_FLAG_SENSOR = 0x10;
+constexpr uint8_t TELEMETRY_FLAG_RUNNING = 0x20;
+constexpr uint8_t TELEMETRY_FLAG_AXIS_SHIFT = 6;
+static_assert(AXIS_MAX <= (0xFF >> TELEMETRY_FLAG_AXIS_SHIFT) + 1, "axis must fit the telemetry flags");
+// Delta frames carry the rate change in these units (steps/s)
+constexpr uint16_t TELEMETRY_RATE_DELTA_UNIT = 16;
+
+struct __attribute__((packed)) TelemetryFull {
+  uint8_t seq;
+  uint8_t kind; // TELEMETRY_KIND_FULL
+  uint8_t flags;
+  int16_t position;
+  uint16_t step_rate;
+};
+
+struct __attribute__((packed)) TelemetryDelta {
+  uint8_t seq;
+  uint8_t kind; // TELEMETRY_KIND_DELTA
+  uint8_t flags;
+  int8_t position_delta;
+  int8_t rate_delta; // x TELEMETRY_RATE_DELTA_UNIT
+};
+
+static_assert(sizeof(TelemetryFull) != sizeof(Message) && sizeof(TelemetryDelta) != sizeof(Message),
+              "telemetry frames must be distinguishable from Message by length");
+
+// Call every motion pass; sends a frame when the adaptive interval has elapsed
+void telemetry_update(const StepperContext *ctx, bool sensor_detected, unsigned long now_ms);
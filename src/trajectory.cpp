@@ -0,0 +1,58 @@
+#include "trajectory.h"
+
+struct Trajectory {
+  Waypoint waypoints[TRAJECTORY_CAPACITY];
+  size_t head;
+  size_t count;
+};
+
+static Trajectory trajectories[AXIS_COUNT];
+
+bool trajectory_push(uint8_t axis, const Waypoint &wp)
+{
+  Trajectory &t = trajectories[axis];
+  if (t.count == TRAJECTORY_CAPACITY) return false;
+  t.waypoints[(t.head + t.count) % TRAJECTORY_CAPACITY] = wp;
+  t.count++;
+  return true;
+}
+
+size_t trajectory_count(uint8_t axis)
+{
+  return trajectories[axis].count;
+}
+
+const Waypoint &trajectory_at(uint8_t axis, size_t i)
+{
+  const Trajectory &t = trajectories[axis];
+  return t.waypoints[(t.head + i) % TRAJECTORY_CAPACITY];
+}
+
+void trajectory_pop(uint8_t axis)
+{
+  Trajectory &t = trajectories[axis];
+  if (!t.count) return;
+  t.head = (t.head + 1) % TRAJECTORY_CAPACITY;
+  t.count--;
+}
+
+void trajectory_clear(uint8_t axis)
+{
+  trajectories[axis].head = 0;
+  trajectories[axis].count = 0;
+}
+
+int trajectory_blend_target(uint8_t axis, int position)
+{
+  int target = position;
+  int dir = 0;
+  for (size_t i = 0; i < trajectories[axis].count; ++i) {
+    const Waypoint &wp = trajectory_at(axis, i);
+    int step = wp.position > target ? 1 : wp.position < target ? -1 : 0;
+    if (step && dir && step != dir) break; // reversal: stop at the previous waypoint
+    if (step) dir = step;
+    target = wp.position;
+    if (wp.dwell_ms) break;
+  }
+  return target;
+}
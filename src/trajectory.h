@@ -0,0 +1,55 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "axis.h"
+
+// Waypoint buffer for pipelined multi-segment moves (STATE_TRAJECTORY).
+// CMD_WAYPOINT appends; the FSM runs the waypoints back to back. Consecutive
+// waypoints in the same direction without a dwell are passed at speed: the step
+// engine is aimed at the end of the run and the waypoints in between are only
+// reported as the carriage passes them. The motor stops at a waypoint with a
+// dwell, before a reversal and at the last waypoint. Each waypoint is reported
+// with one CMD_WAYPOINT_STATUS, including the waypoints a command that ends the
+// trajectory drops and those the command queue discards (WAYPOINT_CANCELLED).
+// One buffer per axis (axis.h). Motion task only.
+
+constexpr size_t TRAJECTORY_CAPACITY = 64;
+// CMD_WAYPOINT_STATUS value when the buffer was full (fits the axis value bits)
+constexpr int32_t WAYPOINT_REJECTED = AXIS_VALUE_MIN;
+// CMD_WAYPOINT_STATUS value when STOP, a jog, a move or homing dropped the waypoint
+constexpr int32_t WAYPOINT_CANCELLED = AXIS_VALUE_MIN + 1;
+// The dwell shares the param with the axis number (axis.h)
+constexpr uint16_t WAYPOINT_DWELL_MAX_MS = 0x0FFF;
+
+struct Waypoint {
+  int16_t position;
+  uint16_t dwell_ms;
+  uint8_t messageId; // of the CMD_WAYPOINT, echoed in CMD_WAYPOINT_STATUS
+};
+
+// param: the axis value (axis_value()), bits 0-15 position, bits 16-27 dwell
+inline Waypoint waypoint_from_param(int32_t param, uint8_t messageId)
+{
+  Waypoint wp;
+  wp.position = (int16_t)(param & 0xFFFF);
+  wp.dwell_ms = (uint16_t)(((uint32_t)param >> 16) & WAYPOINT_DWELL_MAX_MS);
+  wp.messageId = messageId;
+  return wp;
+}
+
+// Combine with axis_param() for axes other than 0
+inline int32_t waypoint_param(int16_t position, uint16_t dwell_ms)
+{
+  if (dwell_ms > WAYPOINT_DWELL_MAX_MS) dwell_ms = WAYPOINT_DWELL_MAX_MS;
+  return (int32_t)(((uint32_t)dwell_ms << 16) | (uint16_t)position);
+}
+
+// False when full
+bool trajectory_push(uint8_t axis, const Waypoint &wp);
+size_t trajectory_count(uint8_t axis);
+// i = 0 is the next waypoint to reach
+const Waypoint &trajectory_at(uint8_t axis, size_t i);
+void trajectory_pop(uint8_t axis);
+void trajectory_clear(uint8_t axis);
+// End of the run the engine can take without stopping, starting from position
+int trajectory_blend_target(uint8_t axis, int position);
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "tuning_table.h"
+#include "crc32.h"
+#include "deferred_log.h"
+#include "hal.h"
+
+struct TuningTable {
+  TuningPoint points[TUNING_CAPACITY + 1]; // one spare for an insert before the eviction
+  size_t count;
+  bool dirty;
+};
+
+constexpr size_t TUNING_BLOB_MAX = sizeof(TuningHeader) + TUNING_CAPACITY * sizeof(TuningPoint) + sizeof(uint32_t);
+
+// Changed by the motion task, written out by the service task
+static HalLock tuning_lock;
+static TuningTable tables[AXIS_COUNT];
+
+static void tuning_key(uint8_t axis, char *key, size_t len)
+{
+  snprintf(key, len, "tune%u", (unsigned)axis);
+}
+
+static size_t blob_size(size_t count)
+{
+  return sizeof(TuningHeader) + count * sizeof(TuningPoint) + sizeof(uint32_t);
+}
+
+static bool blob_valid(const uint8_t *blob, size_t size)
+{
+  TuningHeader header;
+  memcpy(&header, blob, sizeof(header));
+  if (header.version != TUNING_VERSION || header.count > TUNING_CAPACITY || size != blob_size(header.count)) {
+    return false;
+  }
+  uint32_t crc;
+  memcpy(&crc, blob + size - sizeof(crc), sizeof(crc));
+  if (crc != crc32_update(0, blob, size - sizeof(crc))) return false;
+  const TuningPoint *points = (const TuningPoint *)(blob + sizeof(header));
+  for (size_t i = 1; i < header.count; ++i) {
+    if (points[i].freq_hz <= points[i - 1].freq_hz) return false;
+  }
+  return true;
+}
+
+size_t tuning_load()
+{
+  size_t loaded = 0;
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+    TuningTable &t = tables[axis];
+    t.count = 0;
+    t.dirty = false;
+    char key[8];
+    tuning_key(axis, key, sizeof(key));
+    uint8_t blob[TUNING_BLOB_MAX];
+    size_t size = hal_nvs_blob_length(key);
+    if (size < blob_size(0) || size > sizeof(blob)) continue;
+    if (hal_nvs_get_blob(key, blob, size) != size || !blob_valid(blob, size)) {
+      LOG_WARN("[TUNE] axis %u: stored table is corrupt, starting empty", axis);
+      continue;
+    }
+    TuningHeader header;
+    memcpy(&header, blob, sizeof(header));
+    memcpy(t.points, blob + sizeof(header), header.count * sizeof(TuningPoint));
+    t.count = header.count;
+    loaded += t.count;
+  }
+  return loaded;
+}
+
+// Where freq_hz falls between lo and hi, 0..1, linear in 1/f^2
+static float tuning_weight(uint32_t lo_hz, uint32_t hi_hz, uint32_t freq_hz)
+{
+  // MHz keeps the squares well inside float range and precision
+  float lo = lo_hz / 1e6f;
+  float hi = hi_hz / 1e6f;
+  float f = freq_hz / 1e6f;
+  return (hi * hi * (f * f - lo * lo)) / (f * f * (hi * hi - lo * lo));
+}
+
+static int tuning_interpolate(const TuningPoint &lo, const TuningPoint &hi, uint32_t freq_hz)
+{
+  float w = tuning_weight(lo.freq_hz, hi.freq_hz, freq_hz);
+  return lo.position + (int)lroundf(w * (hi.position - lo.position));
+}
+
+bool tuning_lookup(uint8_t axis, uint32_t freq_hz, int &position)
+{
+  const TuningTable &t = tables[axis];
+  if (t.count < 2 || freq_hz < t.points[0].freq_hz || freq_hz > t.points[t.count - 1].freq_hz) return false;
+  const TuningPoint *hi = std::upper_bound(t.points, t.points + t.count, freq_hz,
+                                           [](uint32_t f, const TuningPoint &p) { return f < p.freq_hz; });
+  if (hi == t.points + t.count) hi--; // freq_hz is the last point
+  const TuningPoint *lo = hi - 1;
+  position = tuning_interpolate(*lo, *hi, freq_hz);
+  return true;
+}
+
+// Caller must hold tuning_lock
+static void erase_point(TuningTable &t, size_t i)
+{
+  memmove(&t.points[i], &t.points[i + 1], (t.count - i - 1) * sizeof(TuningPoint));
+  t.count--;
+}
+
+// Caller must hold tuning_lock; the point at keep stays
+static void evict_point(TuningTable &t, size_t keep)
+{
+  size_t best = 0;
+  int best_error = INT32_MAX;
+  for (size_t i = 1; i + 1 < t.count; ++i) {
+    if (i == keep) continue;
+    int error = abs(tuning_interpolate(t.points[i - 1], t.points[i + 1], t.points[i].freq_hz) - t.points[i].position);
+    if (error < best_error) {
+      best = i;
+      best_error = error;
+    }
+  }
+  if (best) erase_point(t, best);
+}
+
+size_t tuning_learn(uint8_t axis, uint32_t freq_hz, int position)
+{
+  TuningTable &t = tables[axis];
+  hal_lock(tuning_lock);
+  // A confirmation close to an existing point replaces it
+  for (size_t i = 0; i < t.count; ++i) {
+    uint32_t distance = t.points[i].freq_hz > freq_hz ? t.points[i].freq_hz - freq_hz : freq_hz - t.points[i].freq_hz;
+    if ((uint64_t)distance * 1000000U <= (uint64_t)freq_hz * TUNING_MERGE_PPM) {
+      erase_point(t, i);
+      break;
+    }
+  }
+  // Which way position runs with frequency, by the points already there
+  int dir = 0;
+  if (t.count >= 2) dir = t.points[t.count - 1].position > t.points[0].position ? 1 : -1;
+  size_t at = std::lower_bound(t.points, t.points + t.count, freq_hz,
+                               [](const TuningPoint &p, uint32_t f) { return p.freq_hz < f; }) - t.points;
+  memmove(&t.points[at + 1], &t.points[at], (t.count - at) * sizeof(TuningPoint));
+  t.points[at] = TuningPoint{freq_hz, (int16_t)position};
+  t.count++;
+  // Older points on the wrong side of the new one are stale
+  size_t dropped = 0;
+  while (dir && at > 0 && (t.points[at - 1].position - position) * dir > 0) {
+    erase_point(t, --at);
+    dropped++;
+  }
+  while (dir && at + 1 < t.count && (position - t.points[at + 1].position) * dir > 0) {
+    erase_point(t, at + 1);
+    dropped++;
+  }
+  if (t.count > TUNING_CAPACITY) evict_point(t, at);
+  t.dirty = true;
+  size_t count = t.count;
+  hal_unlock(tuning_lock);
+  LOG_INFO("[TUNE] axis %u: %u Hz at step %d, %u points", axis, freq_hz, position, (unsigned)count);
+  if (dropped) LOG_INFO("[TUNE] axis %u: dropped %u stale points", axis, (unsigned)dropped);
+  return count;
+}
+
+void tuning_clear(uint8_t axis)
+{
+  hal_lock(tuning_lock);
+  tables[axis].count = 0;
+  tables[axis].dirty = true;
+  hal_unlock(tuning_lock);
+  LOG_INFO("[TUNE] axis %u: table cleared", axis);
+}
+
+size_t tuning_count(uint8_t axis)
+{
+  return tables[axis].count;
+}
+
+TuningPoint tuning_at(uint8_t axis, size_t i)
+{
+  return tables[axis].points[i];
+}
+
+void tuning_service()
+{
+  for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+    TuningTable &t = tables[axis];
+    if (!t.dirty) continue;
+    uint8_t blob[TUNING_BLOB_MAX];
+    hal_lock(tuning_lock);
+    TuningHeader header = {TUNING_VERSION, (uint8_t)t.count};
+    memcpy(blob, &header, sizeof(header));
+    memcpy(blob + sizeof(header), t.points, t.count * sizeof(TuningPoint));
+    size_t size = blob_size(t.count);
+    t.dirty = false;
+    hal_unlock(tuning_lock);
+    uint32_t crc = crc32_update(0, blob, size - sizeof(crc));
+    memcpy(blob + size - sizeof(crc), &crc, sizeof(crc));
+    char key[8];
+    tuning_key(axis, key, sizeof(key));
+    if (!hal_nvs_put_blob(key, blob, size)) LOG_ERROR("[TUNE] axis %u: write failed", axis);
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "axis.h"
+
+// Frequency -> step calibration, so a band change is one move instead of a
+// jog hunt. Each axis keeps up to TUNING_CAPACITY confirmed points sorted by
+// frequency. CMD_MOVE_TO_FREQ looks the frequency up by binary search and
+// interpolates between the two points around it in 1/f^2, the capacitance a
+// resonance at f needs, so a few points per band are enough. Frequencies
+// outside the table are not extrapolated.
+//
+// CMD_TUNE_POINT confirms that the resting position is tuned to a frequency,
+// and the table learns from it:
+//  - a point within TUNING_MERGE_PPM of the frequency is replaced
+//  - neighbours that would make position non-monotonic in frequency are
+//    dropped, since the newest confirmation wins over older ones
+//  - when full, the interior point its neighbours predict best is evicted
+//
+// Each axis' table is stored as its own CRC-checked blob ("tune0", "tune1"..)
+// holding only the points in use, 6 bytes each. The motion task changes the
+// tables; the service task writes changed ones to NVS.
+
+constexpr size_t TUNING_CAPACITY = 32;
+constexpr uint32_t TUNING_MERGE_PPM = 500;
+constexpr uint8_t TUNING_VERSION = 1;
+// CMD_MOVE_TO_FREQ / CMD_TUNE_POINT reply value when nothing was done (fits the axis value bits)
+constexpr int32_t TUNING_REJECTED = AXIS_VALUE_MIN;
+// CMD_TUNE_POINT frequency that clears the axis' table instead
+constexpr int32_t TUNING_CLEAR = 0;
+
+struct __attribute__((packed)) TuningPoint {
+  uint32_t freq_hz;
+  int16_t position;
+};
+
+struct __attribute__((packed)) TuningHeader {
+  uint8_t version;
+  uint8_t count;
+};
+
+// Call once at boot after hal_nvs_begin(); returns the points loaded over all axes
+size_t tuning_load();
+// Position for freq_hz; false if the axis has no two points around it
+bool tuning_lookup(uint8_t axis, uint32_t freq_hz, int &position);
+// The axis rests tuned to freq_hz at position; returns the points in the table
+size_t tuning_learn(uint8_t axis, uint32_t freq_hz, int position);
+void tuning_clear(uint8_t axis);
+size_t tuning_count(uint8_t axis);
+TuningPoint tuning_at(uint8_t axis, size_t i);
+// Service task: write tables that changed
+void tuning_service();
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Decode binary log frames from the StepperController (built with -DLOG_BINARY=1).
+
+Each frame is: A5 5A | timestamp_us u32 | format address u32 | level u8 | nargs u8 | nargs x u32
+(all little endian). Format strings and %s arguments are looked up by address in
+the firmware ELF, so use the .elf from the same build that produced the capture.
+
+Usage:
+    python tools/log_decode.py .pio/build/esp32dev/firmware.elf capture.bin
+    python tools/log_decode.py .pio/build/esp32dev/firmware.elf - < capture.bin
+"""
+import re
+import struct
+import sys
+
+SYNC = b"\xA5\x5A"
+LEVELS = {1: "E", 2: "W", 3: "I", 4: "D"}
+SPEC = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(l*)([diuxXcs%])")
+
+
+class Elf32:
+    """Minimal little-endian ELF32 reader: maps addresses to section contents."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF" or self.data[4] != 1:
+            raise ValueError("%s is not a 32-bit ELF file" % path)
+        shoff, = struct.unpack_from("<I", self.data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", self.data, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, _, addr, offset, size = struct.unpack_from("<IIIIII", self.data, shoff + i * shentsize)
+            if sh_type == 1 and addr and size:  # SHT_PROGBITS with a load address
+                self.sections.append((addr, offset, size))
+
+    def string_at(self, addr):
+        for base, offset, size in self.sections:
+            if base <= addr < base + size:
+                start = offset + (addr - base)
+                end = self.data.index(b"\0", start, offset + size)
+                return self.data[start:end].decode("utf-8", "replace")
+        return "<0x%08X>" % addr
+
+
+def format_record(elf, fmt, args):
+    it = iter(args)
+
+    def repl(m):
+        flags, _, conv = m.groups()
+        if conv == "%":
+            return "%"
+        value = next(it, 0)
+        if conv in "di":
+            return ("%" + flags + "d") % struct.unpack("<i", struct.pack("<I", value))[0]
+        if conv == "s":
+            return ("%" + flags + "s") % (elf.string_at(value) if value else "(null)")
+        if conv == "c":
+            return chr(value & 0xFF)
+        return ("%" + flags + conv) % value
+
+    return SPEC.sub(repl, fmt)
+
+
+def decode(elf, stream, out):
+    buf = stream.read()
+    pos = 0
+    while True:
+        pos = buf.find(SYNC, pos)
+        if pos < 0 or pos + 12 > len(buf):
+            break
+        ts, fmt_addr, level, nargs = struct.unpack_from("<IIBB", buf, pos + 2)
+        end = pos + 12 + 4 * nargs
+        if nargs > 4 or end > len(buf):
+            pos += 1
+            continue
+        args = struct.unpack_from("<%dI" % nargs, buf, pos + 12)
+        text = format_record(elf, elf.string_at(fmt_addr), args)
+        out.write("%s (%d) %s\n" % (LEVELS.get(level, "D"), ts // 1000, text))
+        pos = end
+
+
+def main(argv):
+    if len(argv) != 3:
+        sys.stderr.write(__doc__)
+        return 2
+    elf = Elf32(argv[1])
+    stream = sys.stdin.buffer if argv[2] == "-" else open(argv[2], "rb")
+    with stream:
+        decode(elf, stream, sys.stdout)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))